@@ -0,0 +1,646 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../src/procstat.h"
+
+/*
+ * Every benchmark runs single threaded and with N threads (second argument, number of online CPUs by default).
+ * Threads record into one shared object when the object supports concurrent writers (sharded histograms,
+ * per-cpu counters), and into an object of their own otherwise. ns/op is the wall time of the run divided by
+ * the iterations of each thread, misses/op are the user space cache misses of all the threads per iteration.
+ */
+#define BENCH_ITERATIONS 10000000UL
+#define BENCH_MAX_THREADS 64
+#define BENCH_MOUNTPOINT "/tmp/procstat_bench"
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+typedef void (*bench_fn)(void *arg, unsigned thread, unsigned long iterations);
+
+struct bench {
+	const char 		*name;
+	bench_fn 		fn;
+	void 			*arg;
+	unsigned long 		iterations; /* per thread */
+	pthread_barrier_t 	barrier;
+	uint64_t 		start;
+	uint64_t 		end;
+};
+
+struct bench_thread {
+	struct bench 		*bench;
+	pthread_t 		thread;
+	unsigned 		id;
+	bool 			counted;
+	uint64_t 		misses;
+};
+
+/* -1 when hardware counters are not available, e.g. in a VM or with perf_event_paranoid > 2 */
+static int perf_cache_misses_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	int error = pthread_create(thread, NULL, fn, arg);
+
+	if (error) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(error));
+		exit(1);
+	}
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *thread = arg;
+	struct bench *bench = thread->bench;
+	int fd = perf_cache_misses_open();
+
+	pthread_barrier_wait(&bench->barrier);
+	if (!thread->id)
+		bench->start = now_ns();
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	bench->fn(bench->arg, thread->id, bench->iterations);
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		thread->counted = read(fd, &thread->misses, sizeof(thread->misses)) == sizeof(thread->misses);
+		close(fd);
+	}
+	pthread_barrier_wait(&bench->barrier);
+	if (!thread->id)
+		bench->end = now_ns();
+	return NULL;
+}
+
+static void run_bench(const char *name, bench_fn fn, void *arg, unsigned long iterations, unsigned nthreads)
+{
+	struct bench_thread threads[BENCH_MAX_THREADS];
+	struct bench bench = {.name = name, .fn = fn, .arg = arg, .iterations = iterations};
+	uint64_t misses = 0;
+	bool counted = true;
+	char label[128];
+	unsigned i;
+
+	pthread_barrier_init(&bench.barrier, NULL, nthreads);
+	for (i = 0; i < nthreads; ++i) {
+		threads[i].bench = &bench;
+		threads[i].id = i;
+		threads[i].counted = false;
+		threads[i].misses = 0;
+		start_thread(&threads[i].thread, bench_thread, &threads[i]);
+	}
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i].thread, NULL);
+		counted &= threads[i].counted;
+		misses += threads[i].misses;
+	}
+	pthread_barrier_destroy(&bench.barrier);
+
+	snprintf(label, sizeof(label), "%s/threads:%u", name, nthreads);
+	if (counted)
+		printf("%-72s %10.2f ns/op %10.3f misses/op\n", label, (double)(bench.end - bench.start) / iterations,
+		       (double)misses / ((double)iterations * nthreads));
+	else
+		printf("%-72s %10.2f ns/op %10s misses/op\n", label, (double)(bench.end - bench.start) / iterations, "n/a");
+}
+
+static void run_bench_threads(const char *name, bench_fn fn, void *arg, unsigned long iterations, unsigned nthreads)
+{
+	run_bench(name, fn, arg, iterations, 1);
+	if (nthreads > 1)
+		run_bench(name, fn, arg, iterations, nthreads);
+}
+
+static void clock_gettime_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	struct timespec ts;
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+}
+
+/* series have a single writer, every thread records into its own, on cache lines of its own */
+struct thread_series {
+	struct procstat_series_u64 series;
+} __attribute__((aligned(PROCSTAT_CACHELINE_SIZE)));
+
+static struct thread_series series[BENCH_MAX_THREADS];
+
+static void series_init(int reset_interval)
+{
+	unsigned i;
+
+	memset(series, 0, sizeof(series));
+	for (i = 0; i < BENCH_MAX_THREADS; ++i) {
+		series[i].series.min = ULLONG_MAX;
+		procstat_u64_series_set_reset_interval(&series[i].series, reset_interval);
+	}
+}
+
+static void series_add_point_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		procstat_u64_series_add_point(&series[thread].series, i & 0xffff);
+	assert(series[thread].series.count);
+}
+
+#define BENCH_BATCH 64
+
+static void series_add_points_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	uint64_t values[BENCH_BATCH];
+	unsigned long i;
+	int j;
+
+	for (j = 0; j < BENCH_BATCH; ++j)
+		values[j] = (j * 7919) & 0xffff;
+	for (i = 0; i < iterations; i += BENCH_BATCH)
+		procstat_u64_series_add_points(&series[thread].series, values, BENCH_BATCH);
+	assert(series[thread].series.count);
+}
+
+static void bench_series(unsigned nthreads)
+{
+	series_init(0);
+	run_bench_threads("procstat_u64_series_add_point", series_add_point_fn, NULL, BENCH_ITERATIONS, nthreads);
+	series_init(3600);
+	run_bench_threads("procstat_u64_series_add_point/reset_interval", series_add_point_fn, NULL,
+			  BENCH_ITERATIONS, nthreads);
+	series_init(0);
+	run_bench_threads("procstat_u64_series_add_points/64 (per point)", series_add_points_fn, NULL,
+			  BENCH_ITERATIONS, nthreads);
+}
+
+/* an unsharded histogram has a single writer, every thread records into its own */
+struct thread_histogram {
+	struct procstat_histogram_u32 histogram;
+} __attribute__((aligned(PROCSTAT_CACHELINE_SIZE)));
+
+static struct thread_histogram histograms[BENCH_MAX_THREADS];
+
+static void histogram_add_point_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	struct procstat_histogram_u32 *histogram = arg ? arg : &histograms[thread].histogram;
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		procstat_histogram_u32_add_point(histogram, i & 0xffff);
+}
+
+static void histogram_add_points_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	struct procstat_histogram_u32 *histogram = arg ? arg : &histograms[thread].histogram;
+	uint32_t values[BENCH_BATCH];
+	unsigned long i;
+	int j;
+
+	for (j = 0; j < BENCH_BATCH; ++j)
+		values[j] = (j * 7919) & 0xffff;
+	for (i = 0; i < iterations; i += BENCH_BATCH)
+		procstat_histogram_u32_add_points(histogram, values, BENCH_BATCH);
+}
+
+static void bench_histogram(struct procstat_context *context, unsigned nthreads)
+{
+	struct procstat_histogram_u32 sharded = {.percentile = {{.fraction = 0.5f}}, .npercentile = 1,
+						 .nshards = nthreads};
+	unsigned i;
+
+	memset(histograms, 0, sizeof(histograms));
+	for (i = 0; i < nthreads; ++i) {
+		histograms[i].histogram.histogram = calloc(PROCSTAT_PERCENTILE_ARR_NR, sizeof(uint32_t));
+		assert(histograms[i].histogram.histogram);
+	}
+	run_bench_threads("procstat_histogram_u32_add_point", histogram_add_point_fn, NULL,
+			  BENCH_ITERATIONS, nthreads);
+	run_bench_threads("procstat_histogram_u32_add_points/64 (per point)", histogram_add_points_fn, NULL,
+			  BENCH_ITERATIONS, nthreads);
+	for (i = 0; i < nthreads; ++i)
+		free(histograms[i].histogram.histogram);
+
+	/* shards are allocated on registration, all the threads record into the same histogram */
+	if (!context || procstat_create_histogram_u32_series(context, NULL, "bench_sharded_histogram", &sharded))
+		return;
+	run_bench_threads("procstat_histogram_u32_add_point/sharded", histogram_add_point_fn, &sharded,
+			  BENCH_ITERATIONS, nthreads);
+	procstat_remove_by_name(context, NULL, "bench_sharded_histogram");
+}
+
+static struct procstat_percpu_u64 percpu_counter;
+
+static void percpu_inc_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		procstat_percpu_inc(&percpu_counter);
+}
+
+static void bench_percpu(struct procstat_context *context, unsigned nthreads)
+{
+	if (!context || procstat_create_percpu_u64(context, NULL, "bench_percpu", &percpu_counter))
+		return;
+	run_bench_threads("procstat_percpu_inc", percpu_inc_fn, NULL, BENCH_ITERATIONS, nthreads);
+	procstat_remove_by_name(context, NULL, "bench_percpu");
+}
+
+#define BENCH_PERCENTILE_ITERATIONS 100000UL
+
+static uint32_t percentile_histogram[PROCSTAT_PERCENTILE_ARR_NR];
+static uint64_t percentile_count;
+
+static void percentile_calculate_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	struct procstat_percentile_result result[] = {{.fraction = 0.5f}, {.fraction = 0.9f},
+						      {.fraction = 0.99f}, {.fraction = 0.999f}};
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		procstat_percentile_calculate(percentile_histogram, percentile_count, result, 4);
+	assert(result[0].value);
+}
+
+/* the histogram is shared and only read, every thread calculates into its own results */
+static void bench_percentile(unsigned nthreads)
+{
+	unsigned long i;
+
+	for (i = 0; i < 1000000; ++i)
+		procstat_hist_add_point(percentile_histogram, (i * 7919) % 100000 + 1);
+	percentile_count = 1000000;
+	run_bench_threads("procstat_percentile_calculate/4 percentiles", percentile_calculate_fn, NULL,
+			  BENCH_PERCENTILE_ITERATIONS, nthreads);
+}
+
+#define BENCH_FORMAT_VALUES 1024
+
+struct format_bench {
+	procstats_formatter 	formatter;
+	void 			*values;
+	size_t 			value_size;
+};
+
+static void format_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	struct format_bench *format = arg;
+	uint64_t checksum = 0;
+	char buffer[32];
+	unsigned long i;
+
+	for (i = 0; i < iterations; ++i)
+		checksum += format->formatter((char *)format->values + (i % BENCH_FORMAT_VALUES) * format->value_size,
+					      0, buffer, sizeof(buffer));
+	assert(checksum);
+}
+
+static ssize_t snprintf_u64_decimal(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return snprintf(buffer, len, "%lu\n", *(uint64_t *)object);
+}
+
+static ssize_t snprintf_u64_hex(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return snprintf(buffer, len, "%lx\n", *(uint64_t *)object);
+}
+
+static ssize_t snprintf_int_decimal(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return snprintf(buffer, len, "%d\n", *(int *)object);
+}
+
+/* values of every magnitude, as found in a scrape of counters, sums and latencies; shared by the threads */
+static void bench_formatters(unsigned nthreads)
+{
+	static uint64_t values_u64[BENCH_FORMAT_VALUES];
+	static uint32_t values_u32[BENCH_FORMAT_VALUES];
+	static int values_int[BENCH_FORMAT_VALUES];
+	struct {
+		const char 		*name;
+		struct format_bench 	format;
+	} *entry, formatters[] = {
+		{"snprintf(\"%lu\\n\")", {snprintf_u64_decimal, values_u64, sizeof(uint64_t)}},
+		{"procstat_format_u64_decimal", {procstat_format_u64_decimal, values_u64, sizeof(uint64_t)}},
+		{"snprintf(\"%lx\\n\")", {snprintf_u64_hex, values_u64, sizeof(uint64_t)}},
+		{"procstat_format_u64_hex", {procstat_format_u64_hex, values_u64, sizeof(uint64_t)}},
+		{"procstat_format_u64_address", {procstat_format_u64_address, values_u64, sizeof(uint64_t)}},
+		{"procstat_format_u32_decimal", {procstat_format_u32_decimal, values_u32, sizeof(uint32_t)}},
+		{"procstat_format_u32_hex", {procstat_format_u32_hex, values_u32, sizeof(uint32_t)}},
+		{"snprintf(\"%d\\n\")", {snprintf_int_decimal, values_int, sizeof(int)}},
+		{"procstat_format_int_decimal", {procstat_format_int_decimal, values_int, sizeof(int)}},
+	};
+	unsigned i;
+
+	for (i = 0; i < BENCH_FORMAT_VALUES; ++i) {
+		values_u64[i] = (i * 0x9e3779b97f4a7c15UL) >> (i % 64);
+		values_u32[i] = values_u64[i];
+		values_int[i] = values_u64[i];
+	}
+	for (entry = formatters; entry < formatters + sizeof(formatters) / sizeof(*formatters); ++entry)
+		run_bench_threads(entry->name, format_fn, &entry->format, BENCH_ITERATIONS, nthreads);
+}
+
+#define BENCH_REGISTER_ITERATIONS 100000UL
+
+struct register_bench {
+	struct procstat_context *context;
+	struct procstat_item 	*directory;
+};
+
+/* every iteration registers a stat next to the siblings and removes it, names are unique per thread */
+static void register_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	struct register_bench *bench = arg;
+	static uint64_t value;
+	unsigned long i;
+	char name[32];
+	int error;
+
+	for (i = 0; i < iterations; ++i) {
+		snprintf(name, sizeof(name), "thread_%u_%lu", thread, i & 0xff);
+		error = procstat_create_u64(bench->context, bench->directory, name, &value);
+		assert(!error);
+		error = procstat_remove_by_name(bench->context, bench->directory, name);
+		assert(!error);
+	}
+}
+
+static void bench_register(struct procstat_context *context, unsigned nsiblings, unsigned nthreads)
+{
+	struct register_bench bench = {.context = context};
+	static uint64_t value;
+	char name[64];
+	unsigned i;
+
+	if (!context)
+		return;
+	snprintf(name, sizeof(name), "siblings_%u", nsiblings);
+	bench.directory = procstat_create_directory(context, NULL, name);
+	assert(bench.directory);
+	for (i = 0; i < nsiblings; ++i) {
+		snprintf(name, sizeof(name), "sibling_%u", i);
+		procstat_create_u64(context, bench.directory, name, &value);
+	}
+
+	snprintf(name, sizeof(name), "procstat_create_u64+procstat_remove_by_name/siblings:%u", nsiblings);
+	run_bench_threads(name, register_fn, &bench, BENCH_REGISTER_ITERATIONS, nthreads);
+	procstat_remove(context, bench.directory);
+}
+
+#define BENCH_AGGREGATOR_STATS 1000
+#define BENCH_AGGREGATOR_ITERATIONS 1000UL
+
+struct aggregator_bench {
+	const char 	*path;
+	bool 		failed;
+};
+
+/* every iteration opens the aggregator and reads it whole, as a scraper would */
+static void aggregator_fn(void *arg, unsigned thread, unsigned long iterations)
+{
+	struct aggregator_bench *bench = arg;
+	char buffer[64 * 1024];
+	unsigned long i;
+	ssize_t len;
+	int fd;
+
+	for (i = 0; i < iterations; ++i) {
+		fd = open(bench->path, O_RDONLY);
+		if (fd < 0) {
+			bench->failed = true;
+			return;
+		}
+		do {
+			len = read(fd, buffer, sizeof(buffer));
+		} while (len > 0);
+		close(fd);
+	}
+}
+
+/* served by the fuse workers, only the misses of the reading threads are counted */
+static void bench_aggregator(struct procstat_context *context, const char *mountpoint, unsigned nthreads)
+{
+	static uint64_t values[BENCH_AGGREGATOR_STATS];
+	static struct procstat_series_u64 aggregated_series[BENCH_AGGREGATOR_STATS / 10];
+	struct aggregator_bench bench = {0};
+	struct procstat_item *directory;
+	char path[PATH_MAX];
+	char name[64];
+	unsigned i;
+
+	if (!context)
+		return;
+	directory = procstat_create_directory(context, NULL, "aggregated");
+	assert(directory);
+	for (i = 0; i < BENCH_AGGREGATOR_STATS; ++i) {
+		values[i] = i * 1000;
+		snprintf(name, sizeof(name), "value_%u", i);
+		procstat_create_u64(context, directory, name, &values[i]);
+	}
+	for (i = 0; i < BENCH_AGGREGATOR_STATS / 10; ++i) {
+		snprintf(name, sizeof(name), "series_%u", i);
+		procstat_create_u64_series(context, directory, name, &aggregated_series[i]);
+		procstat_u64_series_add_point(&aggregated_series[i], i);
+	}
+	procstat_create_aggregator(context, directory, "aggregator");
+	procstat_create_snapshot_aggregator(context, directory, "snapshot");
+
+	bench.path = path;
+	snprintf(path, sizeof(path), "%s/aggregated/aggregator", mountpoint);
+	aggregator_fn(&bench, 0, 1);
+	if (bench.failed) {
+		printf("%-72s skipped, cannot read %s\n", "aggregator", path);
+		goto out;
+	}
+	run_bench_threads("procstat_create_aggregator read/1000 values+100 series", aggregator_fn, &bench,
+			  BENCH_AGGREGATOR_ITERATIONS, nthreads);
+	snprintf(path, sizeof(path), "%s/aggregated/snapshot", mountpoint);
+	run_bench_threads("procstat_create_snapshot_aggregator read/1000 values+100 series", aggregator_fn, &bench,
+			  BENCH_AGGREGATOR_ITERATIONS, nthreads);
+out:
+	procstat_remove(context, directory);
+}
+
+#define BENCH_READ_FILES 64
+#define BENCH_READERS 8
+#define BENCH_READ_SEC 2
+
+struct read_bench {
+	struct procstat_context *context;
+	const char 		*mountpoint;
+	unsigned 		nthreads;
+	volatile bool 		stop;
+};
+
+struct bench_reader {
+	struct read_bench 	*bench;
+	pthread_t 		thread;
+	unsigned 		id;
+	uint64_t 		reads;
+};
+
+static void *bench_loop(void *arg)
+{
+	struct read_bench *bench = arg;
+
+	procstat_loop_mt(bench->context, bench->nthreads);
+	return NULL;
+}
+
+static bool bench_read_file(const char *mountpoint, unsigned i)
+{
+	char path[PATH_MAX];
+	char buffer[64];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/bench/value_%u", mountpoint, i % BENCH_READ_FILES);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	len = read(fd, buffer, sizeof(buffer));
+	close(fd);
+	return len > 0;
+}
+
+static void *bench_reader(void *arg)
+{
+	struct bench_reader *reader = arg;
+	unsigned i;
+
+	for (i = reader->id; !reader->bench->stop; ++i) {
+		if (bench_read_file(reader->bench->mountpoint, i))
+			++reader->reads;
+	}
+	return NULL;
+}
+
+/* aggregate throughput of BENCH_READERS concurrent readers of the mount, served by @nthreads workers */
+static void bench_fuse_read(const char *mountpoint, unsigned nthreads)
+{
+	static uint64_t values[BENCH_READ_FILES];
+	struct bench_reader readers[BENCH_READERS];
+	struct procstat_item *directory;
+	struct read_bench bench;
+	pthread_t loop;
+	uint64_t start, elapsed, reads = 0;
+	char name[32];
+	unsigned i;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.mountpoint = mountpoint;
+	bench.nthreads = nthreads;
+	bench.context = procstat_create(mountpoint);
+	if (!bench.context) {
+		printf("%-72s skipped, cannot mount %s\n", "fuse read", mountpoint);
+		return;
+	}
+
+	directory = procstat_create_directory(bench.context, NULL, "bench");
+	assert(directory);
+	for (i = 0; i < BENCH_READ_FILES; ++i) {
+		values[i] = i;
+		snprintf(name, sizeof(name), "value_%u", i);
+		procstat_create_u64(bench.context, directory, name, &values[i]);
+	}
+
+	start_thread(&loop, bench_loop, &bench);
+	start = now_ns();
+	for (i = 0; i < BENCH_READERS; ++i) {
+		readers[i].bench = &bench;
+		readers[i].id = i;
+		readers[i].reads = 0;
+		start_thread(&readers[i].thread, bench_reader, &readers[i]);
+	}
+	sleep(BENCH_READ_SEC);
+	bench.stop = true;
+	for (i = 0; i < BENCH_READERS; ++i)
+		pthread_join(readers[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	/* the workers wait for a request, the last read lets them see the loop was stopped */
+	procstat_stop(bench.context);
+	bench_read_file(mountpoint, 0);
+	pthread_join(loop, NULL);
+	procstat_destroy(bench.context);
+
+	for (i = 0; i < BENCH_READERS; ++i)
+		reads += readers[i].reads;
+	snprintf(name, sizeof(name), "fuse read, %u worker thread(s)", nthreads);
+	printf("%-72s %10.0f reads/s\n", name, reads * 1e9 / elapsed);
+}
+
+/* usage: bench [mountpoint] [threads] */
+int main(int argc, char **argv)
+{
+	const char *mountpoint = argc > 1 ? argv[1] : BENCH_MOUNTPOINT;
+	long nthreads = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	struct read_bench context_bench;
+	pthread_t loop;
+	unsigned n;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > BENCH_MAX_THREADS)
+		nthreads = BENCH_MAX_THREADS;
+
+	run_bench("clock_gettime(CLOCK_MONOTONIC_COARSE)", clock_gettime_fn, NULL, BENCH_ITERATIONS, 1);
+	bench_series(nthreads);
+	bench_percentile(nthreads);
+	bench_formatters(nthreads);
+
+	/* registration, sharded stats and aggregators need a context, whose workers serve the aggregator reads */
+	memset(&context_bench, 0, sizeof(context_bench));
+	context_bench.mountpoint = mountpoint;
+	context_bench.nthreads = 4;
+	context_bench.context = procstat_create(mountpoint);
+	if (!context_bench.context)
+		printf("%-72s skipped, cannot mount %s\n", "registration, sharded stats and aggregators", mountpoint);
+	bench_histogram(context_bench.context, nthreads);
+	if (context_bench.context) {
+		start_thread(&loop, bench_loop, &context_bench);
+		bench_percpu(context_bench.context, nthreads);
+		bench_register(context_bench.context, 1000, nthreads);
+		bench_register(context_bench.context, 100000, nthreads);
+		bench_aggregator(context_bench.context, mountpoint, nthreads);
+		procstat_stop(context_bench.context);
+		bench_read_file(mountpoint, 0);
+		pthread_join(loop, NULL);
+		procstat_destroy(context_bench.context);
+	}
+
+	for (n = 1; n <= BENCH_READERS; n *= 2)
+		bench_fuse_read(mountpoint, n);
+	return 0;
+}
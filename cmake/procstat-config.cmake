@@ -21,7 +21,7 @@ find_package_handle_standard_args(Procstat DEFAULT_MSG
 # like a best practice. I'm not sure I understand the documentation:
 # https://cmake.org/cmake/help/v3.12/manual/cmake-developer.7.html#modules
 if(Procstat_FOUND)
-  set(Procstat_LIBRARIES ${Procstat_LIBRARY})
+  set(Procstat_LIBRARIES ${Procstat_LIBRARY} fuse pthread m rt)
   set(Procstat_INCLUDE_DIRS ${Procstat_INCLUDE_DIR})
   message("GOT ${Procstat_INCLUDE_DIR}")
 endif()
@@ -31,5 +31,6 @@ if(Procstat_FOUND AND NOT TARGET Procstat::Procstat)
   set_target_properties(Procstat::Procstat PROPERTIES
     IMPORTED_LOCATION "${Procstat_LIBRARY}"
     INTERFACE_INCLUDE_DIRECTORIES "${Procstat_INCLUDE_DIR}"
+    INTERFACE_LINK_LIBRARIES "fuse;pthread;m;rt"
   )
 endif()
@@ -35,6 +35,10 @@
 #include <memory.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 /*
  * Given a number, return the index of the corresponding bucket in
@@ -108,6 +112,155 @@ uint32_t procstat_percentile_idx_to_val(unsigned int idx)
 	return base + ((k + 0.5) * (1 << error_bits));
 }
 
+/* largest value of bucket @idx of a histogram with @bucket_bits, wraps to UINT64_MAX for the very last */
+static uint64_t index_upper_bound(unsigned bucket_bits, unsigned int idx)
+{
+	unsigned int error_bits, k;
+	uint64_t base;
+
+	if (idx < (2U << bucket_bits))
+		return idx;
+
+	error_bits = (idx >> bucket_bits) - 1;
+	base = 1ULL << (error_bits + bucket_bits);
+	k = idx & ((1U << bucket_bits) - 1);
+	return base + ((uint64_t)(k + 1) << error_bits) - 1;
+}
+
+uint64_t procstat_hist_index_upper_bound(unsigned int idx)
+{
+	assert(idx < PROCSTAT_PERCENTILE_ARR_NR);
+
+	return index_upper_bound(PROCSTAT_BUCKET_BITS, idx);
+}
+
+
+static void values_to_index_scalar(const uint32_t *values, uint32_t *index, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		index[i] = percentile_value_to_index(values[i]);
+}
+
+#ifdef __x86_64__
+/*
+ * Vector versions of percentile_value_to_index(). All lanes go through the
+ * group computation, and lanes with MSB <= PROCSTAT_BUCKET_BITS are blended
+ * back to the value itself.
+ */
+__attribute__((target("avx512f,avx512cd")))
+static void values_to_index_avx512(const uint32_t *values, uint32_t *index, size_t n)
+{
+	const __m512i bucket_mask = _mm512_set1_epi32(PROCSTAT_BUCKET_VALUES - 1);
+	const __m512i last = _mm512_set1_epi32(PROCSTAT_PERCENTILE_ARR_NR - 1);
+	const __m512i bucket_bits = _mm512_set1_epi32(PROCSTAT_BUCKET_BITS);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512i top_bit = _mm512_set1_epi32(31);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m512i val = _mm512_loadu_si512((const void *)&values[i]);
+		/* msb is -1 for zero, which is handled as small value below */
+		__m512i msb = _mm512_sub_epi32(top_bit, _mm512_lzcnt_epi32(val));
+		__m512i error_bits = _mm512_sub_epi32(msb, bucket_bits);
+		__m512i base = _mm512_slli_epi32(_mm512_add_epi32(error_bits, one), PROCSTAT_BUCKET_BITS);
+		__m512i offset = _mm512_and_si512(_mm512_srlv_epi32(val, error_bits), bucket_mask);
+		__m512i idx = _mm512_min_epu32(_mm512_add_epi32(base, offset), last);
+		__mmask16 small = _mm512_cmple_epi32_mask(msb, bucket_bits);
+
+		_mm512_storeu_si512((void *)&index[i], _mm512_mask_blend_epi32(small, idx, val));
+	}
+
+	values_to_index_scalar(&values[i], &index[i], n - i);
+}
+
+/*
+ * avx2 has no lzcnt, so msb is taken from the float exponent of the isolated top bit,
+ * which converts to float exactly.
+ */
+__attribute__((target("avx2")))
+static void values_to_index_avx2(const uint32_t *values, uint32_t *index, size_t n)
+{
+	const __m256i bucket_mask = _mm256_set1_epi32(PROCSTAT_BUCKET_VALUES - 1);
+	const __m256i last = _mm256_set1_epi32(PROCSTAT_PERCENTILE_ARR_NR - 1);
+	const __m256i small_limit = _mm256_set1_epi32(PROCSTAT_BUCKET_BITS + 1);
+	const __m256i bucket_bits = _mm256_set1_epi32(PROCSTAT_BUCKET_BITS);
+	const __m256i exponent_mask = _mm256_set1_epi32(0xff);
+	const __m256i exponent_bias = _mm256_set1_epi32(127);
+	const __m256i one = _mm256_set1_epi32(1);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i val = _mm256_loadu_si256((const __m256i *)&values[i]);
+		__m256i smear = val;
+		__m256i top, exponent, msb, error_bits, base, offset, idx, small;
+
+		smear = _mm256_or_si256(smear, _mm256_srli_epi32(smear, 1));
+		smear = _mm256_or_si256(smear, _mm256_srli_epi32(smear, 2));
+		smear = _mm256_or_si256(smear, _mm256_srli_epi32(smear, 4));
+		smear = _mm256_or_si256(smear, _mm256_srli_epi32(smear, 8));
+		smear = _mm256_or_si256(smear, _mm256_srli_epi32(smear, 16));
+		top = _mm256_xor_si256(smear, _mm256_srli_epi32(smear, 1));
+
+		/* bit 31 converts to negative float, its exponent is still 31 */
+		exponent = _mm256_castps_si256(_mm256_cvtepi32_ps(top));
+		exponent = _mm256_and_si256(_mm256_srli_epi32(exponent, 23), exponent_mask);
+		msb = _mm256_sub_epi32(exponent, exponent_bias);
+
+		error_bits = _mm256_sub_epi32(msb, bucket_bits);
+		base = _mm256_slli_epi32(_mm256_add_epi32(error_bits, one), PROCSTAT_BUCKET_BITS);
+		offset = _mm256_and_si256(_mm256_srlv_epi32(val, error_bits), bucket_mask);
+		idx = _mm256_min_epu32(_mm256_add_epi32(base, offset), last);
+		small = _mm256_cmpgt_epi32(small_limit, msb);
+
+		_mm256_storeu_si256((__m256i *)&index[i], _mm256_blendv_epi8(idx, val, small));
+	}
+
+	values_to_index_scalar(&values[i], &index[i], n - i);
+}
+#endif
+
+typedef void (*values_to_index_fn)(const uint32_t *values, uint32_t *index, size_t n);
+
+static values_to_index_fn values_to_index_select(void)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd"))
+		return values_to_index_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return values_to_index_avx2;
+#endif
+	return values_to_index_scalar;
+}
+
+void procstat_hist_values_to_index(const uint32_t *values, uint32_t *index, size_t n)
+{
+	static values_to_index_fn values_to_index;
+
+	if (!values_to_index)
+		values_to_index = values_to_index_select();
+	values_to_index(values, index, n);
+}
+
+#define HIST_BATCH_SIZE 64
+void procstat_hist_add_points(uint32_t *histogram, const uint32_t *values, size_t n)
+{
+	uint32_t index[HIST_BATCH_SIZE];
+	size_t batch, i;
+
+	for (; n; n -= batch, values += batch) {
+		batch = n < HIST_BATCH_SIZE ? n : HIST_BATCH_SIZE;
+		procstat_hist_values_to_index(values, index, batch);
+		for (i = 0; i < batch; ++i)
+			++histogram[index[i]];
+	}
+}
+
+unsigned int procstat_hist_value_to_index(uint32_t value)
+{
+	return percentile_value_to_index(value);
+}
 
 void procstat_hist_add_point(uint32_t *histogram, uint32_t value)
 {
@@ -139,3 +292,87 @@ void procstat_percentile_calculate(uint32_t *histogram,
 		}
 	}
 }
+
+int procstat_hist_geometry_init(struct procstat_hist_geometry *geometry, unsigned bucket_bits, uint64_t max_value)
+{
+	unsigned msb;
+
+	if (!bucket_bits || bucket_bits > PROCSTAT_HIST_MAX_BUCKET_BITS)
+		return EINVAL;
+
+	msb = max_value ? (sizeof(max_value)*8) - __builtin_clzll(max_value) - 1 : 0;
+
+	/* groups 0 and 1 hold values with MSB <= bucket_bits as is */
+	geometry->bucket_bits = bucket_bits;
+	geometry->ngroups = msb > bucket_bits ? msb - bucket_bits + 2 : 2;
+	geometry->nbuckets = geometry->ngroups << bucket_bits;
+	return 0;
+}
+
+unsigned int procstat_hist_u64_value_to_index(const struct procstat_hist_geometry *geometry, uint64_t val)
+{
+	unsigned int msb, error_bits, base, offset, idx;
+
+	if (val == 0)
+		return 0;
+
+	msb = (sizeof(val)*8) - __builtin_clzll(val) - 1;
+	if (msb <= geometry->bucket_bits)
+		return (unsigned int)val;
+
+	error_bits = msb - geometry->bucket_bits;
+	base = (error_bits + 1) << geometry->bucket_bits;
+	offset = ((1U << geometry->bucket_bits) - 1) & (val >> error_bits);
+
+	idx = base + offset;
+	return idx < geometry->nbuckets ? idx : geometry->nbuckets - 1;
+}
+
+uint64_t procstat_hist_u64_index_to_value(const struct procstat_hist_geometry *geometry, unsigned int idx)
+{
+	unsigned int error_bits, k;
+	uint64_t base;
+
+	assert(idx < geometry->nbuckets);
+
+	if (idx < (2U << geometry->bucket_bits))
+		return idx;
+
+	error_bits = (idx >> geometry->bucket_bits) - 1;
+	base = 1ULL << (error_bits + geometry->bucket_bits);
+	k = idx & ((1U << geometry->bucket_bits) - 1);
+
+	/* mean of the range of the bucket */
+	return base + ((uint64_t)k << error_bits) + ((1ULL << error_bits) >> 1);
+}
+
+uint64_t procstat_hist_u64_index_upper_bound(const struct procstat_hist_geometry *geometry, unsigned int idx)
+{
+	assert(idx < geometry->nbuckets);
+
+	return index_upper_bound(geometry->bucket_bits, idx);
+}
+
+void procstat_percentile_calculate_u64(const struct procstat_hist_geometry *geometry,
+				       uint64_t *histogram,
+				       uint64_t samples_count,
+				       struct procstat_percentile_result_u64 *result,
+				       unsigned result_len)
+{
+	uint64_t num_points = 0;
+	unsigned int  i, j = 0;
+
+	for (i = 0; i < geometry->nbuckets && j < result_len; ++i) {
+		num_points += histogram[i];
+
+		/* several percentiles might be anwered with same bucket*/
+		while (num_points >= result[j].fraction * samples_count) {
+			assert(result[j].fraction <= 1.0);
+			result[j].value = procstat_hist_u64_index_to_value(geometry, i);
+
+			++j;
+			if (j == result_len)
+				break;
+		}
+	}
+}
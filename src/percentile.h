@@ -96,7 +96,11 @@
  *  ** If a sample's MSB is greater than 23, it will be counted as 23.
  */
 
+#ifndef _PROCSTAT_PERCENTILE_H_
+#define _PROCSTAT_PERCENTILE_H_
+
 #include <stdint.h>
+#include <stddef.h>
 #define PROCSTAT_BUCKET_BITS 6
 #define PROCSTAT_BUCKET_VALUES (1 << PROCSTAT_BUCKET_BITS)
 #define PROCSTAT_GROUP_NR 19
@@ -108,11 +112,31 @@ struct procstat_percentile_result {
 	uint32_t value;
 };
 
+/**
+ * @return index of the @histogram bucket that @value is counted in
+ */
+unsigned int procstat_hist_value_to_index(uint32_t value);
+
+/**
+ * @return the largest value counted in bucket @idx, the last bucket also counts all larger values
+ */
+uint64_t procstat_hist_index_upper_bound(unsigned int idx);
+
 /**
  * @brief adds @value point to @histogram of length at least @PROCSTAT_PERCENTILE_ARR_NR
  */
 void procstat_hist_add_point(uint32_t *histogram, uint32_t value);
 
+/**
+ * @brief computes bucket @index of each of @n @values. Uses avx512/avx2 in case supported by cpu
+ */
+void procstat_hist_values_to_index(const uint32_t *values, uint32_t *index, size_t n);
+
+/**
+ * @brief adds @n points from @values to @histogram of length at least @PROCSTAT_PERCENTILE_ARR_NR
+ */
+void procstat_hist_add_points(uint32_t *histogram, const uint32_t *values, size_t n);
+
 /**
  * @brief calculates percentiles on histogram
  */
@@ -120,3 +144,53 @@ void procstat_percentile_calculate(uint32_t *histogram,
 				   uint64_t samples_count,
 				   struct procstat_percentile_result *result,
 				   unsigned result_len);
+
+/*
+ * 64 bit histograms use the same bucketing, but number of bucket bits (M) and
+ * number of groups are chosen per histogram: groups are added up to the MSB of
+ * the largest value to be tracked, so small range histograms stay small.
+ */
+#define PROCSTAT_HIST_MAX_BUCKET_BITS 16
+
+struct procstat_hist_geometry {
+	unsigned bucket_bits;
+	unsigned ngroups;
+	unsigned nbuckets;
+};
+
+struct procstat_percentile_result_u64 {
+	float 	 fraction;
+	uint64_t value;
+};
+
+/**
+ * @brief initializes @geometry to track values up to @max_value with error bound of 1/2^(@bucket_bits+1)
+ * @return 0 on success, EINVAL in case of invalid @bucket_bits
+ */
+int procstat_hist_geometry_init(struct procstat_hist_geometry *geometry, unsigned bucket_bits, uint64_t max_value);
+
+/**
+ * @return index of the bucket that @value is counted in, values above max are counted in the last bucket
+ */
+unsigned int procstat_hist_u64_value_to_index(const struct procstat_hist_geometry *geometry, uint64_t value);
+
+/**
+ * @return value represented by bucket @idx
+ */
+uint64_t procstat_hist_u64_index_to_value(const struct procstat_hist_geometry *geometry, unsigned int idx);
+
+/**
+ * @return the largest value counted in bucket @idx, the last bucket also counts all larger values
+ */
+uint64_t procstat_hist_u64_index_upper_bound(const struct procstat_hist_geometry *geometry, unsigned int idx);
+
+/**
+ * @brief calculates percentiles on 64 bit histogram of @geometry->nbuckets length
+ */
+void procstat_percentile_calculate_u64(const struct procstat_hist_geometry *geometry,
+				       uint64_t *histogram,
+				       uint64_t samples_count,
+				       struct procstat_percentile_result_u64 *result,
+				       unsigned result_len);
+
+#endif
@@ -37,18 +37,28 @@
 #include <stdbool.h>
 #include <errno.h>
 #include "procstat.h"
+#include "procstat_shm.h"
+#include "procstat_binary.h"
 #include "list.h"
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/param.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*a))
@@ -67,9 +77,23 @@ enum {
 	STATS_ENTRY_FLAG_DIR	     = 1 << 1,
 	STATS_ENTRY_FLAG_HISTOGRAM   = 1 << 2,
 	STATS_ENTRY_FLAG_AGGREGATOR  = 1 << 3,
+	STATS_ENTRY_FLAG_PERCPU      = 1 << 4,
+	STATS_ENTRY_FLAG_HISTOGRAM_U64 = 1 << 5,
+	STATS_ENTRY_FLAG_WINDOW      = 1 << 6,
+	STATS_ENTRY_FLAG_RATE        = 1 << 7,
+	STATS_ENTRY_FLAG_SAMPLED     = 1 << 8,
+	STATS_ENTRY_FLAG_HISTORY     = 1 << 9,
+	STATS_ENTRY_FLAG_SNAPSHOT    = 1 << 10,
+	STATS_ENTRY_FLAG_SERIES      = 1 << 11,
+	STATS_ENTRY_FLAG_TEMPLATE    = 1 << 12,
+	STATS_ENTRY_FLAG_SYNTHESIZED = 1 << 13,
+	STATS_ENTRY_FLAG_STREAM      = 1 << 14,
+	STATS_ENTRY_FLAG_LOOKED_UP   = 1 << 15,
 };
 
 #define SERIES_RESET_CLOCK CLOCK_MONOTONIC_COARSE
+#define SYNTHESIZED_INODE_BUCKETS 256
+#define TICKER_INTERVAL_MSEC 100
 
 #define ATTRIBUTES_TIMEOUT_SEC (60.0 * 60)
 #define DNAME_INLINE_LEN 32
@@ -87,13 +111,24 @@ struct procstat_item {
 	struct procstat_directory *parent;
 	uint32_t 	       name_hash;
 	struct list_head       entry;
-	int 		       refcnt;
+	struct procstat_item   *hash_next; /* in parent directory hash index */
+	int 		       refcnt; /* atomic */
 	unsigned 	       flags;
 };
 
+/*
+ * lock protects the children list, the hash index, the generation and the cached listing.
+ * Lock order is parent directory before child directory, and directory locks before the context locks.
+ */
 struct procstat_directory {
 	struct procstat_item base;
+	pthread_rwlock_t       lock;
 	struct list_head       children;
+	uint64_t 	       generation; /* changed whenever children are added or removed */
+	struct dir_listing     *listing;   /* cached by the last opendir */
+	unsigned 	       nchildren;
+	unsigned 	       nbuckets;   /* hash index of children, built past DIR_HASH_THRESHOLD children */
+	struct procstat_item   **buckets;
 };
 
 struct procstat_file {
@@ -102,40 +137,347 @@ struct procstat_file {
 	uint64_t		arg;
 	procstats_formatter  	fmt;
 	procstats_formatter  	writer;
+	union {
+		uint32_t	shm_slot; /* slot + 1 of the shared memory export record, 0 if not exported */
+		uint32_t	template_index; /* of a synthesized file, which is never exported */
+	};
+	enum procstat_value_type type;
+};
+
+/*
+ * Items and their long names are carved out of per-context slabs, so stats created together are
+ * adjacent in memory and the context is torn down slab by slab instead of item by item.
+ * A slab is aligned to its size: an object finds its slab, and so its cache, from its own address.
+ * Objects larger than the biggest class get a slab of their own.
+ */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_HEADER_SIZE PROCSTAT_CACHELINE_SIZE
+#define SLAB_NCLASSES 10
+static const unsigned slab_class_size[SLAB_NCLASSES] = {32, 64, 96, 128, 192, 256, 384, 512, 1024, 2048};
+
+struct slab_cache {
+	pthread_mutex_t  lock;
+	unsigned 	 size;
+	unsigned 	 nempty;  /* at most one empty slab is kept */
+	struct list_head partial; /* slabs with free objects, allocation is from the first */
+	struct list_head full;
+};
+
+struct procstat_arena {
+	struct slab_cache caches[SLAB_NCLASSES];
+	pthread_mutex_t   large_lock;
+	struct list_head  large;
+	bool 		  teardown; /* objects are not freed one by one, the slabs go at once */
+};
+
+struct slab {
+	struct list_head   entry;
+	struct procstat_arena *arena;
+	struct slab_cache  *cache; /* NULL for a large object slab */
+	void 		   *free;  /* freed objects, linked through their first word */
+	char 		   *unused; /* start of the never allocated tail */
+	unsigned 	   inuse;
 };
 
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+
+static void arena_init(struct procstat_arena *arena)
+{
+	int i;
+
+	for (i = 0; i < SLAB_NCLASSES; ++i) {
+		struct slab_cache *cache = &arena->caches[i];
+
+		pthread_mutex_init(&cache->lock, NULL);
+		cache->size = slab_class_size[i];
+		INIT_LIST_HEAD(&cache->partial);
+		INIT_LIST_HEAD(&cache->full);
+	}
+	pthread_mutex_init(&arena->large_lock, NULL);
+	INIT_LIST_HEAD(&arena->large);
+}
+
+static void slab_list_free(struct list_head *list)
+{
+	struct slab *slab, *n;
+
+	list_for_each_entry_safe(slab, n, list, entry)
+		free(slab);
+}
+
+static void arena_destroy(struct procstat_arena *arena)
+{
+	int i;
+
+	for (i = 0; i < SLAB_NCLASSES; ++i) {
+		slab_list_free(&arena->caches[i].partial);
+		slab_list_free(&arena->caches[i].full);
+		pthread_mutex_destroy(&arena->caches[i].lock);
+	}
+	slab_list_free(&arena->large);
+	pthread_mutex_destroy(&arena->large_lock);
+}
+
+static bool slab_full(struct slab *slab)
+{
+	return !slab->free && slab->unused + slab->cache->size > (char *)slab + SLAB_SIZE;
+}
+
+static void *arena_alloc_large(struct procstat_arena *arena, size_t size)
+{
+	struct slab *slab;
+
+	if (posix_memalign((void **)&slab, SLAB_SIZE, SLAB_HEADER_SIZE + size))
+		return NULL;
+	memset(slab, 0, SLAB_HEADER_SIZE + size);
+	slab->arena = arena;
+	pthread_mutex_lock(&arena->large_lock);
+	list_add(&slab->entry, &arena->large);
+	pthread_mutex_unlock(&arena->large_lock);
+	return (char *)slab + SLAB_HEADER_SIZE;
+}
+
+/* Returns zeroed memory, like calloc */
+static void *arena_alloc(struct procstat_arena *arena, size_t size)
+{
+	struct slab_cache *cache = NULL;
+	struct slab *slab;
+	void *object;
+	int i;
+
+	for (i = 0; i < SLAB_NCLASSES; ++i)
+		if (size <= slab_class_size[i]) {
+			cache = &arena->caches[i];
+			break;
+		}
+	if (!cache)
+		return arena_alloc_large(arena, size);
+
+	pthread_mutex_lock(&cache->lock);
+	if (list_empty(&cache->partial)) {
+		if (posix_memalign((void **)&slab, SLAB_SIZE, SLAB_SIZE)) {
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+		slab->arena = arena;
+		slab->cache = cache;
+		slab->free = NULL;
+		slab->unused = (char *)slab + SLAB_HEADER_SIZE;
+		slab->inuse = 0;
+		ASAN_POISON_MEMORY_REGION(slab->unused, SLAB_SIZE - SLAB_HEADER_SIZE);
+		list_add(&slab->entry, &cache->partial);
+		++cache->nempty;
+	}
+	slab = list_entry(cache->partial.next, struct slab, entry);
+	if (!slab->inuse)
+		--cache->nempty;
+
+	if (slab->free) {
+		object = slab->free;
+		ASAN_UNPOISON_MEMORY_REGION(object, cache->size);
+		slab->free = *(void **)object;
+	} else {
+		object = slab->unused;
+		ASAN_UNPOISON_MEMORY_REGION(object, cache->size);
+		slab->unused += cache->size;
+	}
+	++slab->inuse;
+	if (slab_full(slab)) {
+		list_del(&slab->entry);
+		list_add(&slab->entry, &cache->full);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	memset(object, 0, cache->size);
+	return object;
+}
+
+static struct slab *object_slab(void *object)
+{
+	return (struct slab *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static void arena_free(void *object)
+{
+	struct slab *slab;
+	struct slab_cache *cache;
+	bool was_full;
+
+	if (!object)
+		return;
+
+	slab = object_slab(object);
+	if (slab->arena->teardown)
+		return;
+
+	cache = slab->cache;
+	if (!cache) {
+		pthread_mutex_lock(&slab->arena->large_lock);
+		list_del(&slab->entry);
+		pthread_mutex_unlock(&slab->arena->large_lock);
+		free(slab);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	was_full = slab_full(slab);
+	*(void **)object = slab->free;
+	slab->free = object;
+	ASAN_POISON_MEMORY_REGION(object, cache->size);
+	--slab->inuse;
+	if (was_full) {
+		list_del(&slab->entry);
+		list_add(&slab->entry, &cache->partial);
+	}
+	if (!slab->inuse) {
+		if (cache->nempty) {
+			list_del(&slab->entry);
+			free(slab);
+		} else
+			++cache->nempty;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static char *arena_strdup(struct procstat_arena *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *copy;
+
+	copy = arena_alloc(arena, len);
+	if (copy)
+		memcpy(copy, s, len);
+	return copy;
+}
+
 struct procstat_context {
 	struct procstat_directory root;
 	char *mountpoint;
 	struct fuse_session *session;
 	gid_t	gid;
 	uid_t   uid;
-	pthread_mutex_t global_lock;
+	pthread_mutex_t global_lock; /* innermost, never held while an item is freed */
+	pthread_t	ticker;
+	pthread_mutex_t ticker_lock;
+	pthread_cond_t	ticker_cond;
+	bool		ticker_started;
+	bool		ticker_stop;
+	uint64_t	last_tick;
+	struct list_head tick_handlers; /* protected by global_lock */
+	pthread_t	sampler;
+	pthread_mutex_t sampler_lock;
+	pthread_cond_t	sampler_cond;
+	bool		sampler_started;
+	bool		sampler_stop;
+	unsigned	sampler_interval_msec;
+	struct list_head histories; /* protected by global_lock */
+	pthread_mutex_t shm_lock;   /* nests inside directory locks */
+	struct procstat_shm *shm;   /* protected by shm_lock */
+	pthread_t	shm_refresher;
+	pthread_mutex_t shm_refresher_lock;
+	pthread_cond_t	shm_refresher_cond;
+	bool		shm_refresher_started; /* protected by shm_lock */
+	bool		shm_refresher_stop;
+	pthread_mutex_t inodes_lock; /* innermost */
+	struct procstat_item *inodes[SYNTHESIZED_INODE_BUCKETS]; /* looked up synthesized files, by inode */
+	struct procstat_arena arena;
 };
 
+struct series_template;
 struct procstat_series {
 	struct procstat_directory root;
 	void  	    		  *private;
+	const struct series_template *template; /* files of a STATS_ENTRY_FLAG_TEMPLATE series */
+};
+
+/*
+ * Called by the context ticker once a second under global_lock, as long as @item is registered.
+ * @context is used to remove the handler once the item is freed
+ * @now coarse clock in seconds
+ */
+struct procstat_tick_handler {
+	struct list_head 	entry;
+	struct procstat_context *context;
+	struct procstat_item 	*item;
+	void 			(*tick)(struct procstat_tick_handler *handler, uint64_t now);
 };
 
+struct procstat_window_view {
+	struct procstat_histogram_u32_window 	*window;
+	unsigned 				window_sec;
+	uint64_t 				count;
+	uint64_t 				sum;
+	uint32_t 				*histogram;
+	struct procstat_percentile_result 	percentile[MAX_SUPPORTED_PERCENTILE];
+	uint64_t 				rotation; /* rotation the view was merged at */
+	bool 					valid;
+};
+
+struct procstat_window_series {
+	struct procstat_series 		series;
+	struct procstat_tick_handler 	tick;
+	uint64_t 			last_rotation_time;
+	struct procstat_window_slice 	*slices;
+	uint32_t 			*buckets;
+	struct procstat_window_view 	views[PROCSTAT_MAX_WINDOWS];
+};
+
+/* FNV-1a with murmur3 finalizer, so that similar names (e.g. volume_1, volume_2) spread over the buckets */
 static uint32_t string_hash(const char *string)
 {
-	uint32_t hash = 0;
+	uint32_t hash = 2166136261u;
 	unsigned char *i;
 
-	for (i = (unsigned char*)string; *i; ++i)
-	hash = 31 * hash + *i;
+	for (i = (unsigned char*)string; *i; ++i) {
+		hash ^= *i;
+		hash *= 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
 	return hash;
 }
 
-static struct procstat_file* fuse_inode_to_file(fuse_ino_t inode)
+/*
+ * The inode of an item is its address. A synthesized file is given the address of its series with the
+ * template index in the top byte instead, so it keeps the same inode on every lookup and in readdir.
+ */
+#define SYNTHESIZED_INODE_SHIFT 56
+
+static fuse_ino_t template_file_inode(struct procstat_series *series, unsigned index)
+{
+	return (uintptr_t)series | ((fuse_ino_t)(index + 1) << SYNTHESIZED_INODE_SHIFT);
+}
+
+static fuse_ino_t item_inode(struct procstat_item *item)
 {
-	return (struct procstat_file*)(inode);
+	if (unlikely(item->flags & STATS_ENTRY_FLAG_SYNTHESIZED))
+		return template_file_inode(container_of(item->parent, struct procstat_series, root),
+					   container_of(item, struct procstat_file, base)->template_index);
+	return (uintptr_t)item;
 }
 
+static struct procstat_item *synthesized_inode_item(struct procstat_context *context, fuse_ino_t inode);
+
 static struct procstat_item *fuse_inode_to_item(struct procstat_context *context, fuse_ino_t inode)
 {
-	return (inode == FUSE_ROOT_ID) ? &context->root.base : (struct procstat_item *)(inode);
+	if (inode == FUSE_ROOT_ID)
+		return &context->root.base;
+	if (unlikely(inode >> SYNTHESIZED_INODE_SHIFT))
+		return synthesized_inode_item(context, inode);
+	return (struct procstat_item *)(inode);
+}
+
+static struct procstat_file* fuse_inode_to_file(struct procstat_context *context, fuse_ino_t inode)
+{
+	return container_of(fuse_inode_to_item(context, inode), struct procstat_file, base);
 }
 
 static struct procstat_directory *fuse_inode_to_dir(struct procstat_context *context, fuse_ino_t inode)
@@ -170,7 +512,29 @@ static const char *procstat_item_name(struct procstat_item *item)
 
 static bool item_registered(struct procstat_item *item)
 {
-	return item->flags & STATS_ENTRY_FLAG_REGISTERED;
+	unsigned flags = __atomic_load_n(&item->flags, __ATOMIC_ACQUIRE);
+
+	/* a synthesized file is never in the tree, it is as visible as its directory */
+	if (unlikely(flags & STATS_ENTRY_FLAG_SYNTHESIZED))
+		return item_registered(&item->parent->base);
+	return flags & STATS_ENTRY_FLAG_REGISTERED;
+}
+
+/* flags of a registered item may be changed concurrently, from under different locks */
+static void item_set_flags(struct procstat_item *item, unsigned flags)
+{
+	__atomic_or_fetch(&item->flags, flags, __ATOMIC_RELEASE);
+}
+
+static void item_clear_flags(struct procstat_item *item, unsigned flags)
+{
+	__atomic_and_fetch(&item->flags, ~flags, __ATOMIC_RELEASE);
+}
+
+/* the caller must already hold a reference, or the parent directory lock of a registered item */
+static void item_get(struct procstat_item *item)
+{
+	__atomic_add_fetch(&item->refcnt, 1, __ATOMIC_RELAXED);
 }
 
 static bool item_type_directory(struct procstat_item *item)
@@ -182,26 +546,125 @@ static void free_histogram(struct procstat_series *series)
 {
 	struct procstat_histogram_u32 *hist = series->private;
 
+	if (hist->shards) {
+		free(hist->shards[0].histogram);
+		free(hist->shards);
+		hist->shards = NULL;
+	}
 	if (!hist->histogram)
 		return;
 	free(hist->histogram);
 }
 
+static void free_histogram_u64(struct procstat_series *series)
+{
+	struct procstat_histogram_u64 *hist = series->private;
+
+	free(hist->histogram);
+	hist->histogram = NULL;
+}
+
+static void remove_tick_handler(struct procstat_tick_handler *handler)
+{
+	pthread_mutex_lock(&handler->context->global_lock);
+	list_del(&handler->entry);
+	pthread_mutex_unlock(&handler->context->global_lock);
+}
+
+static void free_window(struct procstat_item *item)
+{
+	struct procstat_window_series *window = container_of(item, struct procstat_window_series, series.root.base);
+	int i;
+
+	remove_tick_handler(&window->tick);
+	for (i = 0; i < PROCSTAT_MAX_WINDOWS; ++i)
+		free(window->views[i].histogram);
+	free(window->buckets);
+	free(window->slices);
+}
+
+#define HISTORY_VALUE_LEN 40
+struct history_sample {
+	uint64_t time_msec;
+	char	 value[HISTORY_VALUE_LEN];
+};
+
+/*
+ * Ring of the last samples of @source, owned by the "<name>.history" @view file.
+ * Samples are written by the sampler thread and read by fuse under global_lock.
+ */
+struct procstat_history {
+	struct list_head 	entry;
+	struct procstat_context *context;
+	struct procstat_file 	*source;
+	struct procstat_file 	*view;
+	unsigned 		nsamples;
+	unsigned 		next;
+	uint64_t 		count;
+	struct history_sample 	samples[0];
+};
+
+static void item_put(struct procstat_item *item);
+static void free_history(struct procstat_history *history)
+{
+	pthread_mutex_lock(&history->context->global_lock);
+	list_del(&history->entry);
+	pthread_mutex_unlock(&history->context->global_lock);
+	if (history->source)
+		item_put(&history->source->base);
+	free(history);
+}
+
+struct procstat_rate_series {
+	struct procstat_series 		series;
+	struct procstat_tick_handler 	tick;
+	uint64_t 			last_tick_time;
+};
+
+static void dir_listing_put(struct dir_listing *listing);
+static void synthesized_inode_remove(struct procstat_item *item);
 static void free_item(struct procstat_item *item)
 {
+	struct procstat_directory *synthesized_parent = NULL;
+
 	list_del(&item->entry);
 	if (item_type_directory(item)) {
 		struct procstat_directory *directory = (struct procstat_directory *)item;
 		assert(list_empty(&directory->children));
+		dir_listing_put(directory->listing);
+		free(directory->buckets);
+		pthread_rwlock_destroy(&directory->lock);
 	}
 
 	if (!stats_item_short_name(item))
-		free(item->name.buffer);
+		arena_free(item->name.buffer);
 
 	if (item->flags & STATS_ENTRY_FLAG_HISTOGRAM)
 		free_histogram((struct procstat_series *)item);
 
-	free(item);
+	if (item->flags & STATS_ENTRY_FLAG_HISTOGRAM_U64)
+		free_histogram_u64((struct procstat_series *)item);
+
+	if (item->flags & STATS_ENTRY_FLAG_PERCPU)
+		free(container_of(item, struct procstat_file, base)->private);
+
+	if (item->flags & STATS_ENTRY_FLAG_WINDOW)
+		free_window(item);
+
+	if (item->flags & STATS_ENTRY_FLAG_RATE)
+		remove_tick_handler(&container_of(item, struct procstat_rate_series, series.root.base)->tick);
+
+	if (item->flags & STATS_ENTRY_FLAG_HISTORY)
+		free_history(container_of(item, struct procstat_file, base)->private);
+
+	if (item->flags & STATS_ENTRY_FLAG_SYNTHESIZED)
+		synthesized_parent = item->parent;
+	if (item->flags & STATS_ENTRY_FLAG_LOOKED_UP)
+		synthesized_inode_remove(item);
+
+	arena_free(item);
+	if (synthesized_parent)
+		item_put(&synthesized_parent->base);
 }
 
 static void free_directory(struct procstat_directory *directory)
@@ -209,12 +672,156 @@ static void free_directory(struct procstat_directory *directory)
 	free_item(&directory->base);
 }
 
+/* "-" + 20 digits + "\n", or "0x" + 16 digits + "\n" */
+#define PRINT_MAX_LEN 22
+
+static const char decimal_pairs[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static unsigned decimal_digits(uint64_t value)
+{
+	unsigned digits = 1;
+
+	for (;;) {
+		if (value < 10)
+			return digits;
+		if (value < 100)
+			return digits + 1;
+		if (value < 1000)
+			return digits + 2;
+		if (value < 10000)
+			return digits + 3;
+		value /= 10000;
+		digits += 4;
+	}
+}
+
+/* writes the digits of @value at @out, two at a time from the end, returns their number */
+static unsigned print_decimal(char *out, uint64_t value)
+{
+	unsigned len = decimal_digits(value);
+	unsigned pos = len;
+	unsigned pair;
+
+	while (value >= 100) {
+		pair = (value % 100) * 2;
+		value /= 100;
+		out[--pos] = decimal_pairs[pair + 1];
+		out[--pos] = decimal_pairs[pair];
+	}
+	if (value >= 10) {
+		out[1] = decimal_pairs[value * 2 + 1];
+		out[0] = decimal_pairs[value * 2];
+	} else {
+		out[0] = '0' + value;
+	}
+	return len;
+}
+
+static unsigned print_hex(char *out, uint64_t value)
+{
+	static const char hex_digits[16] = "0123456789abcdef";
+	unsigned len = (64 - __builtin_clzll(value | 1) + 3) / 4;
+	unsigned pos = len;
+
+	do {
+		out[--pos] = hex_digits[value & 0xf];
+		value >>= 4;
+	} while (pos);
+	return len;
+}
+
+/*
+ * Converts @value into the caller buffer when it surely fits, otherwise through a local one
+ * which is then truncated like snprintf() does
+ */
+static ssize_t print_integer(char *buffer, size_t len, uint64_t value, const char *prefix, bool hex)
+{
+	char local[PRINT_MAX_LEN + 1];
+	char *out = len > PRINT_MAX_LEN ? buffer : local;
+	size_t total = 0;
+
+	while (*prefix)
+		out[total++] = *prefix++;
+	total += hex ? print_hex(&out[total], value) : print_decimal(&out[total], value);
+	out[total++] = '\n';
+	if (out == buffer) {
+		buffer[total] = 0;
+	} else if (len) {
+		size_t n = MIN(total, len - 1);
+
+		memcpy(buffer, local, n);
+		buffer[n] = 0;
+	}
+	return total;
+}
+
+ssize_t procstat_print_u64(char *buffer, size_t len, uint64_t value)
+{
+	return print_integer(buffer, len, value, "", false);
+}
+
+ssize_t procstat_print_s64(char *buffer, size_t len, int64_t value)
+{
+	if (value < 0)
+		return print_integer(buffer, len, -(uint64_t)value, "-", false);
+	return print_integer(buffer, len, value, "", false);
+}
+
+ssize_t procstat_print_hex(char *buffer, size_t len, uint64_t value)
+{
+	return print_integer(buffer, len, value, "", true);
+}
+
+ssize_t procstat_print_address(char *buffer, size_t len, uint64_t value)
+{
+	return print_integer(buffer, len, value, "0x", true);
+}
+
+/*
+ * Reading a series may update its state (reset, shards merge, percentile cache), so concurrent readers
+ * of the same series directory are serialized by a lock picked by the directory address.
+ */
+#define SERIES_READ_LOCKS 64
+static pthread_mutex_t series_read_locks[SERIES_READ_LOCKS] = {
+	[0 ... SERIES_READ_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *series_read_lock(struct procstat_directory *directory)
+{
+	if (!directory || !(directory->base.flags & STATS_ENTRY_FLAG_SERIES))
+		return NULL;
+	return &series_read_locks[((uintptr_t)directory / sizeof(*directory)) % SERIES_READ_LOCKS];
+}
+
+static ssize_t file_format(struct procstat_file *file, char *buffer, size_t length)
+{
+	pthread_mutex_t *lock = series_read_lock(file->base.parent);
+	ssize_t len;
+
+	if (lock)
+		pthread_mutex_lock(lock);
+	len = file->fmt(file->private, file->arg, buffer, length);
+	if (lock)
+		pthread_mutex_unlock(lock);
+	return len;
+}
+
 #define INODE_BLK_SIZE 4096
 static void fill_item_stats(struct procstat_context *context, struct procstat_item *item, struct stat *stat)
 {
 	stat->st_uid = context->uid;
 	stat->st_gid = context->gid;
-	stat->st_ino = (__ino_t)item;
+	stat->st_ino = item_inode(item);
 	struct procstat_file *file;
 
 	if (item_type_directory(item)) {
@@ -225,7 +832,7 @@ static void fill_item_stats(struct procstat_context *context, struct procstat_it
 
 	stat->st_mode = S_IFREG;
 	file = container_of(item, struct procstat_file, base);
-	if (file->fmt)
+	if (file->fmt || (item->flags & (STATS_ENTRY_FLAG_HISTORY | STATS_ENTRY_FLAG_STREAM)))
 		stat->st_mode |= 0444;
 	if (file->writer)
 		stat->st_mode |= 0222;
@@ -241,6 +848,14 @@ static struct procstat_item *lookup_item_locked(struct procstat_directory *paren
 {
 	struct procstat_item *item;
 
+	if (parent->buckets) {
+		for (item = parent->buckets[name_hash & (parent->nbuckets - 1)]; item; item = item->hash_next) {
+			if (item->name_hash == name_hash && strcmp(procstat_item_name(item), name) == 0)
+				return item;
+		}
+		return NULL;
+	}
+
 	list_for_each_entry(item, &parent->children, entry) {
 		if (item->name_hash != name_hash)
 			continue;
@@ -251,94 +866,341 @@ static struct procstat_item *lookup_item_locked(struct procstat_directory *paren
 	return NULL;
 }
 
-static void fuse_lookup(fuse_req_t req, fuse_ino_t parent_inode, const char *name)
+#define DIR_HASH_THRESHOLD 16
+#define DIR_HASH_MIN_BUCKETS 64
+
+/* on allocation failure the current index (or the linear scan) is kept, it is just slower */
+static void directory_hash_resize(struct procstat_directory *directory, unsigned nbuckets)
 {
-	struct procstat_context *context = request_context(req);
-	static struct procstat_directory *parent;
-	struct procstat_item *item;
-	struct fuse_entry_param fuse_entry;
+	struct procstat_item **buckets;
+	struct procstat_item *iter;
 
-	memset(&fuse_entry, 0, sizeof(fuse_entry));
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (!buckets)
+		return;
 
-	pthread_mutex_lock(&context->global_lock);
-	parent = fuse_inode_to_dir(request_context(req), parent_inode);
+	list_for_each_entry(iter, &directory->children, entry) {
+		struct procstat_item **bucket = &buckets[iter->name_hash & (nbuckets - 1)];
 
-	item = lookup_item_locked(parent, name, string_hash(name));
-	if ((!item) || (!item_registered(item))) {
-		pthread_mutex_unlock(&context->global_lock);
-		fuse_reply_err(req, ENOENT);
-		return;
+		iter->hash_next = *bucket;
+		*bucket = iter;
 	}
+	free(directory->buckets);
+	directory->buckets = buckets;
+	directory->nbuckets = nbuckets;
+}
 
-	fuse_entry.ino = (uintptr_t)item;
-	item->refcnt++;
-	fuse_entry.attr_timeout = ATTRIBUTES_TIMEOUT_SEC;
-	fill_item_stats(context, item, &fuse_entry.attr);
-	pthread_mutex_unlock(&context->global_lock);
-	fuse_reply_entry(req, &fuse_entry);
+static void directory_add_child_locked(struct procstat_directory *directory, struct procstat_item *item)
+{
+	list_add_tail(&item->entry, &directory->children);
+	++directory->nchildren;
+	++directory->generation;
+
+	if (directory->buckets) {
+		struct procstat_item **bucket = &directory->buckets[item->name_hash & (directory->nbuckets - 1)];
+
+		item->hash_next = *bucket;
+		*bucket = item;
+		if (directory->nchildren > directory->nbuckets)
+			directory_hash_resize(directory, directory->nbuckets * 2);
+	} else if (directory->nchildren > DIR_HASH_THRESHOLD) {
+		directory_hash_resize(directory, DIR_HASH_MIN_BUCKETS);
+	}
 }
 
-static void item_put_locked(struct procstat_item *item);
-static void fuse_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
-	struct procstat_context *context = request_context(req);
-	struct procstat_item *item;
+static void directory_remove_child_locked(struct procstat_directory *directory, struct procstat_item *item)
+{
+	if (list_empty(&item->entry))
+		return; /* already removed */
 
-	pthread_mutex_lock(&context->global_lock);
-	item = (struct procstat_item *)(ino);
-	if (nlookup >= item->refcnt) {
-		item->refcnt = 1;
-		item_put_locked(item);
-	} else {
-		item->refcnt -= nlookup;
+	list_del_init(&item->entry);
+	--directory->nchildren;
+	++directory->generation;
+
+	if (directory->buckets) {
+		struct procstat_item **iter = &directory->buckets[item->name_hash & (directory->nbuckets - 1)];
+
+		while (*iter != item)
+			iter = &(*iter)->hash_next;
+		*iter = item->hash_next;
+		item->hash_next = NULL;
 	}
-	pthread_mutex_unlock(&context->global_lock);
-	fuse_reply_none(req);
 }
 
-static void fuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+static void directory_hash_free(struct procstat_directory *directory)
 {
-	struct stat stat;
-	struct procstat_context *context = request_context(req);
-	struct procstat_item *item;
+	free(directory->buckets);
+	directory->buckets = NULL;
+	directory->nbuckets = 0;
+}
 
-	memset(&stat, 0, sizeof(stat));
-	pthread_mutex_lock(&context->global_lock);
-	item = fuse_inode_to_item(context, ino);
-	if (!item_registered(item)) {
-		pthread_mutex_unlock(&context->global_lock);
-		fuse_reply_err(req, ENOENT);
-		return;
-	}
+/*
+ * Files of a template series are not allocated: they are described by a static schema shared by all the
+ * series of the type, and synthesized on lookup, readdir and aggregator walks, so a series is a single node.
+ * A series is materialized into regular files once they have to persist: when exported to shared memory,
+ * looked up by procstat_lookup_item() or sampled into history.
+ */
+struct template_file {
+	const char 		*name; /* NULL for the percentile files, one per percentile of the series */
+	procstats_formatter 	fmt;
+	procstats_formatter 	writer; /* called with the series item rather than the user series */
+	uint64_t 		arg;
+	uint64_t 		(*value)(void *series, uint64_t arg); /* raw value of @fmt, for binary consumers */
+};
 
-	fill_item_stats(context, item, &stat);
-	pthread_mutex_unlock(&context->global_lock);
-	fuse_reply_attr(req, &stat, ATTRIBUTES_TIMEOUT_SEC);
+struct series_template {
+	const struct template_file *files;
+	unsigned 		   nfiles;
+	unsigned 		   (*npercentile)(void *series);
+	double 			   (*fraction)(void *series, unsigned index);
+};
+
+static bool series_template(struct procstat_directory *directory)
+{
+	return __atomic_load_n(&directory->base.flags, __ATOMIC_ACQUIRE) & STATS_ENTRY_FLAG_TEMPLATE;
 }
 
-static void fuse_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+/* Fills @file with the file number @index of @series, returns false past the last one */
+static bool template_file_init(struct procstat_series *series, unsigned index, struct procstat_file *file)
 {
-	struct procstat_context *context = request_context(req);
-	struct procstat_item *item;
+	const struct series_template *template = series->template;
+	unsigned template_index = index;
+	unsigned i;
 
-	pthread_mutex_lock(&context->global_lock);
-	item = fuse_inode_to_item(context, ino);
+	for (i = 0; i < template->nfiles; ++i) {
+		const struct template_file *entry = &template->files[i];
+		unsigned nfiles = entry->name ? 1 : template->npercentile(series->private);
 
-	if (!item_registered(item)) {
-		pthread_mutex_unlock(&context->global_lock);
-		fuse_reply_err(req, ENOENT);
-		return;
+		if (index >= nfiles) {
+			index -= nfiles;
+			continue;
+		}
+
+		memset(file, 0, sizeof(*file));
+		if (entry->name)
+			strcpy(file->base.iname, entry->name);
+		else
+			snprintf(file->base.iname, DNAME_INLINE_LEN, "%.4g",
+				 template->fraction(series->private, index) * 100);
+		file->base.name_hash = string_hash(file->base.iname);
+		file->base.parent = &series->root;
+		file->base.flags = STATS_ENTRY_FLAG_SYNTHESIZED;
+		INIT_LIST_HEAD(&file->base.entry);
+		file->private = entry->writer ? (void *)series : series->private;
+		file->arg = entry->name ? entry->arg : index;
+		file->fmt = entry->fmt;
+		file->writer = entry->writer;
+		file->template_index = template_index;
+		return true;
 	}
-	++item->refcnt;
-	pthread_mutex_unlock(&context->global_lock);
-	fi->fh = 0;
-	fuse_reply_open(req, fi);
+	return false;
 }
 
-static void fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
-		       size_t size, off_t off, struct fuse_file_info *fi)
+static bool template_lookup(struct procstat_series *series, const char *name, uint32_t name_hash,
+			    struct procstat_file *file)
 {
-	struct procstat_file *file = fuse_inode_to_file(ino);
-	int num_objects;
+	unsigned index;
+
+	for (index = 0; template_file_init(series, index, file); ++index) {
+		if (file->base.name_hash == name_hash && strcmp(file->base.iname, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Names of the files of a series are unique, as they had been when the files were registered one by one */
+static bool template_names_unique(struct procstat_series *series)
+{
+	struct procstat_file file, other;
+	unsigned i, j;
+
+	for (i = 0; template_file_init(series, i, &file); ++i) {
+		for (j = 0; j < i && template_file_init(series, j, &other); ++j) {
+			if (file.base.name_hash == other.base.name_hash && strcmp(file.base.iname, other.base.iname) == 0)
+				return false;
+		}
+	}
+	return true;
+}
+
+/* The synthesized file lives as long as it is referenced, and holds a reference on its directory */
+static struct procstat_file *template_file_create(struct procstat_context *context,
+						 struct procstat_file *synthesized)
+{
+	struct procstat_file *file;
+
+	file = arena_alloc(&context->arena, sizeof(*file));
+	if (!file)
+		return NULL;
+
+	*file = *synthesized;
+	INIT_LIST_HEAD(&file->base.entry);
+	file->base.refcnt = 1;
+	item_get(&file->base.parent->base);
+	return file;
+}
+
+static unsigned inode_bucket(fuse_ino_t inode)
+{
+	return (inode * 0x9e3779b97f4a7c15ULL) >> 56;
+}
+
+/* a file whose last reference is being dropped is not found any more, it removes itself from the index */
+static bool item_get_unless_zero(struct procstat_item *item)
+{
+	int refcnt = __atomic_load_n(&item->refcnt, __ATOMIC_RELAXED);
+
+	do {
+		if (!refcnt)
+			return false;
+	} while (!__atomic_compare_exchange_n(&item->refcnt, &refcnt, refcnt + 1, false,
+					      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
+}
+
+/* Called with inodes_lock held */
+static struct procstat_item *synthesized_inode_find_locked(struct procstat_context *context, fuse_ino_t inode)
+{
+	struct procstat_item *item;
+
+	for (item = context->inodes[inode_bucket(inode)]; item; item = item->hash_next) {
+		if (item_inode(item) == inode && __atomic_load_n(&item->refcnt, __ATOMIC_RELAXED))
+			return item;
+	}
+	return NULL;
+}
+
+/* the kernel holds a lookup reference on @inode, so it is indexed */
+static struct procstat_item *synthesized_inode_item(struct procstat_context *context, fuse_ino_t inode)
+{
+	struct procstat_item *item;
+
+	pthread_mutex_lock(&context->inodes_lock);
+	item = synthesized_inode_find_locked(context, inode);
+	pthread_mutex_unlock(&context->inodes_lock);
+	assert(item);
+	return item;
+}
+
+/*
+ * A looked up synthesized file is indexed by its inode, so all the lookups of the same file share one
+ * object, whose references are the kernel lookup count.
+ */
+static struct procstat_file *template_file_lookup(struct procstat_context *context,
+						 struct procstat_file *synthesized)
+{
+	fuse_ino_t inode = item_inode(&synthesized->base);
+	struct procstat_item *item;
+	struct procstat_file *file = NULL;
+
+	pthread_mutex_lock(&context->inodes_lock);
+	item = synthesized_inode_find_locked(context, inode);
+	if (item && item_get_unless_zero(item)) {
+		file = container_of(item, struct procstat_file, base);
+	} else {
+		file = template_file_create(context, synthesized);
+		if (file) {
+			file->base.flags |= STATS_ENTRY_FLAG_LOOKED_UP;
+			file->base.hash_next = context->inodes[inode_bucket(inode)];
+			context->inodes[inode_bucket(inode)] = &file->base;
+		}
+	}
+	pthread_mutex_unlock(&context->inodes_lock);
+	return file;
+}
+
+static void synthesized_inode_remove(struct procstat_item *item)
+{
+	struct procstat_context *context = container_of(object_slab(item)->arena, struct procstat_context, arena);
+	struct procstat_item **iter;
+
+	pthread_mutex_lock(&context->inodes_lock);
+	for (iter = &context->inodes[inode_bucket(item_inode(item))]; *iter; iter = &(*iter)->hash_next) {
+		if (*iter == item) {
+			*iter = item->hash_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&context->inodes_lock);
+}
+
+static int template_materialize(struct procstat_context *context, struct procstat_directory *directory);
+
+static void fuse_lookup(fuse_req_t req, fuse_ino_t parent_inode, const char *name)
+{
+	struct procstat_context *context = request_context(req);
+	struct procstat_directory *parent;
+	struct procstat_item *item;
+	struct fuse_entry_param fuse_entry;
+	struct procstat_file synthesized, *file;
+	uint32_t name_hash;
+
+	memset(&fuse_entry, 0, sizeof(fuse_entry));
+
+	parent = fuse_inode_to_dir(context, parent_inode);
+	pthread_rwlock_rdlock(&parent->lock);
+	name_hash = string_hash(name);
+	item = lookup_item_locked(parent, name, name_hash);
+	if (!item && series_template(parent) && item_registered(&parent->base) &&
+	    template_lookup(container_of(parent, struct procstat_series, root), name, name_hash, &synthesized)) {
+		file = template_file_lookup(context, &synthesized);
+		pthread_rwlock_unlock(&parent->lock);
+		if (!file) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		item = &file->base;
+		goto reply;
+	}
+	if ((!item) || (!item_registered(item))) {
+		pthread_rwlock_unlock(&parent->lock);
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	item_get(item);
+	pthread_rwlock_unlock(&parent->lock);
+reply:
+	fuse_entry.ino = item_inode(item);
+	fuse_entry.attr_timeout = ATTRIBUTES_TIMEOUT_SEC;
+	fill_item_stats(context, item, &fuse_entry.attr);
+	fuse_reply_entry(req, &fuse_entry);
+}
+
+static void item_release(struct procstat_item *item);
+static void fuse_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	struct procstat_item *item = fuse_inode_to_item(request_context(req), ino);
+	int refcnt;
+
+	refcnt = __atomic_fetch_sub(&item->refcnt, (int)nlookup, __ATOMIC_ACQ_REL);
+	if (refcnt <= (int)nlookup)
+		item_release(item);
+	fuse_reply_none(req);
+}
+
+/* the kernel holds a lookup reference on the inode, so no lock is needed to access the item */
+static void fuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat stat;
+	struct procstat_context *context = request_context(req);
+	struct procstat_item *item;
+
+	memset(&stat, 0, sizeof(stat));
+	item = fuse_inode_to_item(context, ino);
+	if (!item_registered(item)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	fill_item_stats(context, item, &stat);
+	fuse_reply_attr(req, &stat, ATTRIBUTES_TIMEOUT_SEC);
+}
+
+static void fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		       size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct procstat_file *file = fuse_inode_to_file(request_context(req), ino);
+	int num_objects;
 
 	if (!file->writer) {
 		fuse_reply_err(req, EIO);
@@ -354,72 +1216,189 @@ static void fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 	return;
 }
 
-#define DEFAULT_BUFER_SIZE 1024
-static void fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+/*
+ * Directory listing built at opendir and shared by all the handles opened while the directory
+ * generation does not change. Cached under the directory lock, immutable once built.
+ */
+struct dir_listing {
+	int 	 refcnt; /* atomic */
+	uint64_t generation;
+	size_t 	 nentries;
+	size_t 	 *ends; /* offset past every entry, also used as the readdir offset cookie */
+	size_t 	 size;
+	char 	 *buffer;
+};
+
+static void dir_listing_put(struct dir_listing *listing)
 {
-	struct procstat_context *context = request_context(req);
-	static struct procstat_directory *dir;
-	static struct procstat_item *iter;
-	char *reply_buffer = NULL;
-	size_t bufsize;
-	size_t offset;
-	int alloc_factor = 0;
+	if (!listing || __atomic_sub_fetch(&listing->refcnt, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(listing->ends);
+	free(listing->buffer);
+	free(listing);
+}
 
-	pthread_mutex_lock(&context->global_lock);
-	dir = fuse_inode_to_dir(context, ino);
+static int dir_listing_add(fuse_req_t req, struct dir_listing *listing, size_t *capacity,
+			   const char *fname, struct stat *stat)
+{
+	size_t entry_size;
 
-	if (!item_registered(&dir->base)) {
-		pthread_mutex_unlock(&context->global_lock);
-		fuse_reply_err(req, ENOENT);
-		return;
+	entry_size = fuse_add_direntry(req, NULL, 0, fname, NULL, 0);
+	if (listing->size + entry_size > *capacity) {
+		size_t new_capacity = MAX(*capacity * 2, listing->size + entry_size);
+		char *new_buffer = realloc(listing->buffer, new_capacity);
+
+		if (!new_buffer)
+			return ENOMEM;
+		listing->buffer = new_buffer;
+		*capacity = new_capacity;
 	}
+	fuse_add_direntry(req, listing->buffer + listing->size, entry_size, fname, stat,
+			  listing->size + entry_size);
+	listing->size += entry_size;
+	listing->ends[listing->nentries++] = listing->size;
+	return 0;
+}
 
-	/* FIXME: currently it is very naive implementation which requires lots of reallocations
-	 * this can be improved with iovec. */
-	/**
-	 * FIXME: This is very inefficient since for every lookup this is called twice with offset 0 and with
-	 * offset past last, We need to "rebuild" it and save it between "opendir" and "releasedir"
-	 */
+static struct dir_listing *dir_listing_build_locked(fuse_req_t req, struct procstat_context *context,
+						    struct procstat_directory *dir)
+{
+	struct dir_listing *listing;
+	struct procstat_item *iter;
+	struct procstat_file synthesized;
+	struct procstat_series *series = NULL;
+	size_t capacity = 0;
+	size_t count = 0;
+	struct stat stat;
+	unsigned index;
+
+	listing = calloc(1, sizeof(*listing));
+	if (!listing)
+		return NULL;
+	listing->refcnt = 1;
+	listing->generation = dir->generation;
 
-	bufsize = 0;
-	offset = 0;
+	if (series_template(dir)) {
+		series = container_of(dir, struct procstat_series, root);
+		for (index = 0; template_file_init(series, index, &synthesized); ++index)
+			++count;
+	}
 	list_for_each_entry(iter, &dir->children, entry) {
-		const char *fname;
-		size_t entry_size;
-		struct stat stat;
+		if (!item_registered(iter))
+			continue;
+		if (iter->flags & STATS_ENTRY_FLAG_AGGREGATOR)
+			continue;
+		++count;
+	}
+	listing->ends = malloc(MAX(count, 1) * sizeof(*listing->ends));
+	if (!listing->ends)
+		goto free_listing;
+
+	for (index = 0; series && template_file_init(series, index, &synthesized); ++index) {
+		memset(&stat, 0, sizeof(stat));
+		fill_item_stats(context, &synthesized.base, &stat);
+		if (dir_listing_add(req, listing, &capacity, synthesized.base.iname, &stat))
+			goto free_listing;
+	}
 
+	list_for_each_entry(iter, &dir->children, entry) {
 		if (!item_registered(iter))
 			continue;
 		if (iter->flags & STATS_ENTRY_FLAG_AGGREGATOR)
 			continue;
 		memset(&stat, 0, sizeof(stat));
-		fname = procstat_item_name(iter);
 		fill_item_stats(context, iter, &stat);
-		entry_size = fuse_add_direntry(req, NULL, 0, fname, NULL, 0);
-		if (bufsize <= entry_size + offset) {
-			bufsize = DEFAULT_BUFER_SIZE * (1 << alloc_factor);
-			char *new_buffer = realloc(reply_buffer, bufsize);
-
-			++alloc_factor;
-			if (!new_buffer) {
-				pthread_mutex_unlock(&context->global_lock);
+		if (dir_listing_add(req, listing, &capacity, procstat_item_name(iter), &stat))
+			goto free_listing;
+	}
+	return listing;
+
+free_listing:
+	dir_listing_put(listing);
+	return NULL;
+}
+
+static void fuse_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct procstat_context *context = request_context(req);
+	struct procstat_directory *dir;
+	struct dir_listing *listing;
+
+	dir = fuse_inode_to_dir(context, ino);
+	if (!item_registered(&dir->base)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&dir->lock);
+	listing = dir->listing;
+	if (!listing || listing->generation != dir->generation) {
+		/* rebuild under the write lock, another opendir may have done it meanwhile */
+		pthread_rwlock_unlock(&dir->lock);
+		pthread_rwlock_wrlock(&dir->lock);
+		listing = dir->listing;
+		if (!listing || listing->generation != dir->generation) {
+			listing = dir_listing_build_locked(req, context, dir);
+			if (!listing) {
+				pthread_rwlock_unlock(&dir->lock);
 				fuse_reply_err(req, ENOMEM);
-				goto done;
+				return;
 			}
-			reply_buffer = new_buffer;
+			dir_listing_put(dir->listing);
+			dir->listing = listing;
 		}
-		fuse_add_direntry(req, reply_buffer + offset, entry_size, fname, &stat, offset + entry_size);
-		offset += entry_size;
 	}
+	__atomic_add_fetch(&listing->refcnt, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&dir->lock);
+	item_get(&dir->base);
+	fi->fh = (uint64_t)listing;
+	fuse_reply_open(req, fi);
+}
 
-	pthread_mutex_unlock(&context->global_lock);
-	if (off < offset)
-		fuse_reply_buf(req, reply_buffer + off, MIN(size, offset - off));
-	else
+/* The listing is immutable once built, so it is read without the directory lock */
+static void fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct dir_listing *listing = (struct dir_listing *)fi->fh;
+	size_t first, last, low, high;
+
+	if (!listing) {
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	if (off >= listing->size) {
 		fuse_reply_buf(req, NULL, 0);
-done:
-	free(reply_buffer);
-	return;
+		return;
+	}
+
+	/* reply only whole entries: find the last entry ending within off + size */
+	first = off;
+	low = 0;
+	high = listing->nentries;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+
+		if (listing->ends[mid] <= first + size)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	last = low ? listing->ends[low - 1] : 0;
+	if (last <= first) {
+		fuse_reply_err(req, ERANGE);
+		return;
+	}
+	fuse_reply_buf(req, listing->buffer + first, last - first);
+}
+
+static void fuse_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct procstat_context *context = request_context(req);
+	struct procstat_item *item = fuse_inode_to_item(context, ino);
+
+	dir_listing_put((struct dir_listing *)fi->fh);
+	item_put(item);
+	fuse_reply_err(req, 0);
 }
 
 static bool allowed_open(struct procstat_item *item, struct fuse_file_info *fi)
@@ -435,7 +1414,9 @@ static bool allowed_open(struct procstat_item *item, struct fuse_file_info *fi)
 }
 
 #define READ_BUFFER_SIZE 100
+/* per open file handle, lock serializes concurrent reads of the same handle */
 struct read_struct {
+	pthread_mutex_t lock;
 	ssize_t size;
 	char buffer[READ_BUFFER_SIZE];
 	void *ext;
@@ -454,32 +1435,31 @@ static void fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 		return;
 	}
 
-	pthread_mutex_lock(&context->global_lock);
-	item = (struct procstat_item *)(ino);
+	item = fuse_inode_to_item(context, ino);
 
 	if (!item_registered(item))
-		goto out_locked;
+		goto out;
 
 	if (!allowed_open(item, fi))
-		goto out_locked;
+		goto out;
 
+	pthread_mutex_init(&read_buffer->lock, NULL);
+	read_buffer->size = -1; /* formatted on the first read, at whatever offset */
 	read_buffer->ext = NULL;
 	fi->fh = (uint64_t)read_buffer;
 
 	/* we dont know size of file in advance so use directio*/
 	fi->direct_io = true;
 
-	++item->refcnt;
+	item_get(item);
 	if (item->flags & STATS_ENTRY_FLAG_AGGREGATOR)
-		++item->parent->base.refcnt;
+		item_get(&item->parent->base);
 
-	pthread_mutex_unlock(&context->global_lock);
 	fuse_reply_open(req, fi);
 
 	return;
 
-out_locked:
-	pthread_mutex_unlock(&context->global_lock);
+out:
 	free(read_buffer);
 	fuse_reply_err(req, ret);
 }
@@ -518,9 +1498,10 @@ static int out_item(struct out_stream *out, char *path, struct procstat_item *it
 		struct procstat_file *file = container_of(item, struct procstat_file, base);
 		int space = out->size - out->total;
 		size_t total = out->total;
+		int path_len;
 
 		if (!file->fmt)
-			return 0; /* skipping write-only files */
+			return 0; /* skipping write-only files and histories */
 		if (out->discard_lines) {
 			--out->discard_lines;
 			/*
@@ -531,14 +1512,19 @@ static int out_item(struct out_stream *out, char *path, struct procstat_item *it
 			++out->lines;
 			return 0;
 		}
-		len = snprintf(&out->buf[total], space, "%s/%s:", path, fname);
-		total += len > space ? space : len;
-		if (len > space)
+		/* "path/fname:", the value must fit after it too */
+		path_len = strlen(path);
+		len = strlen(fname);
+		if (path_len + 1 + len + 1 >= space)
 			return -1;
+		memcpy(&out->buf[total], path, path_len);
+		total += path_len;
+		out->buf[total++] = '/';
+		memcpy(&out->buf[total], fname, len);
+		total += len;
+		out->buf[total++] = ':';
 		space = out->size - total;
-		if (!space)
-			return -1;
-		len = file->fmt(file->private, file->arg, &out->buf[total], space);
+		len = file_format(file, &out->buf[total], space);
 		total += len > space ? space : len;
 		if (len > space)
 			return -1;
@@ -567,11 +1553,23 @@ static int out_item(struct out_stream *out, char *path, struct procstat_item *it
 		strncpy(path + pos, fname, p_space);
 		path[MAX_PATH_LEN - 1] = 0;
 
-		list_for_each_entry(child, &dir->children, entry) {
-			ret = out_item(out, path, child);
-			if (ret)
-				break;
+		pthread_rwlock_rdlock(&dir->lock);
+		if (series_template(dir)) {
+			struct procstat_series *series = container_of(dir, struct procstat_series, root);
+			struct procstat_file synthesized;
+			unsigned index;
+
+			for (index = 0; !ret && template_file_init(series, index, &synthesized); ++index)
+				ret = out_item(out, path, &synthesized.base);
+		}
+		if (!ret) {
+			list_for_each_entry(child, &dir->children, entry) {
+				ret = out_item(out, path, child);
+				if (ret)
+					break;
+			}
 		}
+		pthread_rwlock_unlock(&dir->lock);
 		path[path_len] = 0;
 	}
 
@@ -584,11 +1582,10 @@ static void aggregator_read(fuse_req_t req, struct procstat_file *file, struct r
 	struct procstat_directory *dir = file->base.parent;
 	struct list_head *last = &dir->children;
 	struct list_head *self = &file->base.entry;
+	struct procstat_item *previous = NULL;
 	struct out_stream out;
 	char path[MAX_PATH_LEN];
 
-	struct procstat_context *context = request_context(req);
-
 	if (!as || (as->buf_size < size + AGGR_EXTRA_BYTES)) {
 		struct aggregator_context c;
 
@@ -633,15 +1630,14 @@ static void aggregator_read(fuse_req_t req, struct procstat_file *file, struct r
 	/*
 	 * While the aggregator node is open, the node and the parent directory node cannot be freed, so setting "last" above was safe.
 	 */
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_rdlock(&dir->lock);
 
 	if (!as->c.current) {
 		as->c.current = dir->children.next;
 	} else if (as->c.current != last) {
-		struct procstat_item *current = container_of(as->c.current, struct procstat_item, entry);
-		--current->refcnt;
+		previous = container_of(as->c.current, struct procstat_item, entry);
 		/* If this node has been deleted it is removed from parent's children list */
-		if (list_empty(&current->entry)) {
+		if (list_empty(&previous->entry)) {
 			as->c.current = last;
 		}
 	}
@@ -672,964 +1668,4037 @@ static void aggregator_read(fuse_req_t req, struct procstat_file *file, struct r
 
 	/* Protect the current item from being freed, so we can safely access it next time */
 	if (as->c.current != last)
-		++(container_of(as->c.current, struct procstat_item, entry)->refcnt);
+		item_get(container_of(as->c.current, struct procstat_item, entry));
 
 	as->c.off += out.total;
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&dir->lock);
+	if (previous)
+		item_put(previous);
 	fuse_reply_buf(req, &out.buf[0], out.total);
 }
 
-static void aggregator_release_locked(struct procstat_item *item, struct fuse_file_info *fi)
-{
-	struct read_struct *rs = (struct read_struct *)fi->fh;
+struct growbuf {
+	char 	*buf;
+	size_t 	len;
+	size_t 	size;
+};
 
-	if (rs) {
-		struct aggregator_struct *as = (struct aggregator_struct *)rs->ext;
+#define GROWBUF_MIN_SIZE 256
+static int growbuf_reserve(struct growbuf *b, size_t n)
+{
+	size_t size;
+	char *buf;
 
-		if (as && as->c.current) {
-			if (as->c.current != &item->parent->children) {
-				struct procstat_item *current = container_of(as->c.current, struct procstat_item, entry);
+	if (b->len + n <= b->size)
+		return 0;
 
-				--current->refcnt;
-			}
-		}
-	}
-	--item->parent->base.refcnt;
+	size = MAX(MAX(b->size * 2, b->len + n), GROWBUF_MIN_SIZE);
+	buf = realloc(b->buf, size);
+	if (!buf)
+		return ENOMEM;
+	b->buf = buf;
+	b->size = size;
+	return 0;
 }
 
-static void fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+static int growbuf_append(struct growbuf *b, const char *data, size_t n)
 {
-	struct read_struct *read_buffer = (struct read_struct *)fi->fh;
-	struct procstat_file *file = fuse_inode_to_file(ino);
-
-	if (file->base.flags & STATS_ENTRY_FLAG_AGGREGATOR) {
-		aggregator_read(req, file, read_buffer, size, off);
-		return;
-	}
+	if (!n)
+		return 0;
+	if (growbuf_reserve(b, n))
+		return ENOMEM;
+	memcpy(&b->buf[b->len], data, n);
+	b->len += n;
+	return 0;
+}
 
-	/*
-	 * An item unregistered via procstat_remove may still be reached here: the item itself has refcnt held from fuse_open.
-	 * If so, the owner may have freed the item stat memory, which is still ok to read.
-	 * HOWEVER, writing to this memory is prohibited and may cause memory corruption.
-	 * Write is possible only for series (see is_reset() and clear_values_...).
-	 * The item itself may not be marked as unregistered (refcnt != 0 in item_put_locked),
-	 * but since series are removed by directory we can rely on parent being marked as unregistered by procstat_remove().
-	 */
-	if (!file->fmt || !file->base.parent || !item_registered(&file->base.parent->base)) {
-		fuse_reply_buf(req, NULL, 0);
-		return;
+/* formatters are snprintf alike, retry with the required space once it is known */
+static int growbuf_format_file(struct growbuf *b, struct procstat_file *file)
+{
+	size_t space = READ_BUFFER_SIZE;
+	ssize_t len;
+
+	for (;;) {
+		if (growbuf_reserve(b, space))
+			return ENOMEM;
+		space = b->size - b->len;
+		len = file_format(file, &b->buf[b->len], space);
+		if (len < 0)
+			return 0;
+		if ((size_t)len < space)
+			break;
+		space = len + 1;
 	}
+	b->len += len;
+	return 0;
+}
 
-	if (off == 0)
-		read_buffer->size = file->fmt(file->private, file->arg, read_buffer->buffer, READ_BUFFER_SIZE);
+/*
+ * Output of stream files, and of formatters that do not fit READ_BUFFER_SIZE. It is kept in a chain
+ * of chunks which are passed to fuse_reply_iov() as they are, so large output is never moved or copied.
+ */
+#define STREAM_CHUNK_SIZE (16 * 1024)
+#define STREAM_MAX_IOV 64
+
+struct stream_chunk {
+	struct stream_chunk 	*next;
+	size_t 			len;
+	size_t 			size;
+	char 			data[0];
+};
 
-	if (off >= read_buffer->size) {
-		fuse_reply_buf(req, NULL, 0);
-		return;
-	}
+struct procstat_stream {
+	struct stream_chunk 	*head;
+	struct stream_chunk 	*tail;
+	size_t 			size;
+	/* sequential reads continue from the chunk the previous one started in */
+	struct stream_chunk 	*cursor;
+	size_t 			cursor_off;
+};
 
-	fuse_reply_buf(req, (char *)read_buffer->buffer + off, read_buffer->size - off);
-}
+struct procstat_stream_file {
+	struct procstat_file 		file;
+	procstat_stream_formatter 	formatter;
+};
 
-static bool valid_filename(const char *name)
+static void stream_clear(struct procstat_stream *stream)
 {
-	const char *c;
+	struct stream_chunk *chunk, *next;
 
-	for (c = name; *c; ++c) {
-		if (isalnum(*c) || (*c == '.') || (*c == '_') || (*c == '-'))
-			continue;
-		return false;
+	for (chunk = stream->head; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
 	}
-	return true;
+	memset(stream, 0, sizeof(*stream));
 }
 
-static void init_item(struct procstat_item *item, const char *name)
+/* Returns room for @len contiguous bytes at the end of @stream, a new chunk is added if needed */
+static char *stream_reserve(struct procstat_stream *stream, size_t len)
 {
-	size_t name_len = strlen(name);
+	struct stream_chunk *chunk = stream->tail;
+	size_t size;
 
-	item->name_hash = string_hash(name);
-	if (name_len < DNAME_INLINE_LEN)
-		strcpy(item->iname, name);
-	else {
-		item->name.zero = 0;
-		item->name.buffer = strdup(name);
-	}
-	INIT_LIST_HEAD(&item->entry);
-}
-
-static struct procstat_file *allocate_file_item(const char *name,
-					   	void *priv,
-						procstats_formatter fmt,
-						procstats_formatter writer)
-{
-	struct procstat_file *file;
+	if (chunk && chunk->size - chunk->len >= len)
+		return &chunk->data[chunk->len];
 
-	file = calloc(1, sizeof(*file));
-	if (!file)
+	size = MAX(STREAM_CHUNK_SIZE - sizeof(*chunk), len);
+	chunk = malloc(sizeof(*chunk) + size);
+	if (!chunk)
 		return NULL;
-
-	init_item(&file->base, name);
-	file->private = priv;
-	file->fmt = fmt;
-	file->writer = writer;
-	return file;
+	chunk->next = NULL;
+	chunk->len = 0;
+	chunk->size = size;
+	if (stream->tail)
+		stream->tail->next = chunk;
+	else
+		stream->head = chunk;
+	stream->tail = chunk;
+	return chunk->data;
 }
 
-static int register_item(struct procstat_context *context,
-			 struct procstat_item *item,
-			 struct procstat_directory *parent)
+static void stream_commit(struct procstat_stream *stream, size_t len)
 {
-	if (likely(parent)) {
-		struct procstat_item *duplicate;
-		bool locked = false;
-
-		if (unlikely(root_directory(context, parent))) {
-			/* Only root directory can be modified concurrently by different threads */
-			pthread_mutex_lock(&context->global_lock);
-			locked = true;
-		}
-
-		duplicate = lookup_item_locked(parent, procstat_item_name(item), item->name_hash);
-		if (unlikely(duplicate)) {
-			if (locked)
-				pthread_mutex_unlock(&context->global_lock);
-			return EEXIST;
-		}
-
-		if (likely(!locked))
-			pthread_mutex_lock(&context->global_lock);
+	stream->tail->len += len;
+	stream->size += len;
+}
 
-		list_add_tail(&item->entry, &parent->children);
-	} else {
-		pthread_mutex_lock(&context->global_lock);
+int procstat_stream_write(struct procstat_stream *stream, const void *data, size_t len)
+{
+	struct stream_chunk *chunk = stream->tail;
+	const char *src = data;
+	char *dst;
+	size_t n;
+
+	/* fill up the tail chunk, the rest goes to a new one */
+	if (chunk) {
+		n = MIN(len, chunk->size - chunk->len);
+		memcpy(&chunk->data[chunk->len], src, n);
+		stream_commit(stream, n);
+		src += n;
+		len -= n;
 	}
+	if (!len)
+		return 0;
 
-
-	item->flags |= STATS_ENTRY_FLAG_REGISTERED;
-	item->refcnt = 1;
-	item->parent = parent;
-	pthread_mutex_unlock(&context->global_lock);
+	dst = stream_reserve(stream, len);
+	if (!dst) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(dst, src, len);
+	stream_commit(stream, len);
 	return 0;
 }
 
-static int init_directory(struct procstat_context *context,
-			  struct procstat_directory *directory,
-			  const char *name,
-			  struct procstat_directory *parent)
+int procstat_stream_printf(struct procstat_stream *stream, const char *fmt, ...)
 {
-	int error;
+	struct stream_chunk *chunk = stream->tail;
+	size_t space = chunk ? chunk->size - chunk->len : 0;
+	va_list args;
+	char *dst;
+	int len;
 
-	init_item(&directory->base, name);
-	directory->base.flags = STATS_ENTRY_FLAG_DIR;
-	INIT_LIST_HEAD(&directory->children);
-	error = register_item(context, &directory->base, parent);
-	if (error)
-		return error;
+	va_start(args, fmt);
+	len = vsnprintf(chunk ? &chunk->data[chunk->len] : NULL, space, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return -1;
 
+	/* does not fit the tail chunk, format again into a new one */
+	if ((size_t)len >= space) {
+		dst = stream_reserve(stream, len + 1);
+		if (!dst) {
+			errno = ENOMEM;
+			return -1;
+		}
+		va_start(args, fmt);
+		vsnprintf(dst, len + 1, fmt, args);
+		va_end(args);
+	}
+	stream_commit(stream, len);
 	return 0;
 }
 
-static void item_put_locked(struct procstat_item *item);
-static void item_put_children_locked(struct procstat_directory *directory)
+/* formatters are snprintf alike, retry with the required space once it is known */
+static int stream_format_file(struct procstat_stream *stream, struct procstat_file *file, size_t len)
 {
-	struct procstat_item *iter, *n;
-	list_for_each_entry_safe(iter, n, &directory->children, entry) {
-		iter->parent = NULL;
-		list_del_init(&iter->entry);
-		item_put_locked(iter);
+	size_t space;
+	ssize_t ret;
+	char *dst;
+
+	for (;;) {
+		dst = stream_reserve(stream, len + 1);
+		if (!dst)
+			return ENOMEM;
+		space = stream->tail->size - stream->tail->len;
+		ret = file_format(file, dst, space);
+		if (ret < 0)
+			return 0;
+		if ((size_t)ret < space)
+			break;
+		len = ret;
 	}
+	stream_commit(stream, ret);
+	return 0;
 }
 
-static void item_put_locked(struct procstat_item *item)
+static void stream_reply(fuse_req_t req, struct procstat_stream *stream, size_t size, size_t off)
 {
-	assert(item->refcnt);
+	struct iovec iov[STREAM_MAX_IOV];
+	struct stream_chunk *chunk = stream->head;
+	size_t chunk_off = 0;
+	size_t n;
+	int count = 0;
 
-	if (--item->refcnt)
+	if (off >= stream->size) {
+		fuse_reply_buf(req, NULL, 0);
 		return;
+	}
 
-	item->flags &= ~STATS_ENTRY_FLAG_REGISTERED;
-	if (item_type_directory(item))
-		item_put_children_locked((struct procstat_directory *)item);
-
-	free_item(item);
+	if (stream->cursor && stream->cursor_off <= off) {
+		chunk = stream->cursor;
+		chunk_off = stream->cursor_off;
+	}
+	while (chunk_off + chunk->len <= off) {
+		chunk_off += chunk->len;
+		chunk = chunk->next;
+	}
+	stream->cursor = chunk;
+	stream->cursor_off = chunk_off;
+
+	/* a reply longer than STREAM_MAX_IOV chunks is cut short, the reader asks for the rest */
+	off -= chunk_off;
+	for (; chunk && size && count < STREAM_MAX_IOV; chunk = chunk->next) {
+		n = MIN(size, chunk->len - off);
+		if (!n)
+			continue;
+		iov[count].iov_base = &chunk->data[off];
+		iov[count].iov_len = n;
+		++count;
+		size -= n;
+		off = 0;
+	}
+	fuse_reply_iov(req, iov, count);
 }
 
-static struct procstat_item *parent_or_root(struct procstat_context *context, struct procstat_item *parent)
+/* The formatter runs on a read at offset 0, and on the first read after open */
+static void stream_read(fuse_req_t req, struct procstat_file *file, struct read_struct *rs, size_t size, off_t off)
 {
-	if (!parent)
-		return &context->root.base;
-	else if (item_type_directory(parent))
-		return parent;
-	return NULL;
-}
+	struct procstat_stream_file *stream_file = container_of(file, struct procstat_stream_file, file);
+	struct procstat_stream *stream = rs->ext;
+	bool format = !off;
+
+	if (!stream) {
+		stream = calloc(1, sizeof(*stream));
+		if (!stream) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		rs->ext = stream;
+		format = true;
+	}
 
-static struct procstat_file *create_file(struct procstat_context *context,
-					 struct procstat_directory *parent,
-					 const char *name, void *item,
-					 procstats_formatter fmt, procstats_formatter writer)
-{
-	struct procstat_file *file;
-	int error;
+	if (format) {
+		stream_clear(stream);
+		errno = 0;
+		if (stream_file->formatter(file->private, file->arg, stream)) {
+			int error = errno ? errno : EIO;
 
-	if (!valid_filename(name)) {
-		errno = -EINVAL;
-		return NULL;
+			stream_clear(stream);
+			fuse_reply_err(req, error);
+			return;
+		}
 	}
+	stream_reply(req, stream, size, off);
+}
 
-	file = allocate_file_item(name, item, fmt, writer);
-	if (!file) {
-		errno = ENOMEM;
-		return NULL;
-	}
 
-	error = register_item(context,&file->base, parent);
-	if (error) {
-		errno = error;
-		free_item(&file->base);
-		return NULL;
+struct snapshot_entry {
+	struct procstat_file 	*file;
+	size_t 			path; /* offset of the parent directory path in snapshot_walk paths */
+};
 
-	}
-	return file;
-}
+struct walked_directory {
+	struct procstat_directory *directory;
+	uint64_t 		  generation; /* at the walk */
+};
 
-struct procstat_item *procstat_create_directory(struct procstat_context *context,
-					   	struct procstat_item *parent,
-						const char *name)
-{
-	struct procstat_directory *new_directory;
-	int error;
+struct snapshot_walk {
+	struct snapshot_entry 	*entries;
+	size_t 			nentries;
+	size_t 			capacity;
+	struct walked_directory *directories;
+	size_t 			ndirectories;
+	size_t 			directories_capacity;
+	struct growbuf 		paths;
+	struct growbuf 		path; /* of the current directory */
+	size_t 			current; /* offset of the current directory path in paths */
+	struct procstat_item 	*self;
+	struct procstat_context *context;
+};
 
-	parent = parent_or_root(context, parent);
-	if (!parent) {
-		errno = EINVAL;
-		return NULL;
-	}
+/*
+ * @walk is kept by binary aggregators, so that the next frames of the same handle
+ * reuse its dictionary, @base is the offset of @buffer in the read stream.
+ */
+struct aggregator_snapshot {
+	struct growbuf 		buffer;
+	struct snapshot_walk 	walk;
+	off_t 			base;
+	bool 			eof; /* end of the current frame was read */
+};
 
-	if (!valid_filename(name)) {
-		errno = -EINVAL;
-		return NULL;
-	}
+static int snapshot_add_file(struct snapshot_walk *walk, struct procstat_file *file)
+{
+	struct snapshot_entry *entry;
 
-	new_directory = calloc(1, sizeof(*new_directory));
-	if (!new_directory) {
-		errno = ENOMEM;
-		return NULL;
-	}
+	if (walk->nentries == walk->capacity) {
+		size_t capacity = MAX(walk->capacity * 2, 64);
 
-	error = init_directory(context, new_directory, name, (struct procstat_directory *)parent);
-	if (error) {
-		free_directory(new_directory);
-		errno = error;
-		return NULL;
+		entry = realloc(walk->entries, capacity * sizeof(*entry));
+		if (!entry)
+			return ENOMEM;
+		walk->entries = entry;
+		walk->capacity = capacity;
 	}
 
-	return &new_directory->base;
+	entry = &walk->entries[walk->nentries++];
+	entry->file = file;
+	entry->path = walk->current;
+	item_get(&file->base);
+	return 0;
 }
 
-void procstat_remove(struct procstat_context *context, struct procstat_item *item)
+/* Called with @directory read locked, the walk holds a reference on it */
+static int snapshot_add_directory(struct snapshot_walk *walk, struct procstat_directory *directory)
 {
-	struct procstat_directory *directory;
-
-	assert(context);
-	assert(item);
+	struct walked_directory *walked;
 
-	pthread_mutex_lock(&context->global_lock);
-	if (!item_type_directory(item))
-		goto remove_item;
+	if (walk->ndirectories == walk->directories_capacity) {
+		size_t capacity = MAX(walk->directories_capacity * 2, 16);
 
-	directory = (struct procstat_directory *)item;
-	if (root_directory(context, directory)) {
-		item_put_children_locked(directory);
-		goto done;
+		walked = realloc(walk->directories, capacity * sizeof(*walked));
+		if (!walked)
+			return ENOMEM;
+		walk->directories = walked;
+		walk->directories_capacity = capacity;
 	}
 
-remove_item:
-	item->flags &= ~STATS_ENTRY_FLAG_REGISTERED;
-	list_del_init(&item->entry); /* Make it not discoverable */
-	item_put_locked(item);
-done:
-	pthread_mutex_unlock(&context->global_lock);
+	walked = &walk->directories[walk->ndirectories++];
+	walked->directory = directory;
+	walked->generation = directory->generation;
+	item_get(&directory->base);
+	return 0;
 }
 
-int procstat_remove_by_name(struct procstat_context *context,
-			    struct procstat_item *parent,
-			    const char *name)
+static int snapshot_enter_directory(struct snapshot_walk *walk, struct procstat_directory *directory)
 {
-	struct procstat_item *item;
-
-	parent = parent_or_root(context, parent);
-	if (!parent) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	pthread_mutex_lock(&context->global_lock);
-	item = lookup_item_locked((struct procstat_directory *)parent,
-				  name, string_hash(name));
-	if (!item) {
-		pthread_mutex_unlock(&context->global_lock);
-		return ENOENT;
-	}
-	item->flags &= ~STATS_ENTRY_FLAG_REGISTERED;
-	list_del_init(&item->entry); /* Make it not discoverable */
-	item_put_locked(item);
-	pthread_mutex_unlock(&context->global_lock);
+	if (snapshot_add_directory(walk, directory))
+		return ENOMEM;
+	walk->current = walk->paths.len;
+	if (growbuf_append(&walk->paths, walk->path.buf, walk->path.len) ||
+	    growbuf_append(&walk->paths, "", 1))
+		return ENOMEM;
 	return 0;
 }
 
-int procstat_create_simple(struct procstat_context *context,
-			   struct procstat_item *parent,
-			   struct procstat_simple_handle *descriptors,
-			   size_t descriptors_size)
+/* Same output as out_item(), but the path is not limited in length. Called with @directory read locked */
+static int snapshot_collect_locked(struct snapshot_walk *walk, struct procstat_directory *directory)
 {
-	int i;
+	struct procstat_item *child;
+	int error;
 
-	parent = parent_or_root(context, parent);
-	if (!parent) {
-		errno = EINVAL;
-		return -1;
+	error = snapshot_enter_directory(walk, directory);
+	if (error)
+		return error;
+
+	if (series_template(directory)) {
+		struct procstat_series *series = container_of(directory, struct procstat_series, root);
+		struct procstat_file synthesized, *file;
+		unsigned index;
+
+		for (index = 0; template_file_init(series, index, &synthesized); ++index) {
+			if (!synthesized.fmt)
+				continue;
+			/* the walk takes its own reference, the file goes with it */
+			file = template_file_create(walk->context, &synthesized);
+			if (!file)
+				return ENOMEM;
+			error = snapshot_add_file(walk, file);
+			item_put(&file->base);
+			if (error)
+				return error;
+		}
 	}
 
-	for (i = 0; i < descriptors_size; ++i) {
-		struct procstat_file *file;
-		struct procstat_simple_handle *descriptor = &descriptors[i];
+	list_for_each_entry(child, &directory->children, entry) {
+		if (child == walk->self)
+			continue;
 
-		file = create_file(context, (struct procstat_directory *)parent,
-				   descriptor->name, descriptor->object,
-				   descriptor->fmt, descriptor->writer);
-		if (!file) {
-			--i;
-			goto error_release;
+		if (item_type_directory(child)) {
+			const char *name = procstat_item_name(child);
+			size_t path_len = walk->path.len;
+			size_t current = walk->current;
+
+			/* See fuse_read(): it is unsafe to read files under a directory that is marked unregistered */
+			if (!item_registered(child))
+				continue;
+			if ((path_len && growbuf_append(&walk->path, "/", 1)) ||
+			    growbuf_append(&walk->path, name, strlen(name)))
+				return ENOMEM;
+			pthread_rwlock_rdlock(&((struct procstat_directory *)child)->lock);
+			error = snapshot_collect_locked(walk, (struct procstat_directory *)child);
+			pthread_rwlock_unlock(&((struct procstat_directory *)child)->lock);
+			walk->path.len = path_len;
+			walk->current = current;
+			if (error)
+				return error;
+		} else {
+			struct procstat_file *file = container_of(child, struct procstat_file, base);
+
+			if (!file->fmt)
+				continue; /* skipping write-only files, aggregators and histories */
+			error = snapshot_add_file(walk, file);
+			if (error)
+				return error;
 		}
-		file->arg = descriptor->arg;
 	}
 	return 0;
-error_release:
-
-	for (; i >= 0; --i)
-		procstat_remove_by_name(context, parent, descriptors[i].name);
-	return -1;
 }
 
-int procstat_create_aggregator(struct procstat_context *context,
-			      struct procstat_item *parent,
-			      const char *name)
+static bool snapshot_entry_readable(struct snapshot_entry *entry)
 {
-	parent = parent_or_root(context, parent);
-	if (!parent) {
-		errno = EINVAL;
-		return -1;
-	}
+	struct procstat_file *file = entry->file;
 
-	struct procstat_file *file;
+	return file->base.parent && item_registered(&file->base.parent->base);
+}
 
-	file = create_file(context, (struct procstat_directory *)parent,
-			   name, NULL, NULL, NULL);
-	if (!file)
-		return -1;
+/* formats the value of @entry into @value as a string, without the trailing new line */
+static int snapshot_format_value(struct growbuf *value, struct snapshot_entry *entry)
+{
+	int error;
+
+	value->len = 0;
+	error = growbuf_format_file(value, entry->file);
+	if (error)
+		return error;
+	while (value->len && isspace(value->buf[value->len - 1]))
+		--value->len;
+	return growbuf_append(value, "", 1);
+}
 
-	file->base.flags |= STATS_ENTRY_FLAG_AGGREGATOR;
+/* decimal numbers only, strtod() also accepts hex, inf and nan which are not valid in the serialized formats */
+static bool numeric_value(const char *value)
+{
+	char *end;
 
-	return 0;
+	if (!isdigit(*value) && !(*value == '-' && isdigit(value[1])))
+		return false;
+	if (strpbrk(value, "xXnN"))
+		return false;
+	strtod(value, &end);
+	return !*end;
 }
 
-bool is_reset(struct reset_info* reset)
+static int serialize_text(struct growbuf *out, struct snapshot_walk *walk)
 {
-	unsigned reset_requested = 0;
-	bool reset_interval_expired = false;
-	uint64_t reset_interval, time_since_last_reset;
+	size_t i;
+	int error = 0;
 
-	struct timespec cur_time;
-	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time) == 0) {
-		time_since_last_reset = cur_time.tv_sec - reset->last_reset_time;
-		reset_interval = __atomic_load_n(&reset->reset_interval, __ATOMIC_RELAXED);
-		if ((reset_interval) && (time_since_last_reset > reset_interval)) {
-			reset_interval_expired = true;
-			reset->last_reset_time = cur_time.tv_sec;
-		}
-	}
+	for (i = 0; !error && i < walk->nentries; ++i) {
+		struct snapshot_entry *entry = &walk->entries[i];
+		const char *path = &walk->paths.buf[entry->path];
+		const char *name = procstat_item_name(&entry->file->base);
 
-	if (reset_interval_expired == false) {
-		reset_requested = __atomic_load_n(&reset->reset_flag, __ATOMIC_RELAXED);
+		if (!snapshot_entry_readable(entry))
+			continue;
+		error = growbuf_append(out, path, strlen(path)) ||
+			growbuf_append(out, "/", 1) ||
+			growbuf_append(out, name, strlen(name)) ||
+			growbuf_append(out, ":", 1) ? ENOMEM : 0;
+		if (!error)
+			error = growbuf_format_file(out, entry->file);
 	}
+	return error;
+}
 
-	if (reset_interval_expired || reset_requested) {
-		return true;
-	} else {
-		return false;
+/* metric name made of the path components, invalid characters are replaced with '_' */
+static int openmetrics_append_name(struct growbuf *out, const char *path, const char *name)
+{
+	const char *parts[] = {path, name};
+	size_t start = out->len;
+	size_t i;
+	const char *c;
+
+	for (i = 0; i < ARRAY_SIZE(parts); ++i) {
+		if (!parts[i] || !*parts[i])
+			continue;
+		if (out->len != start && growbuf_append(out, "_", 1))
+			return ENOMEM;
+		for (c = parts[i]; *c; ++c) {
+			char ch = (isalnum(*c) || *c == '_' || *c == ':') ? *c : '_';
+
+			if (out->len == start && isdigit(ch) && growbuf_append(out, "_", 1))
+				return ENOMEM;
+			if (growbuf_append(out, &ch, 1))
+				return ENOMEM;
+		}
 	}
+	return 0;
 }
 
-void clear_values_series(struct procstat_series_u64 *series)
+static int openmetrics_append_metric(struct growbuf *out, const char *type, const char *path,
+				     const char *name, const char *value)
 {
-	series->count = 0;
-	series->sum = 0;
-	series->mean = 0;
-	series->aggregated_variance = 0;
-	series->min = ULLONG_MAX;
-	series->max = 0;
-	__atomic_store_n(&series->reset.reset_flag, 0, __ATOMIC_RELEASE);
+	size_t start;
+	size_t len;
+
+	if (growbuf_append(out, "# TYPE ", 7))
+		return ENOMEM;
+	start = out->len;
+	if (openmetrics_append_name(out, path, name))
+		return ENOMEM;
+	len = out->len - start;
+	if (growbuf_reserve(out, len + strlen(type) + strlen(value) + 3))
+		return ENOMEM;
+	out->len += sprintf(&out->buf[out->len], " %s\n", type);
+	/* the name is copied after reserve, so the source is not moved by realloc */
+	memcpy(&out->buf[out->len], &out->buf[start], len);
+	out->len += len;
+	return growbuf_append(out, " ", 1) || growbuf_append(out, value, strlen(value)) ||
+	       growbuf_append(out, "\n", 1) ? ENOMEM : 0;
 }
 
-void procstat_u64_series_add_point(struct procstat_series_u64 *series, uint64_t value)
-{
-	int64_t delta;
-	int64_t delta2;
-	int64_t avg_delta;
+bool is_reset(struct reset_info *reset);
+static void histogram_reset(struct procstat_histogram_u32 *series);
+static void merge_histogram_shards(struct procstat_histogram_u32 *series, bool histogram);
+static void clear_values_histogram_u64(struct procstat_histogram_u64 *series);
 
-	if (is_reset(&series->reset)) 
-		clear_values_series(series);
+static int openmetrics_append_bucket(struct growbuf *out, const char *path, const char *le, uint64_t count)
+{
+	if (openmetrics_append_name(out, path, NULL) || growbuf_reserve(out, strlen(le) + 48))
+		return ENOMEM;
+	out->len += sprintf(&out->buf[out->len], "_bucket{le=\"%s\"} %lu\n", le, count);
+	return 0;
+}
 
-	if (value < series->min)
-		series->min = value;
-	if (value > series->max)
-		series->max = value;
-	++series->count;
-	series->last = value;
-	series->sum += value;
+/*
+ * Cumulative counts of the non empty buckets, taken under the series read lock like the binary
+ * serializer does. The last bucket also counts all larger values, so it goes to +Inf only.
+ * Count is the sum of the buckets rather than the count file, so the family stays consistent
+ * while points are recorded.
+ */
+static int openmetrics_append_buckets(struct growbuf *out, const char *path, struct procstat_series *series_stat)
+{
+	pthread_mutex_t *lock = series_read_lock(&series_stat->root);
+	bool u32 = series_stat->root.base.flags & STATS_ENTRY_FLAG_HISTOGRAM;
+	struct procstat_histogram_u32 *series_u32 = series_stat->private;
+	struct procstat_histogram_u64 *series_u64 = series_stat->private;
+	uint64_t count = 0;
+	unsigned nbuckets;
+	uint64_t bucket;
+	uint64_t sum;
+	char le[24];
+	unsigned i;
+	int error = 0;
+
+	pthread_mutex_lock(lock);
+	if (u32) {
+		histogram_reset(series_u32);
+		if (series_u32->shards)
+			merge_histogram_shards(series_u32, true);
+		nbuckets = PROCSTAT_PERCENTILE_ARR_NR;
+		sum = series_u32->sum;
+	} else {
+		if (is_reset(&series_u64->reset))
+			clear_values_histogram_u64(series_u64);
+		nbuckets = series_u64->geometry.nbuckets;
+		sum = series_u64->sum;
+	}
 
-	/* Calculate mean and estimated variance according to Welford algorithm
-	 * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance*/
-	delta = (int64_t)value - series->mean;
-	avg_delta = delta / (int64_t)series->count;
-	series->mean = (int64_t)series->mean + avg_delta;
-	delta2 = (int64_t)value - series->mean;
-	series->aggregated_variance += delta * delta2;
-}
+	for (i = 0; !error && i < nbuckets; ++i) {
+		bucket = u32 ? __atomic_load_n(&series_u32->histogram[i], __ATOMIC_RELAXED) :
+			       __atomic_load_n(&series_u64->histogram[i], __ATOMIC_RELAXED);
+		if (!bucket)
+			continue;
+		count += bucket;
+		if (i == nbuckets - 1)
+			break;
+		sprintf(le, "%lu", u32 ? procstat_hist_index_upper_bound(i) :
+					 procstat_hist_u64_index_upper_bound(&series_u64->geometry, i));
+		error = openmetrics_append_bucket(out, path, le, count);
+	}
+	pthread_mutex_unlock(lock);
+	if (error)
+		return error;
 
-enum series_u64_type{
-	SERIES_SUM = 0,
-	SERIES_COUNT = 1,
-	SERIES_MIN = 2,
-	SERIES_MAX = 3,
-	SERIES_LAST = 4,
-	SERIES_AVG = 5,
-	SERIES_MEAN = 6,
-	SERIES_STDEV = 7,
-	SERIES_RESET_INTERVAL = 8,
-};
+	if (openmetrics_append_bucket(out, path, "+Inf", count) || openmetrics_append_name(out, path, NULL) ||
+	    growbuf_reserve(out, 64))
+		return ENOMEM;
+	out->len += sprintf(&out->buf[out->len], "_sum %lu\n", sum);
+	if (openmetrics_append_name(out, path, NULL) || growbuf_reserve(out, 64))
+		return ENOMEM;
+	out->len += sprintf(&out->buf[out->len], "_count %lu\n", count);
+	return 0;
+}
 
-static ssize_t series_u64_read(void *object, uint64_t arg, char *buffer, size_t len)
+static int openmetrics_append_quantiles(struct growbuf *out, struct growbuf *value, struct snapshot_walk *walk,
+					size_t first, size_t last)
 {
-	struct procstat_series_u64 *series = object;
-	enum series_u64_type type = arg;
-	uint64_t *data_ptr = NULL;
-	uint64_t data;
-	uint64_t count;
+	const char *path = &walk->paths.buf[walk->entries[first].path];
+	size_t i;
+	int error;
 
-	if (is_reset(&series->reset))
-		clear_values_series(series);
+	for (i = first; i < last; ++i) {
+		struct snapshot_entry *entry = &walk->entries[i];
+		const char *name = procstat_item_name(&entry->file->base);
+		bool quantile = numeric_value(name);
 
-	count = *((volatile uint64_t *)&series->count);
-	switch (type) {
-	case SERIES_SUM:
-		data_ptr = &series->sum;
-		goto write_var;
-	case SERIES_COUNT:
-		data_ptr = &series->count;
-		goto write_var;
-	case SERIES_LAST:
-		data_ptr = &series->last;
-		goto write_var;
-	case SERIES_MEAN:
-		data_ptr = &series->mean;
-		goto write_var;
-	case SERIES_MIN:
-		data_ptr = &series->min;
-		goto write_var;
-	case SERIES_MAX:
-		data_ptr = &series->max;
-		goto write_var;
-	case SERIES_AVG:
-		if (!count)
-			goto write_zero;
-		data = series->sum / count;
-		data_ptr = &data;
-		goto write_var;
-	case SERIES_STDEV:
-		if (count < 2)
-			goto write_zero;
-		data = series->aggregated_variance / (count - 1);
-		data_ptr = &data;
-		goto write_var;
-	case SERIES_RESET_INTERVAL:
-		data = series->reset.reset_interval;
-		data_ptr = &data;
-		goto write_var;
-	default:
-		return -1;
-	}
-write_zero:
-	return snprintf(buffer, len, "0\n");
-write_var:
-	return procstat_format_u64_decimal(data_ptr, arg, buffer, len);
+		if (!quantile && strcmp(name, "sum") && strcmp(name, "count"))
+			continue;
+		if (!snapshot_entry_readable(entry))
+			continue;
+		error = snapshot_format_value(value, entry);
+		if (error)
+			return error;
+		if (!numeric_value(value->buf))
+			continue;
 
+		if (openmetrics_append_name(out, path, NULL))
+			return ENOMEM;
+		if (quantile) {
+			if (growbuf_reserve(out, 64))
+				return ENOMEM;
+			out->len += sprintf(&out->buf[out->len], "{quantile=\"%g\"}", strtod(name, NULL) / 100);
+		} else if (growbuf_append(out, "_", 1) || growbuf_append(out, name, strlen(name))) {
+			return ENOMEM;
+		}
+		if (growbuf_append(out, " ", 1) || growbuf_append(out, value->buf, strlen(value->buf)) ||
+		    growbuf_append(out, "\n", 1))
+			return ENOMEM;
+	}
+	return 0;
 }
 
-static int register_u64_series_files(struct procstat_context *context,
-				     struct procstat_series *series_stat)
+/*
+ * Histograms are exported as a histogram family: cumulative bucket counts, sum and count.
+ * Series are exported as a summary family: sum, count and the percentiles as quantiles.
+ * The rest of the files (min, max, avg, percentiles of histograms...) go as separate metrics.
+ */
+static int openmetrics_append_series(struct growbuf *out, struct growbuf *value, struct snapshot_walk *walk,
+				     size_t first, size_t last)
 {
-	struct procstat_series_u64 *series = series_stat->private;
-	struct procstat_simple_handle descriptors[] = {
-			{"sum",    			series, SERIES_SUM, series_u64_read},
-			{"count",  			series, SERIES_COUNT, series_u64_read},
-			{"min",    			series, SERIES_MIN, series_u64_read},
-			{"max",    			series, SERIES_MAX, series_u64_read},
-			{"last",   			series, SERIES_LAST, series_u64_read},
-			{"avg",    			series, SERIES_AVG, series_u64_read},
-			{"mean",   			series, SERIES_MEAN, series_u64_read},
-			{"stddev", 			series, SERIES_STDEV, series_u64_read},
-			{"get_reset_interval_sec", 	series, SERIES_RESET_INTERVAL, series_u64_read}};
+	const char *path = &walk->paths.buf[walk->entries[first].path];
+	struct procstat_directory *parent = walk->entries[first].file->base.parent;
+	bool histogram = parent->base.flags & (STATS_ENTRY_FLAG_HISTOGRAM | STATS_ENTRY_FLAG_HISTOGRAM_U64);
+	size_t i;
+	int error;
+
+	/* the buckets are read from the series itself, which is gone once unregistered */
+	if (!snapshot_entry_readable(&walk->entries[first]))
+		return 0;
+	if (growbuf_append(out, "# TYPE ", 7) || openmetrics_append_name(out, path, NULL) ||
+	    growbuf_append(out, histogram ? " histogram\n" : " summary\n", histogram ? 11 : 9))
+		return ENOMEM;
 
+	if (histogram)
+		error = openmetrics_append_buckets(out, path, container_of(parent, struct procstat_series, root));
+	else
+		error = openmetrics_append_quantiles(out, value, walk, first, last);
+	if (error)
+		return error;
+
+	for (i = first; i < last; ++i) {
+		struct snapshot_entry *entry = &walk->entries[i];
+		const char *name = procstat_item_name(&entry->file->base);
 
-	return procstat_create_simple(context, &series_stat->root.base, descriptors, ARRAY_SIZE(descriptors));
+		if ((!histogram && numeric_value(name)) || !strcmp(name, "sum") || !strcmp(name, "count"))
+			continue;
+		if (!snapshot_entry_readable(entry))
+			continue;
+		error = snapshot_format_value(value, entry);
+		if (error)
+			return error;
+		if (!numeric_value(value->buf))
+			continue;
+		error = openmetrics_append_metric(out, "gauge", path, name, value->buf);
+		if (error)
+			return error;
+	}
+	return 0;
 }
 
-static ssize_t reset_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
+static int serialize_openmetrics(struct growbuf *out, struct snapshot_walk *walk)
 {
-	struct procstat_series *series_stat = object;
-	struct procstat_series_u64 *series = series_stat->private;
-	uint32_t control;
+	struct growbuf value = {0};
+	size_t i, last;
+	int error = 0;
+
+	for (i = 0; !error && i < walk->nentries; i = last) {
+		struct snapshot_entry *entry = &walk->entries[i];
+		struct procstat_directory *parent = entry->file->base.parent;
+
+		last = i + 1;
+		if (parent && (parent->base.flags & STATS_ENTRY_FLAG_SERIES)) {
+			/* files of a directory are collected consecutively */
+			while (last < walk->nentries && walk->entries[last].path == entry->path)
+				++last;
+			error = openmetrics_append_series(out, &value, walk, i, last);
+			continue;
+		}
 
-	control = strtoul(buffer, NULL, 10);
-	if (control != 1)
-		return EINVAL;
+		if (!snapshot_entry_readable(entry))
+			continue;
+		error = snapshot_format_value(&value, entry);
+		if (!error && numeric_value(value.buf))
+			error = openmetrics_append_metric(out, "unknown", &walk->paths.buf[entry->path],
+							  procstat_item_name(&entry->file->base), value.buf);
+	}
 
-	__atomic_store_n(&series->reset.reset_flag, 1, __ATOMIC_RELAXED);
-	return 1;
+	if (!error)
+		error = growbuf_append(out, "# EOF\n", 6);
+	free(value.buf);
+	return error;
 }
 
-static ssize_t set_reset_interval_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
+static int json_append_string(struct growbuf *out, const char *str, size_t len)
 {
-	struct procstat_series *series_stat = object;
-	struct procstat_series_u64 *series = series_stat->private;
-	int32_t control;
+	size_t i;
+
+	if (growbuf_append(out, "\"", 1))
+		return ENOMEM;
+	for (i = 0; i < len; ++i) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\') {
+			char escaped[2] = {'\\', c};
+
+			if (growbuf_append(out, escaped, 2))
+				return ENOMEM;
+		} else if (c < 0x20) {
+			if (growbuf_reserve(out, 6))
+				return ENOMEM;
+			out->len += sprintf(&out->buf[out->len], "\\u%04x", c);
+		} else if (growbuf_append(out, (char *)&c, 1)) {
+			return ENOMEM;
+		}
+	}
+	return growbuf_append(out, "\"", 1);
+}
 
-	control = strtoul(buffer, NULL, 10);
-	if (control < 0)
-		return EINVAL;
+/* length of the first @depth components of @path */
+static size_t path_prefix_len(const char *path, unsigned depth)
+{
+	const char *c = path;
 
-	__atomic_store_n(&series->reset.reset_interval, control, __ATOMIC_RELAXED);
-	return 1;
+	while (depth--) {
+		c = strchr(c, '/');
+		if (!c)
+			return strlen(path);
+		++c;
+	}
+	return c - path - 1;
 }
 
-int procstat_create_u64_series(struct procstat_context *context, struct procstat_item *parent,
-			       const char *name, struct procstat_series_u64 *series)
+/*
+ * The tree is output as nested objects. The directories are opened and closed as the consecutive
+ * entries paths change, so the output is produced in a single pass.
+ */
+static int serialize_json(struct growbuf *out, struct snapshot_walk *walk)
 {
-	struct procstat_series *series_stat;
-	struct procstat_simple_handle control[] = {
-		{.name = "reset", .writer = reset_u64_series},
-		{.name = "reset_interval_sec", .writer = set_reset_interval_u64_series}};
-	int error;
+	struct growbuf value = {0};
+	const char *current = "";
+	unsigned depth = 0;
+	bool comma = false;
+	size_t i;
+	int error = 0;
+
+	error = growbuf_append(out, "{", 1);
+	for (i = 0; !error && i < walk->nentries; ++i) {
+		struct snapshot_entry *entry = &walk->entries[i];
+		const char *path = &walk->paths.buf[entry->path];
+		const char *name = procstat_item_name(&entry->file->base);
+		unsigned common = 0, new_depth = 0;
+		const char *c;
+
+		if (!snapshot_entry_readable(entry))
+			continue;
+		error = snapshot_format_value(&value, entry);
+		if (error)
+			break;
 
-	parent = parent_or_root(context, parent);
-	if (!parent) {
-		errno = EINVAL;
-		return -1;
+		if (*path)
+			for (new_depth = 1, c = path; *c; ++c)
+				new_depth += *c == '/';
+		while (common < MIN(depth, new_depth) &&
+		       path_prefix_len(path, common + 1) == path_prefix_len(current, common + 1) &&
+		       !strncmp(path, current, path_prefix_len(path, common + 1)))
+			++common;
+
+		for (; depth > common; --depth) {
+			if (growbuf_append(out, "}", 1))
+				goto nomem;
+			comma = true;
+		}
+		for (; depth < new_depth; ++depth) {
+			size_t start = depth ? path_prefix_len(path, depth) + 1 : 0;
+			size_t end = path_prefix_len(path, depth + 1);
+
+			if ((comma && growbuf_append(out, ",", 1)) ||
+			    json_append_string(out, path + start, end - start) ||
+			    growbuf_append(out, ":{", 2))
+				goto nomem;
+			comma = false;
+		}
+		current = path;
+
+		if ((comma && growbuf_append(out, ",", 1)) ||
+		    json_append_string(out, name, strlen(name)) ||
+		    growbuf_append(out, ":", 1))
+			goto nomem;
+		if (numeric_value(value.buf))
+			error = growbuf_append(out, value.buf, strlen(value.buf));
+		else
+			error = json_append_string(out, value.buf, strlen(value.buf));
+		comma = true;
 	}
 
-	series_stat = calloc(1, sizeof(*series_stat));
-	if (!series_stat) {
-		errno = ENOMEM;
-		return -1;
-	}
-	series_stat->private = series;
+	for (; !error && depth; --depth)
+		error = growbuf_append(out, "}", 1);
+	if (!error)
+		error = growbuf_append(out, "}\n", 2);
+	free(value.buf);
+	return error;
+nomem:
+	free(value.buf);
+	return ENOMEM;
+}
 
-	series->min = ULLONG_MAX;
-	error = init_directory(context, &series_stat->root,
-			       name, (struct procstat_directory *)parent);
-	if (error) {
-		free_item(&series_stat->root.base);
-		errno = error;
-		return -1;
-	}
+static int growbuf_append_varint(struct growbuf *b, uint64_t value)
+{
+	char bytes[10];
+	size_t n = 0;
+
+	do {
+		bytes[n] = value & 0x7f;
+		value >>= 7;
+		if (value)
+			bytes[n] |= 0x80;
+		++n;
+	} while (value);
+	return growbuf_append(b, bytes, n);
+}
 
-	error = register_u64_series_files(context, series_stat);
-	if (error) {
-		errno = error;
-		goto error_remove_stat;
-	}
+static uint64_t zigzag_encode(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
 
-	struct timespec cur_time;
-	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time) == 0) {
-		series->reset.last_reset_time = cur_time.tv_sec;
-	} else {
-		series->reset.last_reset_time = 0;
+static bool series_file_value(struct procstat_file *file, uint64_t *value);
+
+static enum procstat_binary_type binary_file_type(struct procstat_file *file)
+{
+	if (file->base.flags & STATS_ENTRY_FLAG_PERCPU)
+		return PROCSTAT_BINARY_U64;
+
+	switch (file->type) {
+	case PROCSTAT_VALUE_U32:
+	case PROCSTAT_VALUE_U64:
+		return PROCSTAT_BINARY_U64;
+	case PROCSTAT_VALUE_INT:
+		return PROCSTAT_BINARY_S64;
+	default:
+		return series_file_value(file, NULL) ? PROCSTAT_BINARY_U64 : PROCSTAT_BINARY_TEXT;
 	}
-	series->reset.reset_flag = 0;
-	series->reset.reset_interval = 0;
+}
 
-	control[0].object = series_stat;
-	control[1].object = series_stat;
-	error = procstat_create_simple(context, &series_stat->root.base, control, 2);
-	if (error)
-		goto error_remove_stat;
-	return 0;
+static uint64_t percpu_u64_sum(struct procstat_percpu_slot *slots, unsigned mask);
 
-error_remove_stat:
-	procstat_remove(context, parent);
-	return -1;
+static uint64_t binary_file_value(struct procstat_file *file)
+{
+	uint64_t value = 0;
+
+	if (file->base.flags & STATS_ENTRY_FLAG_PERCPU)
+		return percpu_u64_sum(file->private, file->arg);
+
+	switch (file->type) {
+	case PROCSTAT_VALUE_U32:
+		return *(volatile uint32_t *)file->private;
+	case PROCSTAT_VALUE_U64:
+		return *(volatile uint64_t *)file->private;
+	case PROCSTAT_VALUE_INT:
+		return (int64_t)*(volatile int *)file->private;
+	default:
+		series_file_value(file, &value);
+		return value;
+	}
 }
 
-void procstat_u64_series_set_reset_interval(struct procstat_series_u64 *series, int reset_interval)
+/* A histogram series directory gets its own entry, placed before the first of its files */
+static struct procstat_series *binary_histogram(struct snapshot_walk *walk, size_t i)
 {
-	series->reset.reset_interval = reset_interval;
+	struct procstat_directory *parent = walk->entries[i].file->base.parent;
+
+	if (i && walk->entries[i - 1].path == walk->entries[i].path)
+		return NULL;
+	if (!parent || !(parent->base.flags & (STATS_ENTRY_FLAG_HISTOGRAM | STATS_ENTRY_FLAG_HISTOGRAM_U64)))
+		return NULL;
+	return container_of(parent, struct procstat_series, root);
 }
 
-int procstat_create_multiple_u64_series(struct procstat_context *context,
-					struct procstat_item *parent,
-					struct procstat_series_u64_handle *descriptors,
-					size_t series_len)
+static int binary_append_entry(struct growbuf *out, uint32_t id, enum procstat_binary_type type,
+			       const char *path, const char *name)
 {
-	int i;
+	struct procstat_binary_entry entry;
+	size_t path_len = strlen(path);
+	size_t name_len = name ? strlen(name) : 0;
+	size_t len = path_len + name_len + (path_len && name_len);
+
+	if (len > UINT16_MAX)
+		return ENAMETOOLONG;
+	entry.id = id;
+	entry.type = type;
+	entry.path_len = len;
+	if (growbuf_append(out, (char *)&entry, sizeof(entry)) ||
+	    growbuf_append(out, path, path_len) ||
+	    (path_len && name_len && growbuf_append(out, "/", 1)) ||
+	    growbuf_append(out, name, name_len))
+		return ENOMEM;
+	return 0;
+}
 
-	parent = parent_or_root(context, parent);
-	if (!parent) {
-		errno = EINVAL;
-		return -1;
-	}
+static int binary_append_buckets_u32(struct growbuf *out, const uint32_t *buckets, size_t n)
+{
+	uint32_t previous = 0;
+	size_t i;
 
-	for (i = 0; i < series_len; ++i) {
-		int error;
+	if (growbuf_append_varint(out, n))
+		return ENOMEM;
+	for (i = 0; i < n; ++i) {
+		uint32_t bucket = __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
 
-		error = procstat_create_u64_series(context, parent,
-						   descriptors[i].name, descriptors[i].series);
-		if (error) {
-			errno = error;
-			--i;
-			goto error_release;
-		}
+		if (growbuf_append_varint(out, zigzag_encode((int64_t)bucket - previous)))
+			return ENOMEM;
+		previous = bucket;
 	}
 	return 0;
-error_release:
-	for (;i >= 0; --i)
-		procstat_remove_by_name(context, parent, descriptors[i].name);
-	return -1;
 }
 
-int procstat_create_start_end(struct procstat_context *context,
-			      struct procstat_item *parent,
-			      struct procstat_start_end_handle *descriptors,
-			      size_t descriptors_size)
+static int binary_append_buckets_u64(struct growbuf *out, const uint64_t *buckets, size_t n)
 {
-	int i;
-
-	parent = parent_or_root(context, parent);
-	if (!parent) {
-		errno = EINVAL;
-		return -1;
+	uint64_t previous = 0;
+	size_t i;
+
+	if (growbuf_append_varint(out, n))
+		return ENOMEM;
+	for (i = 0; i < n; ++i) {
+		uint64_t bucket = __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+
+		/* wraps around for huge deltas, decoding with unsigned arithmetic restores it */
+		if (growbuf_append_varint(out, zigzag_encode((int64_t)(bucket - previous))))
+			return ENOMEM;
+		previous = bucket;
 	}
+	return 0;
+}
 
-	for (i = 0; i < descriptors_size; ++i) {
-		struct procstat_start_end_handle *descriptor = &descriptors[i];
-		struct procstat_directory *directory;
-		struct procstat_file *file;
+static int binary_append_histogram(struct growbuf *out, uint32_t id, struct procstat_series *series_stat)
+{
+	struct procstat_binary_record record = {.id = id, .type = PROCSTAT_BINARY_HISTOGRAM};
+	pthread_mutex_t *lock = series_read_lock(&series_stat->root);
+	size_t start = out->len;
+	int error;
 
-		directory = (struct procstat_directory *)procstat_create_directory(context, parent,
-										   descriptors[i].name);
-		if (!directory) {
-			--i;
-			goto error_release;
-		}
+	if (growbuf_append(out, (char *)&record, sizeof(record)))
+		return ENOMEM;
 
-		file = create_file(context, directory, "start", descriptor->start, descriptor->fmt, NULL);
-		if (!file)
-			goto error_release;
+	pthread_mutex_lock(lock);
+	if (series_stat->root.base.flags & STATS_ENTRY_FLAG_HISTOGRAM) {
+		struct procstat_histogram_u32 *series = series_stat->private;
 
-		file = create_file(context, directory, "end", descriptor->end, descriptor->fmt, NULL);
-		if (!file) {
-			goto error_release;
-		}
+		histogram_reset(series);
+		if (series->shards)
+			merge_histogram_shards(series, true);
+		record.value = series->count;
+		error = binary_append_buckets_u32(out, series->histogram, PROCSTAT_PERCENTILE_ARR_NR);
+	} else {
+		struct procstat_histogram_u64 *series = series_stat->private;
+
+		if (is_reset(&series->reset))
+			clear_values_histogram_u64(series);
+		record.value = series->count;
+		error = binary_append_buckets_u64(out, series->histogram, series->geometry.nbuckets);
 	}
+	pthread_mutex_unlock(lock);
+	if (error)
+		return error;
+
+	record.size = out->len - start - sizeof(record);
+	memcpy(&out->buf[start], &record, sizeof(record));
 	return 0;
-error_release:
-	for (; i >= 0; --i)
-		procstat_remove_by_name(context, parent, descriptors[i].name);
-	return -1;
 }
 
-struct procstat_item *procstat_root(struct procstat_context *context)
+static int binary_append_file(struct growbuf *out, struct growbuf *value, uint32_t id,
+			      struct snapshot_entry *entry)
 {
-	assert(context);
-	return &context->root.base;
+	struct procstat_binary_record record = {.id = id};
+	enum procstat_binary_type type = binary_file_type(entry->file);
+	int error;
+
+	if (type != PROCSTAT_BINARY_TEXT) {
+		record.type = type;
+		record.value = binary_file_value(entry->file);
+		return growbuf_append(out, (char *)&record, sizeof(record));
+	}
+
+	/* no raw value is known, fall back to the formatter */
+	error = snapshot_format_value(value, entry);
+	if (error)
+		return error;
+	record.type = PROCSTAT_BINARY_TEXT;
+	record.size = strlen(value->buf);
+	if (growbuf_append(out, (char *)&record, sizeof(record)) ||
+	    growbuf_append(out, value->buf, record.size))
+		return ENOMEM;
+	return 0;
 }
 
-struct procstat_context *procstat_context(struct procstat_item *item)
+/* dictionary, ids are assigned in the same order by binary_append_records() */
+static int binary_append_dictionary(struct growbuf *out, struct snapshot_walk *walk,
+				    struct procstat_binary_header *header)
 {
-	struct procstat_directory *root;
+	uint32_t id;
+	size_t i;
+	int error = 0;
 
-	assert(item);
+	for (i = 0, id = 0; !error && i < walk->nentries; ++i) {
+		struct snapshot_entry *entry = &walk->entries[i];
+		const char *path = &walk->paths.buf[entry->path];
 
-	if (!item->parent)
-		root = (struct procstat_directory *)item;
-	else
-		for (root = item->parent; root->base.parent != NULL; root = root->base.parent);
+		if (binary_histogram(walk, i)) {
+			error = binary_append_entry(out, id++, PROCSTAT_BINARY_HISTOGRAM, path, NULL);
+			if (error)
+				break;
+		}
+		error = binary_append_entry(out, id++, binary_file_type(entry->file), path,
+					    procstat_item_name(&entry->file->base));
+	}
+	header->nentries = id;
+	return error;
+}
 
-	return (struct procstat_context *)root;
+static int binary_append_records(struct growbuf *out, struct snapshot_walk *walk,
+				 struct procstat_binary_header *header)
+{
+	struct growbuf value = {0};
+	uint32_t id;
+	size_t i;
+	int error = 0;
+
+	for (i = 0, id = 0; !error && i < walk->nentries; ++i) {
+		struct snapshot_entry *entry = &walk->entries[i];
+		struct procstat_series *histogram = binary_histogram(walk, i);
+		bool readable = snapshot_entry_readable(entry);
+
+		if (histogram) {
+			if (readable) {
+				error = binary_append_histogram(out, id, histogram);
+				++header->nrecords;
+			}
+			++id;
+		}
+		if (readable && !error) {
+			error = binary_append_file(out, &value, id, entry);
+			++header->nrecords;
+		}
+		++id;
+	}
+	free(value.buf);
+	return error;
 }
 
-void fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+/* The dictionary is written in the first frame of a handle, and again only once the walked tree changes */
+static int serialize_binary_frame(struct growbuf *out, struct snapshot_walk *walk, bool dictionary)
 {
-	struct stat stat;
-	struct procstat_context *context = request_context(req);
-	struct procstat_item *item;
+	struct procstat_binary_header header = {.magic = PROCSTAT_BINARY_MAGIC,
+						.version = PROCSTAT_BINARY_VERSION,
+						.header_size = sizeof(header),
+						.flags = dictionary ? PROCSTAT_BINARY_FLAG_DICTIONARY : 0};
+	size_t start = out->len;
+	int error;
 
-	memset(&stat, 0, sizeof(stat));
-	pthread_mutex_lock(&context->global_lock);
+	error = growbuf_append(out, (char *)&header, sizeof(header));
+	if (!error && dictionary)
+		error = binary_append_dictionary(out, walk, &header);
+	if (!error)
+		error = binary_append_records(out, walk, &header);
+	if (!error)
+		memcpy(&out->buf[start], &header, sizeof(header));
+	return error;
+}
 
-	item = fuse_inode_to_item(context, ino);
-	if (!item_registered(item)) {
-		pthread_mutex_unlock(&context->global_lock);
-		fuse_reply_err(req, ENOENT);
-		return;
+static int serialize_binary(struct growbuf *out, struct snapshot_walk *walk)
+{
+	return serialize_binary_frame(out, walk, true);
+}
+
+typedef int (*aggregator_serializer)(struct growbuf *out, struct snapshot_walk *walk);
+
+static const aggregator_serializer aggregator_serializers[] = {
+	[PROCSTAT_AGGREGATOR_TEXT] 	  = serialize_text,
+	[PROCSTAT_AGGREGATOR_OPENMETRICS] = serialize_openmetrics,
+	[PROCSTAT_AGGREGATOR_JSON] 	  = serialize_json,
+	[PROCSTAT_AGGREGATOR_BINARY] 	  = serialize_binary,
+};
+
+static void snapshot_walk_release(struct snapshot_walk *walk)
+{
+	size_t i;
+
+	for (i = 0; i < walk->nentries; ++i)
+		item_put(&walk->entries[i].file->base);
+	for (i = 0; i < walk->ndirectories; ++i)
+		item_put(&walk->directories[i].directory->base);
+
+	free(walk->entries);
+	free(walk->directories);
+	free(walk->paths.buf);
+	free(walk->path.buf);
+	memset(walk, 0, sizeof(*walk));
+}
+
+/* The ids of a walk hold as long as none of the walked directories gained or lost children */
+static bool snapshot_walk_current(struct snapshot_walk *walk)
+{
+	size_t i;
+
+	if (!walk->ndirectories)
+		return false;
+
+	for (i = 0; i < walk->ndirectories; ++i) {
+		struct procstat_directory *directory = walk->directories[i].directory;
+		bool current;
+
+		pthread_rwlock_rdlock(&directory->lock);
+		current = item_registered(&directory->base) && directory->generation == walk->directories[i].generation;
+		pthread_rwlock_unlock(&directory->lock);
+		if (!current)
+			return false;
 	}
+	return true;
+}
 
-	if (!fuse_inode_to_file(ino)->writer) {
-		pthread_mutex_unlock(&context->global_lock);
-		fuse_reply_err(req, EPERM);
-		return;
+/*
+ * The subtree is walked under the directory read locks only to collect the files (holding a reference on each),
+ * the formatters are called by the serializer after the locks are released.
+ */
+static int aggregator_snapshot(struct procstat_context *context, struct procstat_file *file,
+			       struct aggregator_snapshot *snapshot)
+{
+	struct procstat_directory *parent = file->base.parent;
+	struct snapshot_walk *walk = &snapshot->walk;
+	int error = 0;
+
+	walk->self = &file->base;
+	walk->context = context;
+
+	/* the parent is referenced by the open aggregator */
+	if (parent && item_registered(&parent->base)) {
+		pthread_rwlock_rdlock(&parent->lock);
+		error = snapshot_collect_locked(walk, parent);
+		pthread_rwlock_unlock(&parent->lock);
 	}
 
-	/* only support for truncate as it is needed during write */
-	if (to_set != FUSE_SET_ATTR_SIZE) {
-		pthread_mutex_unlock(&context->global_lock);
+	if (!error)
+		error = aggregator_serializers[file->arg](&snapshot->buffer, walk);
+
+	if (error || file->arg != PROCSTAT_AGGREGATOR_BINARY)
+		snapshot_walk_release(walk);
+	return error;
+}
+
+/* Records only, with the ids of the kept walk, unless the walked tree changed since */
+static int aggregator_next_frame(struct procstat_context *context, struct procstat_file *file,
+				 struct aggregator_snapshot *snapshot)
+{
+	snapshot->buffer.len = 0;
+	snapshot->eof = false;
+	if (snapshot_walk_current(&snapshot->walk))
+		return serialize_binary_frame(&snapshot->buffer, &snapshot->walk, false);
+
+	snapshot_walk_release(&snapshot->walk);
+	return aggregator_snapshot(context, file, snapshot);
+}
+
+/*
+ * Reads are served from the snapshot taken at the first read. A binary aggregator takes a new frame
+ * on a later read at offset 0, or past the end of the current frame once its end was read.
+ */
+static void snapshot_aggregator_read(fuse_req_t req, struct procstat_file *file, struct read_struct *rs,
+				     size_t size, off_t off)
+{
+	struct aggregator_snapshot *snapshot = rs->ext;
+	int error;
+
+	if (!snapshot) {
+		snapshot = calloc(1, sizeof(*snapshot));
+		if (!snapshot) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		error = aggregator_snapshot(request_context(req), file, snapshot);
+		if (error) {
+			free(snapshot->buffer.buf);
+			free(snapshot);
+			fuse_reply_err(req, error);
+			return;
+		}
+		rs->ext = snapshot;
+	} else if (file->arg == PROCSTAT_AGGREGATOR_BINARY &&
+		   (!off || (snapshot->eof && off >= snapshot->base + (off_t)snapshot->buffer.len))) {
+		error = aggregator_next_frame(request_context(req), file, snapshot);
+		snapshot->base = off;
+		if (error) {
+			snapshot->buffer.len = 0;
+			fuse_reply_err(req, error);
+			return;
+		}
+	}
+
+	if (off < snapshot->base) {
 		fuse_reply_err(req, EINVAL);
 		return;
 	}
-
-	fill_item_stats(context, item, &stat);
-	pthread_mutex_unlock(&context->global_lock);
-	fuse_reply_attr(req, &stat, 1.0);
+	off -= snapshot->base;
+	if (off >= snapshot->buffer.len) {
+		snapshot->eof = true;
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	fuse_reply_buf(req, &snapshot->buffer.buf[off], MIN(size, snapshot->buffer.len - off));
 }
 
-static void fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+static void aggregator_release(struct procstat_item *item, struct fuse_file_info *fi)
 {
-	struct procstat_context *context = request_context(req);
-	struct procstat_item *item = fuse_inode_to_item(request_context(req), ino);
+	struct read_struct *rs = (struct read_struct *)fi->fh;
 
-	pthread_mutex_lock(&context->global_lock);
-	if (item->flags & STATS_ENTRY_FLAG_AGGREGATOR)
-		aggregator_release_locked(item, fi);
-	if (--item->refcnt == 0)
-		free_item(item);
-	pthread_mutex_unlock(&context->global_lock);
-	if (fi->fh) {
-		struct read_struct *fh = (struct read_struct *)fi->fh;
-		free(fh->ext);
-		free(fh);
+	if (rs && (item->flags & STATS_ENTRY_FLAG_SNAPSHOT)) {
+		struct aggregator_snapshot *snapshot = rs->ext;
+
+		if (snapshot) {
+			snapshot_walk_release(&snapshot->walk);
+			free(snapshot->buffer.buf);
+		}
+	} else if (rs) {
+		struct aggregator_struct *as = (struct aggregator_struct *)rs->ext;
+
+		if (as && as->c.current) {
+			if (as->c.current != &item->parent->children)
+				item_put(container_of(as->c.current, struct procstat_item, entry));
+		}
 	}
-	fuse_reply_err(req, 0);
+	item_put(&item->parent->base);
 }
 
-static struct fuse_lowlevel_ops fops = {
-	.read = fuse_read,
-	.lookup = fuse_lookup,
-	.forget = fuse_forget,
-	.getattr = fuse_getattr,
-	.opendir = fuse_opendir,
-	.readdir = fuse_readdir,
-	.open = fuse_open,
-	.write = fuse_write,
-	.setattr = fuse_setattr,
-	.release = fuse_release,
-	.releasedir = fuse_release,
+struct history_snapshot {
+	size_t size;
+	char buffer[0];
 };
 
-#define ROOT_DIR_NAME "."
-struct procstat_context *procstat_create(const char *mountpoint)
+#define HISTORY_LINE_LEN (20 + 1 + 3 + 1 + HISTORY_VALUE_LEN + 1)
+static void history_read(fuse_req_t req, struct procstat_file *file, struct read_struct *rs, size_t size, off_t off)
 {
-	struct procstat_context *context;
-	char *argv[] = {(char *)"stats", (char *)"-o", (char *)"auto_unmount", (char *)mountpoint, NULL};
-	struct fuse_args args = FUSE_ARGS_INIT(ARRAY_SIZE(argv)-1, argv);
-	char *full_path_mountpoint;
-	int error;
-	struct fuse_chan *channel;
+	struct procstat_context *context = request_context(req);
+	struct procstat_history *history = file->private;
+	struct history_snapshot *snapshot = rs->ext;
 
-	error = mkdir(mountpoint, 0755);
-	if (error) {
-		if (errno != EEXIST)
-			return NULL;
+	/* the samples are formatted once at the first read so that the output is consistent */
+	if (!snapshot) {
+		unsigned nsamples, first, i;
+
+		pthread_mutex_lock(&context->global_lock);
+		nsamples = MIN(history->count, history->nsamples);
+		first = (history->next + history->nsamples - nsamples) % history->nsamples;
+		snapshot = malloc(sizeof(*snapshot) + nsamples * HISTORY_LINE_LEN + 1);
+		if (!snapshot) {
+			pthread_mutex_unlock(&context->global_lock);
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		snapshot->size = 0;
+		for (i = 0; i < nsamples; ++i) {
+			struct history_sample *sample = &history->samples[(first + i) % history->nsamples];
+
+			snapshot->size += sprintf(&snapshot->buffer[snapshot->size], "%lu.%03lu %s\n",
+						  sample->time_msec / 1000, sample->time_msec % 1000, sample->value);
+		}
+		pthread_mutex_unlock(&context->global_lock);
+		rs->ext = snapshot;
 	}
 
-	error = fuse_parse_cmdline(&args, &full_path_mountpoint, NULL, NULL);
-	if (error) {
-		errno = EINVAL;
-		return NULL;
+	if (off >= snapshot->size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
 	}
+	fuse_reply_buf(req, &snapshot->buffer[off], MIN(size, snapshot->size - off));
+}
 
-	context = calloc(1, sizeof(*context));
-	if (!context) {
-		errno = ENOMEM;
-		return NULL;
+static void fuse_read_locked(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct read_struct *read_buffer = (struct read_struct *)fi->fh;
+	struct procstat_file *file = fuse_inode_to_file(request_context(req), ino);
+
+	if (file->base.flags & STATS_ENTRY_FLAG_SNAPSHOT) {
+		snapshot_aggregator_read(req, file, read_buffer, size, off);
+		return;
 	}
-	context->mountpoint = full_path_mountpoint;
-	context->uid = getuid();
-	context->gid = getgid();
 
-	pthread_mutex_init(&context->global_lock, NULL);
-	init_directory(context, &context->root, ROOT_DIR_NAME, NULL);
+	if (file->base.flags & STATS_ENTRY_FLAG_AGGREGATOR) {
+		aggregator_read(req, file, read_buffer, size, off);
+		return;
+	}
 
-	channel = fuse_mount(context->mountpoint, &args);
-	if (!channel) {
-		errno = EFAULT;
-		goto free_stats;
+	if (file->base.flags & STATS_ENTRY_FLAG_HISTORY) {
+		history_read(req, file, read_buffer, size, off);
+		return;
 	}
 
-	context->session = fuse_lowlevel_new(&args, &fops, sizeof(fops), context);
-	if (!context->session) {
-		errno = EPERM;
-		goto free_stats;
+	/*
+	 * An item unregistered via procstat_remove may still be reached here: the item itself has refcnt held from fuse_open.
+	 * If so, the owner may have freed the item stat memory, which is still ok to read.
+	 * HOWEVER, writing to this memory is prohibited and may cause memory corruption.
+	 * Write is possible only for series (see is_reset() and clear_values_...).
+	 * The item itself may not be marked as unregistered (refcnt != 0 in item_put),
+	 * but since series are removed by directory we can rely on parent being marked as unregistered by procstat_remove().
+	 */
+	if ((!file->fmt && !(file->base.flags & STATS_ENTRY_FLAG_STREAM)) ||
+	    !file->base.parent || !item_registered(&file->base.parent->base)) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
 	}
 
-	fuse_opt_free_args(&args);
-	fuse_session_add_chan(context->session, channel);
-	return context;
-free_stats:
-	procstat_destroy(context);
-	return NULL;
+	if (file->base.flags & STATS_ENTRY_FLAG_STREAM) {
+		stream_read(req, file, read_buffer, size, off);
+		return;
+	}
+
+	if (off == 0 || read_buffer->size < 0) {
+		read_buffer->size = file_format(file, read_buffer->buffer, READ_BUFFER_SIZE);
+		/* does not fit, format again into a stream which is read from until the next read at offset 0 */
+		if (read_buffer->size >= READ_BUFFER_SIZE) {
+			struct procstat_stream *stream = read_buffer->ext;
+			int error;
+
+			if (!stream)
+				stream = read_buffer->ext = calloc(1, sizeof(*stream));
+			if (!stream) {
+				fuse_reply_err(req, ENOMEM);
+				return;
+			}
+			stream_clear(stream);
+			error = stream_format_file(stream, file, read_buffer->size);
+			if (error) {
+				stream_clear(stream);
+				read_buffer->size = 0;
+				fuse_reply_err(req, error);
+				return;
+			}
+		}
+	}
+
+	if (read_buffer->size >= READ_BUFFER_SIZE) {
+		stream_reply(req, read_buffer->ext, size, off);
+		return;
+	}
+
+	if (off >= read_buffer->size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	fuse_reply_buf(req, (char *)read_buffer->buffer + off, MIN(size, read_buffer->size - off));
 }
 
-void procstat_stop(struct procstat_context *context)
+static void fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-	struct fuse_session *session;
+	struct read_struct *read_buffer = (struct read_struct *)fi->fh;
 
-	assert(context);
-	session = context->session;
+	pthread_mutex_lock(&read_buffer->lock);
+	fuse_read_locked(req, ino, size, off, fi);
+	pthread_mutex_unlock(&read_buffer->lock);
+}
 
-	if (session)
-		fuse_session_exit(session);
+static bool valid_filename(const char *name)
+{
+	const char *c;
+
+	for (c = name; *c; ++c) {
+		if (isalnum(*c) || (*c == '.') || (*c == '_') || (*c == '-'))
+			continue;
+		return false;
+	}
+	return true;
 }
 
-void procstat_destroy(struct procstat_context *context)
+static void init_item(struct procstat_context *context, struct procstat_item *item, const char *name)
 {
-	struct fuse_session *session;
+	size_t name_len = strlen(name);
 
-	assert(context);
-	session = context->session;
+	item->name_hash = string_hash(name);
+	if (name_len < DNAME_INLINE_LEN)
+		strcpy(item->iname, name);
+	else {
+		item->name.zero = 0;
+		item->name.buffer = arena_strdup(&context->arena, name);
+	}
+	INIT_LIST_HEAD(&item->entry);
+}
 
-	pthread_mutex_lock(&context->global_lock);
-	if (session) {
-		struct fuse_chan *channel = NULL;
+static struct procstat_file *allocate_file_item(struct procstat_context *context,
+						const char *name,
+					   	void *priv,
+						procstats_formatter fmt,
+						procstats_formatter writer)
+{
+	struct procstat_file *file;
 
-		assert(context->mountpoint);
-		fuse_session_exit(session);
-		channel = fuse_session_next_chan(session, channel);
-		assert(channel);
-		fuse_session_remove_chan(channel);
+	file = arena_alloc(&context->arena, sizeof(*file));
+	if (!file)
+		return NULL;
 
-		fuse_unmount(context->mountpoint, channel);
-		fuse_session_destroy(session);
+	init_item(context, &file->base, name);
+	file->private = priv;
+	file->fmt = fmt;
+	file->writer = writer;
+	return file;
+}
+
+struct procstat_shm {
+	char 				*name;
+	struct procstat_shm_header 	*header;
+	size_t 				size;
+	struct procstat_file 		**files; /* owner of every record */
+	uint32_t 			*free_slots;
+	unsigned 			nfree;
+};
+
+#define SHM_HEADER_SIZE PROCSTAT_CACHELINE_SIZE
+#define SHM_REFRESH_BATCH 256
+
+static struct procstat_shm_record *shm_record(struct procstat_shm *shm, unsigned slot)
+{
+	return (struct procstat_shm_record *)procstat_shm_record(shm->header, slot);
+}
+
+static void shm_write_begin(struct procstat_shm_record *record)
+{
+	__atomic_store_n(&record->seq, record->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_write_end(struct procstat_shm_record *record)
+{
+	__atomic_store_n(&record->seq, record->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* path relative to the root directory, -1 in case it does not fit */
+static int item_path(struct procstat_item *item, char *buffer, size_t len)
+{
+	const char *name = procstat_item_name(item);
+	size_t name_len = strlen(name);
+	int pos = 0;
+
+	if (item->parent && item->parent->base.parent) {
+		pos = item_path(&item->parent->base, buffer, len);
+		if (pos < 0)
+			return -1;
+		buffer[pos++] = '/';
 	}
+	if (pos + name_len >= len)
+		return -1;
+	memcpy(buffer + pos, name, name_len + 1);
+	return pos + name_len;
+}
 
-	item_put_children_locked(&context->root);
-	free(context->mountpoint);
-	pthread_mutex_unlock(&context->global_lock);
-	pthread_mutex_destroy(&context->global_lock);
+/* fallback for stats with no raw value, e.g. with a custom formatter */
+static void shm_fill_text(struct procstat_shm_record *record, struct procstat_file *file)
+{
+	char buffer[READ_BUFFER_SIZE];
+	ssize_t len;
+	char *end;
+	uint64_t value;
+
+	len = file_format(file, buffer, sizeof(buffer));
+	len = MAX(0, MIN(len, PROCSTAT_SHM_TEXT_LEN - 1));
+	if (len && buffer[len - 1] == '\n')
+		--len;
+	buffer[len] = 0;
+	errno = 0;
+	value = strtoull(buffer, &end, 10);
+	if (!len || *end || errno)
+		value = 0;
+
+	shm_write_begin(record);
+	memcpy(record->text, buffer, len + 1);
+	record->value = value;
+	record->type = PROCSTAT_SHM_TEXT;
+	shm_write_end(record);
+}
+
+static void shm_fill_value(struct procstat_shm_record *record, struct procstat_file *file)
+{
+	enum procstat_binary_type type = binary_file_type(file);
+	uint64_t value;
+
+	if (type == PROCSTAT_BINARY_TEXT) {
+		shm_fill_text(record, file);
+		return;
+	}
+
+	value = binary_file_value(file);
+	shm_write_begin(record);
+	record->value = value;
+	record->type = (type == PROCSTAT_BINARY_S64) ? PROCSTAT_SHM_S64 : PROCSTAT_SHM_U64;
+	shm_write_end(record);
+}
+
+static void shm_add_file_locked(struct procstat_context *context, struct procstat_file *file)
+{
+	struct procstat_shm *shm = context->shm;
+	struct procstat_shm_header *header = shm->header;
+	struct procstat_shm_record *record;
+	char path[PROCSTAT_SHM_NAME_LEN];
+	unsigned slot;
+	int len;
+
+	if ((!file->fmt && binary_file_type(file) == PROCSTAT_BINARY_TEXT) || file->shm_slot)
+		return;
+
+	len = item_path(&file->base, path, sizeof(path));
+	if (len < 0 || (!shm->nfree && header->nrecords == header->capacity)) {
+		++header->dropped;
+		return;
+	}
+
+	slot = shm->nfree ? shm->free_slots[--shm->nfree] : header->nrecords++;
+	shm->files[slot] = file;
+	file->shm_slot = slot + 1;
+
+	record = shm_record(shm, slot);
+	shm_write_begin(record);
+	memcpy(record->name, path, len + 1);
+	record->name_len = len;
+	record->text[0] = 0;
+	shm_write_end(record);
+	shm_fill_value(record, file);
+	__atomic_add_fetch(&header->generation, 1, __ATOMIC_RELEASE);
+}
+
+static void shm_add_file(struct procstat_context *context, struct procstat_file *file)
+{
+	pthread_mutex_lock(&context->shm_lock);
+	if (context->shm)
+		shm_add_file_locked(context, file);
+	pthread_mutex_unlock(&context->shm_lock);
+}
+
+/* Called with @directory read locked */
+static void shm_add_tree_locked(struct procstat_context *context, struct procstat_directory *directory)
+{
+	struct procstat_item *child;
+
+	list_for_each_entry(child, &directory->children, entry) {
+		if (!item_registered(child))
+			continue;
+		if (item_type_directory(child)) {
+			struct procstat_directory *subdirectory = (struct procstat_directory *)child;
+
+			/* exported files must persist, materializing adds them to the export */
+			if (series_template(subdirectory)) {
+				template_materialize(context, subdirectory);
+				continue;
+			}
+			pthread_rwlock_rdlock(&subdirectory->lock);
+			shm_add_tree_locked(context, subdirectory);
+			pthread_rwlock_unlock(&subdirectory->lock);
+		} else {
+			shm_add_file(context, container_of(child, struct procstat_file, base));
+		}
+	}
+}
+
+/*
+ * A file is exported only while all its ancestors are registered: an unregistered directory is marked
+ * before its subtree is walked by shm_remove_item(), so a file added in the subtree meanwhile is not missed.
+ */
+static bool directory_reachable(struct procstat_directory *directory)
+{
+	for (; directory; directory = directory->base.parent) {
+		if (!item_registered(&directory->base))
+			return false;
+	}
+	return true;
+}
+
+static void shm_remove_file(struct procstat_context *context, struct procstat_file *file)
+{
+	struct procstat_shm *shm;
+	struct procstat_shm_record *record;
+	unsigned slot;
+
+	pthread_mutex_lock(&context->shm_lock);
+	shm = context->shm;
+	if (!shm || !file->shm_slot) {
+		pthread_mutex_unlock(&context->shm_lock);
+		return;
+	}
+
+	slot = file->shm_slot - 1;
+	file->shm_slot = 0;
+	shm->files[slot] = NULL;
+	shm->free_slots[shm->nfree++] = slot;
+
+	record = shm_record(shm, slot);
+	shm_write_begin(record);
+	record->type = PROCSTAT_SHM_FREE;
+	record->name_len = 0;
+	record->name[0] = 0;
+	shm_write_end(record);
+	__atomic_add_fetch(&shm->header->generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&context->shm_lock);
+}
+
+/* Called with @directory locked */
+static void shm_remove_children_locked(struct procstat_context *context, struct procstat_directory *directory)
+{
+	struct procstat_item *child;
+
+	if (!__atomic_load_n(&context->shm, __ATOMIC_ACQUIRE))
+		return;
+
+	list_for_each_entry(child, &directory->children, entry) {
+		if (item_type_directory(child)) {
+			struct procstat_directory *subdirectory = (struct procstat_directory *)child;
+
+			pthread_rwlock_rdlock(&subdirectory->lock);
+			shm_remove_children_locked(context, subdirectory);
+			pthread_rwlock_unlock(&subdirectory->lock);
+		} else {
+			shm_remove_file(context, container_of(child, struct procstat_file, base));
+		}
+	}
+}
+
+/* Called with the parent directory of @item locked */
+static void shm_remove_item(struct procstat_context *context, struct procstat_item *item)
+{
+	if (!__atomic_load_n(&context->shm, __ATOMIC_ACQUIRE))
+		return;
+
+	if (item_type_directory(item)) {
+		struct procstat_directory *directory = (struct procstat_directory *)item;
+
+		pthread_rwlock_rdlock(&directory->lock);
+		shm_remove_children_locked(context, directory);
+		pthread_rwlock_unlock(&directory->lock);
+		return;
+	}
+	shm_remove_file(context, container_of(item, struct procstat_file, base));
+}
+
+/*
+ * Called by the refresher thread. Records are refreshed in batches, shm_lock is dropped in between so
+ * registration and removal of stats are not held for the whole walk.
+ */
+static void shm_refresh(struct procstat_context *context)
+{
+	struct procstat_shm *shm;
+	struct timespec ts;
+	unsigned slot = 0;
+	unsigned end;
+
+	for (;;) {
+		pthread_mutex_lock(&context->shm_lock);
+		shm = context->shm;
+		if (!shm) {
+			pthread_mutex_unlock(&context->shm_lock);
+			return;
+		}
+
+		end = MIN(slot + SHM_REFRESH_BATCH, shm->header->nrecords);
+		for (; slot < end; ++slot) {
+			if (shm->files[slot])
+				shm_fill_value(shm_record(shm, slot), shm->files[slot]);
+		}
+		if (slot == shm->header->nrecords)
+			break;
+		pthread_mutex_unlock(&context->shm_lock);
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	__atomic_store_n(&shm->header->update_time_msec, ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000,
+			 __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&context->shm_lock);
+}
+
+/*
+ * The refresh is O(records) and may call slow custom formatters, so it runs on a thread of its own
+ * rather than on the ticker, which keeps the clock, reset deadlines and window and rate ticks on time.
+ */
+#define SHM_REFRESH_INTERVAL_MSEC 100
+static void *shm_refresher_loop(void *arg)
+{
+	struct procstat_context *context = arg;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	pthread_mutex_lock(&context->shm_refresher_lock);
+	while (!context->shm_refresher_stop) {
+		pthread_mutex_unlock(&context->shm_refresher_lock);
+		shm_refresh(context);
+		pthread_mutex_lock(&context->shm_refresher_lock);
+
+		deadline.tv_nsec += SHM_REFRESH_INTERVAL_MSEC * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			++deadline.tv_sec;
+		}
+		while (!context->shm_refresher_stop &&
+		       pthread_cond_timedwait(&context->shm_refresher_cond, &context->shm_refresher_lock,
+					      &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&context->shm_refresher_lock);
+	return NULL;
+}
+
+/* A context is exported once, so the refresher is started once */
+static int shm_refresher_start(struct procstat_context *context)
+{
+	pthread_condattr_t attr;
+	int error;
+
+	pthread_mutex_lock(&context->shm_lock);
+	if (context->shm_refresher_started) {
+		pthread_mutex_unlock(&context->shm_lock);
+		return EEXIST;
+	}
+
+	pthread_mutex_init(&context->shm_refresher_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&context->shm_refresher_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	context->shm_refresher_stop = false;
+	error = pthread_create(&context->shm_refresher, NULL, shm_refresher_loop, context);
+	if (error) {
+		pthread_mutex_destroy(&context->shm_refresher_lock);
+		pthread_cond_destroy(&context->shm_refresher_cond);
+	} else {
+		context->shm_refresher_started = true;
+	}
+	pthread_mutex_unlock(&context->shm_lock);
+	return error;
+}
+
+static void shm_refresher_stop(struct procstat_context *context)
+{
+	if (!context->shm_refresher_started)
+		return;
+
+	pthread_mutex_lock(&context->shm_refresher_lock);
+	context->shm_refresher_stop = true;
+	pthread_cond_signal(&context->shm_refresher_cond);
+	pthread_mutex_unlock(&context->shm_refresher_lock);
+	pthread_join(context->shm_refresher, NULL);
+	pthread_mutex_destroy(&context->shm_refresher_lock);
+	pthread_cond_destroy(&context->shm_refresher_cond);
+	context->shm_refresher_started = false;
+}
+
+static void shm_destroy(struct procstat_shm *shm)
+{
+	if (shm->header) {
+		munmap(shm->header, shm->size);
+		shm_unlink(shm->name);
+	}
+	free(shm->name);
+	free(shm->files);
+	free(shm->free_slots);
+	free(shm);
+}
+
+int procstat_shm_export(struct procstat_context *context, const char *name, unsigned capacity)
+{
+	struct procstat_shm *shm;
+	void *segment;
+	int error;
+	int fd;
+
+	if (!capacity || name[0] != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm) {
+		errno = ENOMEM;
+		return -1;
+	}
+	shm->name = strdup(name);
+	shm->files = calloc(capacity, sizeof(*shm->files));
+	shm->free_slots = calloc(capacity, sizeof(*shm->free_slots));
+	if (!shm->name || !shm->files || !shm->free_slots) {
+		error = ENOMEM;
+		goto free_shm;
+	}
+
+	shm->size = SHM_HEADER_SIZE + (size_t)capacity * sizeof(struct procstat_shm_record);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		error = errno;
+		goto free_shm;
+	}
+	if (ftruncate(fd, shm->size)) {
+		error = errno;
+		close(fd);
+		shm_unlink(name);
+		goto free_shm;
+	}
+	segment = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	error = errno;
+	close(fd);
+	if (segment == MAP_FAILED) {
+		shm_unlink(name);
+		goto free_shm;
+	}
+
+	shm->header = segment;
+	shm->header->header_size = SHM_HEADER_SIZE;
+	shm->header->record_size = sizeof(struct procstat_shm_record);
+	shm->header->capacity = capacity;
+	shm->header->version = PROCSTAT_SHM_VERSION;
+
+	/* refreshes nothing until the segment is installed below */
+	error = shm_refresher_start(context);
+	if (error) {
+		shm_unlink(name);
+		goto free_shm;
+	}
+
+	pthread_mutex_lock(&context->shm_lock);
+	if (context->shm) {
+		pthread_mutex_unlock(&context->shm_lock);
+		error = EEXIST;
+		goto free_shm;
+	}
+	__atomic_store_n(&context->shm, shm, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&context->shm_lock);
+
+	/* files registered from now on add themselves, shm_add_file_locked() skips those already exported */
+	pthread_rwlock_rdlock(&context->root.lock);
+	shm_add_tree_locked(context, &context->root);
+	pthread_rwlock_unlock(&context->root.lock);
+	/* readers may validate the segment only after it is fully initialized */
+	__atomic_store_n(&shm->header->magic, PROCSTAT_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+
+free_shm:
+	shm_destroy(shm);
+	errno = error;
+	return -1;
+}
+
+/* Called with @parent write locked */
+static int register_item_locked(struct procstat_context *context,
+				struct procstat_item *item,
+				struct procstat_directory *parent)
+{
+	struct procstat_item *duplicate;
+	struct procstat_file synthesized;
+
+	duplicate = lookup_item_locked(parent, procstat_item_name(item), item->name_hash);
+	if (unlikely(duplicate))
+		return EEXIST;
+	if (unlikely(series_template(parent)) &&
+	    template_lookup(container_of(parent, struct procstat_series, root), procstat_item_name(item),
+			    item->name_hash, &synthesized))
+		return EEXIST;
+
+	item->flags |= STATS_ENTRY_FLAG_REGISTERED;
+	item->refcnt = 1;
+	item->parent = parent;
+	directory_add_child_locked(parent, item);
+	if (__atomic_load_n(&context->shm, __ATOMIC_ACQUIRE) && directory_reachable(parent)) {
+		if (!item_type_directory(item))
+			shm_add_file(context, container_of(item, struct procstat_file, base));
+		else if (item->flags & STATS_ENTRY_FLAG_TEMPLATE)
+			template_materialize(context, (struct procstat_directory *)item);
+	}
+	return 0;
+}
+
+static int register_item(struct procstat_context *context,
+			 struct procstat_item *item,
+			 struct procstat_directory *parent)
+{
+	int error;
+
+	if (unlikely(!parent)) {
+		item->flags |= STATS_ENTRY_FLAG_REGISTERED;
+		item->refcnt = 1;
+		return 0;
+	}
+
+	/* registration in different directories does not contend */
+	pthread_rwlock_wrlock(&parent->lock);
+	error = register_item_locked(context, item, parent);
+	pthread_rwlock_unlock(&parent->lock);
+	return error;
+}
+
+/* @flags are set before the directory is visible */
+static int init_directory_ext(struct procstat_context *context,
+			      struct procstat_directory *directory,
+			      const char *name,
+			      struct procstat_directory *parent,
+			      unsigned flags)
+{
+	int error;
+
+	init_item(context, &directory->base, name);
+	directory->base.flags = STATS_ENTRY_FLAG_DIR | flags;
+	pthread_rwlock_init(&directory->lock, NULL);
+	INIT_LIST_HEAD(&directory->children);
+	error = register_item(context, &directory->base, parent);
+	if (error)
+		return error;
+
+	return 0;
+}
+
+static int init_directory(struct procstat_context *context,
+			  struct procstat_directory *directory,
+			  const char *name,
+			  struct procstat_directory *parent)
+{
+	return init_directory_ext(context, directory, name, parent, 0);
+}
+
+/* Called with @directory write locked, or once it is no longer reachable */
+static void item_put_children_locked(struct procstat_directory *directory)
+{
+	struct procstat_item *iter, *n;
+	list_for_each_entry_safe(iter, n, &directory->children, entry) {
+		iter->parent = NULL;
+		list_del_init(&iter->entry);
+		iter->hash_next = NULL;
+		item_put(iter);
+	}
+	directory->nchildren = 0;
+	directory_hash_free(directory);
+	++directory->generation;
+}
+
+/* the last reference is gone, nobody else can reach the item */
+static void item_release(struct procstat_item *item)
+{
+	item_clear_flags(item, STATS_ENTRY_FLAG_REGISTERED);
+	if (item_type_directory(item))
+		item_put_children_locked((struct procstat_directory *)item);
+
+	free_item(item);
+}
+
+/* Must not be called under global_lock: freeing an item may need it */
+static void item_put(struct procstat_item *item)
+{
+	assert(__atomic_load_n(&item->refcnt, __ATOMIC_RELAXED));
+
+	if (__atomic_sub_fetch(&item->refcnt, 1, __ATOMIC_ACQ_REL))
+		return;
+	item_release(item);
+}
+
+static struct procstat_item *parent_or_root(struct procstat_context *context, struct procstat_item *parent)
+{
+	if (!parent)
+		return &context->root.base;
+	else if (item_type_directory(parent))
+		return parent;
+	return NULL;
+}
+
+/*
+ * @flags, @arg and @type are set before the file is visible to fuse, which relies on them from open to
+ * release, and to the shared memory export and binary aggregators reading raw values
+ */
+static struct procstat_file *create_typed_file(struct procstat_context *context,
+					       struct procstat_directory *parent,
+					       const char *name, void *item,
+					       procstats_formatter fmt, procstats_formatter writer,
+					       unsigned flags, uint64_t arg, enum procstat_value_type type)
+{
+	struct procstat_file *file;
+	int error;
+
+	if (!valid_filename(name)) {
+		errno = -EINVAL;
+		return NULL;
+	}
+
+	file = allocate_file_item(context, name, item, fmt, writer);
+	if (!file) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	file->base.flags = flags;
+	file->arg = arg;
+	file->type = type;
+
+	error = register_item(context,&file->base, parent);
+	if (error) {
+		errno = error;
+		free_item(&file->base);
+		return NULL;
+
+	}
+	return file;
+}
+
+static struct procstat_file *create_file_ext(struct procstat_context *context,
+					     struct procstat_directory *parent,
+					     const char *name, void *item,
+					     procstats_formatter fmt, procstats_formatter writer,
+					     unsigned flags, uint64_t arg)
+{
+	return create_typed_file(context, parent, name, item, fmt, writer, flags, arg, PROCSTAT_VALUE_FORMATTED);
+}
+
+static struct procstat_file *create_file(struct procstat_context *context,
+					 struct procstat_directory *parent,
+					 const char *name, void *item,
+					 procstats_formatter fmt, procstats_formatter writer)
+{
+	return create_file_ext(context, parent, name, item, fmt, writer, 0, 0);
+}
+
+struct procstat_item *procstat_create_directory(struct procstat_context *context,
+					   	struct procstat_item *parent,
+						const char *name)
+{
+	struct procstat_directory *new_directory;
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!valid_filename(name)) {
+		errno = -EINVAL;
+		return NULL;
+	}
+
+	new_directory = arena_alloc(&context->arena, sizeof(*new_directory));
+	if (!new_directory) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	error = init_directory(context, new_directory, name, (struct procstat_directory *)parent);
+	if (error) {
+		free_directory(new_directory);
+		errno = error;
+		return NULL;
+	}
+
+	return &new_directory->base;
+}
+
+/*
+ * The batch directory is not registered until commit: fuse cannot reach it, and files created under it
+ * are not exported to shared memory (see directory_reachable()) before the subtree is attached.
+ */
+struct procstat_item *procstat_batch_begin(struct procstat_context *context, const char *name)
+{
+	struct procstat_directory *batch;
+
+	if (!valid_filename(name)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	batch = arena_alloc(&context->arena, sizeof(*batch));
+	if (!batch) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	init_item(context, &batch->base, name);
+	batch->base.flags = STATS_ENTRY_FLAG_DIR;
+	batch->base.refcnt = 1;
+	pthread_rwlock_init(&batch->lock, NULL);
+	INIT_LIST_HEAD(&batch->children);
+	return &batch->base;
+}
+
+int procstat_batch_commit(struct procstat_context *context, struct procstat_item *parent,
+			  struct procstat_item *batch)
+{
+	struct procstat_directory *directory = (struct procstat_directory *)batch;
+	struct procstat_directory *parent_directory;
+	int error;
+
+	assert(batch && item_type_directory(batch) && !batch->parent);
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		error = EINVAL;
+		goto abort;
+	}
+	parent_directory = (struct procstat_directory *)parent;
+
+	pthread_rwlock_wrlock(&parent_directory->lock);
+	if (lookup_item_locked(parent_directory, procstat_item_name(batch), batch->name_hash)) {
+		pthread_rwlock_unlock(&parent_directory->lock);
+		error = EEXIST;
+		goto abort;
+	}
+
+	batch->parent = parent_directory;
+	item_set_flags(batch, STATS_ENTRY_FLAG_REGISTERED);
+	directory_add_child_locked(parent_directory, batch);
+	if (__atomic_load_n(&context->shm, __ATOMIC_ACQUIRE) && directory_reachable(parent_directory)) {
+		pthread_rwlock_rdlock(&directory->lock);
+		shm_add_tree_locked(context, directory);
+		pthread_rwlock_unlock(&directory->lock);
+	}
+	pthread_rwlock_unlock(&parent_directory->lock);
+	return 0;
+
+abort:
+	procstat_batch_abort(context, batch);
+	errno = error;
+	return -1;
+}
+
+void procstat_batch_abort(struct procstat_context *context, struct procstat_item *batch)
+{
+	assert(batch && !batch->parent);
+	item_put(batch);
+}
+
+#define HISTORY_SUFFIX ".history"
+static void remove_history_view_locked(struct procstat_item *item)
+{
+	char name[strlen(procstat_item_name(item)) + sizeof(HISTORY_SUFFIX)];
+	struct procstat_item *view;
+
+	if (!item->parent)
+		return;
+	sprintf(name, "%s" HISTORY_SUFFIX, procstat_item_name(item));
+	view = lookup_item_locked(item->parent, name, string_hash(name));
+	if (!view || !(view->flags & STATS_ENTRY_FLAG_HISTORY))
+		return;
+	item_clear_flags(view, STATS_ENTRY_FLAG_REGISTERED);
+	directory_remove_child_locked(item->parent, view);
+	item_put(view);
+}
+
+/* Called with the parent directory of @item write locked */
+static void unregister_item_locked(struct procstat_context *context, struct procstat_item *item)
+{
+	if (item->flags & STATS_ENTRY_FLAG_SAMPLED)
+		remove_history_view_locked(item);
+	/*
+	 * marked before the export is cleaned, see directory_reachable(). A tick writes to the owner object
+	 * of windows and rates, so these are marked under global_lock: once removed, no tick is running
+	 * and the owner may free the object.
+	 */
+	if (item->flags & (STATS_ENTRY_FLAG_WINDOW | STATS_ENTRY_FLAG_RATE)) {
+		pthread_mutex_lock(&context->global_lock);
+		item_clear_flags(item, STATS_ENTRY_FLAG_REGISTERED);
+		pthread_mutex_unlock(&context->global_lock);
+	} else {
+		item_clear_flags(item, STATS_ENTRY_FLAG_REGISTERED);
+	}
+	shm_remove_item(context, item);
+	/* Make it not discoverable */
+	if (item->parent)
+		directory_remove_child_locked(item->parent, item);
+	else
+		list_del_init(&item->entry);
+	item_put(item);
+}
+
+/* Turns the synthesized files of a template series into regular ones, it is an ordinary series from now on */
+static int template_materialize(struct procstat_context *context, struct procstat_directory *directory)
+{
+	struct procstat_series *series = container_of(directory, struct procstat_series, root);
+	struct procstat_file synthesized, *file;
+	struct list_head *last, *entry, *next;
+	unsigned index, created;
+	int error = 0;
+
+	if (!series_template(directory))
+		return 0;
+
+	pthread_rwlock_wrlock(&directory->lock);
+	if (!series_template(directory)) {
+		pthread_rwlock_unlock(&directory->lock);
+		return 0;
+	}
+
+	item_clear_flags(&directory->base, STATS_ENTRY_FLAG_TEMPLATE);
+	last = directory->children.prev;
+	for (index = 0; template_file_init(series, index, &synthesized); ++index) {
+		file = allocate_file_item(context, synthesized.base.iname, synthesized.private,
+					  synthesized.fmt, synthesized.writer);
+		if (!file) {
+			error = ENOMEM;
+			break;
+		}
+		file->arg = synthesized.arg;
+		error = register_item_locked(context, &file->base, directory);
+		if (error) {
+			free_item(&file->base);
+			break;
+		}
+	}
+
+	if (error) {
+		/* all or nothing, the series stays a template */
+		for (created = 0; created < index; ++created)
+			unregister_item_locked(context, list_entry(directory->children.prev,
+								   struct procstat_item, entry));
+		item_set_flags(&directory->base, STATS_ENTRY_FLAG_TEMPLATE);
+	} else if (last != &directory->children) {
+		/* files added to the series before stay after the template files, as they are listed */
+		for (entry = directory->children.next; ; entry = next) {
+			next = entry->next;
+			list_del(entry);
+			list_add_tail(entry, &directory->children);
+			if (entry == last)
+				break;
+		}
+	}
+	pthread_rwlock_unlock(&directory->lock);
+	return error;
+}
+
+void procstat_remove(struct procstat_context *context, struct procstat_item *item)
+{
+	struct procstat_directory *directory;
+	struct procstat_directory *parent;
+
+	assert(context);
+	assert(item);
+
+	if (!item_type_directory(item))
+		goto remove_item;
+
+	directory = (struct procstat_directory *)item;
+	if (root_directory(context, directory)) {
+		pthread_rwlock_wrlock(&directory->lock);
+		shm_remove_children_locked(context, directory);
+		item_put_children_locked(directory);
+		pthread_rwlock_unlock(&directory->lock);
+		return;
+	}
+
+remove_item:
+	parent = item->parent;
+	if (parent)
+		pthread_rwlock_wrlock(&parent->lock);
+	unregister_item_locked(context, item);
+	if (parent)
+		pthread_rwlock_unlock(&parent->lock);
+}
+
+int procstat_remove_by_name(struct procstat_context *context,
+			    struct procstat_item *parent,
+			    const char *name)
+{
+	struct procstat_directory *directory;
+	struct procstat_item *item;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	directory = (struct procstat_directory *)parent;
+	pthread_rwlock_wrlock(&directory->lock);
+	item = lookup_item_locked(directory, name, string_hash(name));
+	if (!item) {
+		pthread_rwlock_unlock(&directory->lock);
+		return ENOENT;
+	}
+	unregister_item_locked(context, item);
+	pthread_rwlock_unlock(&directory->lock);
+	return 0;
+}
+
+int procstat_create_simple(struct procstat_context *context,
+			   struct procstat_item *parent,
+			   struct procstat_simple_handle *descriptors,
+			   size_t descriptors_size)
+{
+	int i;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < descriptors_size; ++i) {
+		struct procstat_file *file;
+		struct procstat_simple_handle *descriptor = &descriptors[i];
+
+		file = create_typed_file(context, (struct procstat_directory *)parent,
+					 descriptor->name, descriptor->object,
+					 descriptor->fmt, descriptor->writer, 0, descriptor->arg,
+					 descriptor->type);
+		if (!file) {
+			--i;
+			goto error_release;
+		}
+	}
+	return 0;
+error_release:
+
+	for (; i >= 0; --i)
+		procstat_remove_by_name(context, parent, descriptors[i].name);
+	return -1;
+}
+
+static int create_aggregator(struct procstat_context *context,
+			     struct procstat_item *parent,
+			     const char *name,
+			     unsigned flags,
+			     enum procstat_aggregator_format format)
+{
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct procstat_file *file;
+
+	file = create_file_ext(context, (struct procstat_directory *)parent,
+			       name, NULL, NULL, NULL, flags, format);
+	if (!file)
+		return -1;
+
+	return 0;
+}
+
+int procstat_create_aggregator(struct procstat_context *context,
+			      struct procstat_item *parent,
+			      const char *name)
+{
+	return create_aggregator(context, parent, name, STATS_ENTRY_FLAG_AGGREGATOR, PROCSTAT_AGGREGATOR_TEXT);
+}
+
+int procstat_create_snapshot_aggregator(struct procstat_context *context,
+					struct procstat_item *parent,
+					const char *name)
+{
+	return create_aggregator(context, parent, name, STATS_ENTRY_FLAG_AGGREGATOR | STATS_ENTRY_FLAG_SNAPSHOT,
+				 PROCSTAT_AGGREGATOR_TEXT);
+}
+
+int procstat_create_formatted_aggregator(struct procstat_context *context,
+					 struct procstat_item *parent,
+					 const char *name,
+					 enum procstat_aggregator_format format)
+{
+	if (format >= ARRAY_SIZE(aggregator_serializers)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return create_aggregator(context, parent, name, STATS_ENTRY_FLAG_AGGREGATOR | STATS_ENTRY_FLAG_SNAPSHOT,
+				 format);
+}
+
+__thread unsigned procstat_thread_slot;
+static unsigned next_thread_slot;
+
+unsigned procstat_thread_slot_assign(void)
+{
+	procstat_thread_slot = __atomic_add_fetch(&next_thread_slot, 1, __ATOMIC_RELAXED);
+	return procstat_thread_slot;
+}
+
+static unsigned percpu_slots_count(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	unsigned nslots = 1;
+
+	while (nslots < ncpus)
+		nslots <<= 1;
+	return nslots;
+}
+
+static uint64_t percpu_u64_sum(struct procstat_percpu_slot *slots, unsigned mask)
+{
+	uint64_t sum = 0;
+	unsigned i;
+
+	for (i = 0; i <= mask; ++i)
+		sum += __atomic_load_n(&slots[i].value, __ATOMIC_RELAXED);
+	return sum;
+}
+
+uint64_t procstat_percpu_u64_sum(struct procstat_percpu_u64 *counter)
+{
+	return percpu_u64_sum(counter->slots, counter->mask);
+}
+
+static ssize_t percpu_u64_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	uint64_t sum = percpu_u64_sum(object, arg);
+
+	return procstat_format_u64_decimal(&sum, 0, buffer, len);
+}
+
+int procstat_create_percpu_u64(struct procstat_context *context, struct procstat_item *parent,
+			       const char *name, struct procstat_percpu_u64 *counter)
+{
+	struct procstat_percpu_slot *slots;
+	struct procstat_file *file;
+	unsigned nslots;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nslots = percpu_slots_count();
+	if (posix_memalign((void **)&slots, PROCSTAT_CACHELINE_SIZE, nslots * sizeof(*slots))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(slots, 0, nslots * sizeof(*slots));
+	counter->slots = slots;
+	counter->mask = nslots - 1;
+
+	/* slots are owned by the file, so reading removed counter is still safe */
+	file = create_file_ext(context, (struct procstat_directory *)parent,
+			       name, slots, percpu_u64_read, NULL, 0, counter->mask);
+	if (!file) {
+		free(slots);
+		return -1;
+	}
+	item_set_flags(&file->base, STATS_ENTRY_FLAG_PERCPU);
+
+	return 0;
+}
+
+int procstat_create_stream(struct procstat_context *context, struct procstat_item *parent,
+			   const char *name, void *object, uint64_t arg,
+			   procstat_stream_formatter formatter)
+{
+	struct procstat_stream_file *stream_file;
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent || !formatter || !valid_filename(name)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	stream_file = arena_alloc(&context->arena, sizeof(*stream_file));
+	if (!stream_file) {
+		errno = ENOMEM;
+		return -1;
+	}
+	init_item(context, &stream_file->file.base, name);
+	stream_file->file.private = object;
+	stream_file->file.arg = arg;
+	stream_file->file.base.flags = STATS_ENTRY_FLAG_STREAM;
+	stream_file->formatter = formatter;
+
+	error = register_item(context, &stream_file->file.base, (struct procstat_directory *)parent);
+	if (error) {
+		free_item(&stream_file->file.base);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Coarse clock in seconds, updated by the context ticker thread. Writers compare
+ * reset deadlines against it, so they never call clock_gettime on the hot path.
+ */
+static uint64_t procstat_clock_sec;
+
+static uint64_t procstat_clock(void)
+{
+	return __atomic_load_n(&procstat_clock_sec, __ATOMIC_RELAXED);
+}
+
+static void procstat_clock_update(void)
+{
+	struct timespec cur_time;
+
+	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time) == 0)
+		__atomic_store_n(&procstat_clock_sec, cur_time.tv_sec, __ATOMIC_RELAXED);
+}
+
+bool is_reset(struct reset_info* reset)
+{
+	uint64_t reset_interval;
+	uint64_t now;
+
+	reset_interval = __atomic_load_n(&reset->reset_interval, __ATOMIC_RELAXED);
+	if (unlikely(reset_interval)) {
+		now = procstat_clock();
+		if (now - reset->last_reset_time > reset_interval) {
+			reset->last_reset_time = now;
+			return true;
+		}
+	}
+
+	return __atomic_load_n(&reset->reset_flag, __ATOMIC_RELAXED);
+}
+
+void clear_values_series(struct procstat_series_u64 *series)
+{
+	series->count = 0;
+	series->sum = 0;
+	series->mean = 0;
+	series->aggregated_variance = 0;
+	series->min = ULLONG_MAX;
+	series->max = 0;
+	++series->reset.epoch;
+	__atomic_store_n(&series->reset.reset_flag, 0, __ATOMIC_RELEASE);
+}
+
+void procstat_u64_series_add_point(struct procstat_series_u64 *series, uint64_t value)
+{
+	int64_t delta;
+	int64_t delta2;
+	int64_t avg_delta;
+
+	if (is_reset(&series->reset)) 
+		clear_values_series(series);
+
+	if (value < series->min)
+		series->min = value;
+	if (value > series->max)
+		series->max = value;
+	++series->count;
+	series->last = value;
+	series->sum += value;
+
+	/* Calculate mean and estimated variance according to Welford algorithm
+	 * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance*/
+	delta = (int64_t)value - series->mean;
+	avg_delta = delta / (int64_t)series->count;
+	series->mean = (int64_t)series->mean + avg_delta;
+	delta2 = (int64_t)value - series->mean;
+	series->aggregated_variance += delta * delta2;
+}
+
+static void series_u64_batch_stats_scalar(const uint64_t *values, size_t n,
+					  uint64_t *min, uint64_t *max, uint64_t *sum)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (values[i] < *min)
+			*min = values[i];
+		if (values[i] > *max)
+			*max = values[i];
+		*sum += values[i];
+	}
+}
+
+#ifdef __x86_64__
+/*
+ * avx2 has only signed 64 bit compare, so values are compared with flipped sign bit,
+ * which preserves unsigned order.
+ */
+__attribute__((target("avx2")))
+static void series_u64_batch_stats_avx2(const uint64_t *values, size_t n,
+					uint64_t *min, uint64_t *max, uint64_t *sum)
+{
+	const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	__m256i vmin = _mm256_xor_si256(_mm256_set1_epi64x(*min), sign);
+	__m256i vmax = _mm256_xor_si256(_mm256_set1_epi64x(*max), sign);
+	__m256i vsum = _mm256_setzero_si256();
+	uint64_t lanes_min[4], lanes_max[4], lanes_sum[4];
+	size_t i;
+	int lane;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&values[i]);
+		__m256i biased = _mm256_xor_si256(v, sign);
+
+		vsum = _mm256_add_epi64(vsum, v);
+		vmin = _mm256_blendv_epi8(vmin, biased, _mm256_cmpgt_epi64(vmin, biased));
+		vmax = _mm256_blendv_epi8(vmax, biased, _mm256_cmpgt_epi64(biased, vmax));
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes_min, _mm256_xor_si256(vmin, sign));
+	_mm256_storeu_si256((__m256i *)lanes_max, _mm256_xor_si256(vmax, sign));
+	_mm256_storeu_si256((__m256i *)lanes_sum, vsum);
+	for (lane = 0; lane < 4; ++lane) {
+		if (lanes_min[lane] < *min)
+			*min = lanes_min[lane];
+		if (lanes_max[lane] > *max)
+			*max = lanes_max[lane];
+		*sum += lanes_sum[lane];
+	}
+
+	series_u64_batch_stats_scalar(&values[i], n - i, min, max, sum);
+}
+#endif
+
+static void series_u64_batch_stats(const uint64_t *values, size_t n,
+				   uint64_t *min, uint64_t *max, uint64_t *sum)
+{
+	*min = ULLONG_MAX;
+	*max = 0;
+	*sum = 0;
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2")) {
+		series_u64_batch_stats_avx2(values, n, min, max, sum);
+		return;
+	}
+#endif
+	series_u64_batch_stats_scalar(values, n, min, max, sum);
+}
+
+void procstat_u64_series_add_points(struct procstat_series_u64 *series, const uint64_t *values, size_t n)
+{
+	uint64_t min, max, sum;
+	uint64_t count;
+	double batch_mean, batch_m2 = 0;
+	double delta;
+	size_t i;
+
+	if (!n)
+		return;
+
+	if (is_reset(&series->reset))
+		clear_values_series(series);
+
+	series_u64_batch_stats(values, n, &min, &max, &sum);
+	batch_mean = (double)sum / n;
+	for (i = 0; i < n; ++i) {
+		double d = (double)values[i] - batch_mean;
+
+		batch_m2 += d * d;
+	}
+
+	if (min < series->min)
+		series->min = min;
+	if (max > series->max)
+		series->max = max;
+	series->last = values[n - 1];
+	series->sum += sum;
+
+	/* Merge batch mean and variance into the series (Chan et al. parallel algorithm)
+	 * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Parallel_algorithm */
+	count = series->count + n;
+	delta = batch_mean - (double)series->mean;
+	series->aggregated_variance += (uint64_t)(batch_m2 + delta * delta * series->count * n / count + 0.5);
+	series->mean = (uint64_t)((double)series->mean + delta * n / count + 0.5);
+	series->count = count;
+}
+
+enum series_u64_type{
+	SERIES_SUM = 0,
+	SERIES_COUNT = 1,
+	SERIES_MIN = 2,
+	SERIES_MAX = 3,
+	SERIES_LAST = 4,
+	SERIES_AVG = 5,
+	SERIES_MEAN = 6,
+	SERIES_STDEV = 7,
+	SERIES_RESET_INTERVAL = 8,
+};
+
+static uint64_t series_u64_value(void *object, uint64_t arg)
+{
+	struct procstat_series_u64 *series = object;
+	enum series_u64_type type = arg;
+	uint64_t count;
+
+	if (is_reset(&series->reset))
+		clear_values_series(series);
+
+	count = *((volatile uint64_t *)&series->count);
+	switch (type) {
+	case SERIES_SUM:
+		return series->sum;
+	case SERIES_COUNT:
+		return count;
+	case SERIES_LAST:
+		return series->last;
+	case SERIES_MEAN:
+		return series->mean;
+	case SERIES_MIN:
+		return series->min;
+	case SERIES_MAX:
+		return series->max;
+	case SERIES_AVG:
+		return count ? series->sum / count : 0;
+	case SERIES_STDEV:
+		return (count < 2) ? 0 : series->aggregated_variance / (count - 1);
+	case SERIES_RESET_INTERVAL:
+		return series->reset.reset_interval;
+	default:
+		return 0;
+	}
+}
+
+static ssize_t series_u64_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return procstat_print_u64(buffer, len, series_u64_value(object, arg));
+}
+
+static ssize_t reset_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_series_u64 *series = series_stat->private;
+	uint32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control != 1)
+		return EINVAL;
+
+	__atomic_store_n(&series->reset.reset_flag, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static ssize_t set_reset_interval_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_series_u64 *series = series_stat->private;
+	int32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control < 0)
+		return EINVAL;
+
+	__atomic_store_n(&series->reset.reset_interval, control, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static const struct template_file u64_series_files[] = {
+	{"sum",    			series_u64_read, NULL, SERIES_SUM, series_u64_value},
+	{"count",  			series_u64_read, NULL, SERIES_COUNT, series_u64_value},
+	{"min",    			series_u64_read, NULL, SERIES_MIN, series_u64_value},
+	{"max",    			series_u64_read, NULL, SERIES_MAX, series_u64_value},
+	{"last",   			series_u64_read, NULL, SERIES_LAST, series_u64_value},
+	{"avg",    			series_u64_read, NULL, SERIES_AVG, series_u64_value},
+	{"mean",   			series_u64_read, NULL, SERIES_MEAN, series_u64_value},
+	{"stddev", 			series_u64_read, NULL, SERIES_STDEV, series_u64_value},
+	{"get_reset_interval_sec", 	series_u64_read, NULL, SERIES_RESET_INTERVAL, series_u64_value},
+	{"reset",			NULL, reset_u64_series},
+	{"reset_interval_sec",		NULL, set_reset_interval_u64_series},
+};
+
+static const struct series_template u64_series_template = {
+	.files = u64_series_files,
+	.nfiles = ARRAY_SIZE(u64_series_files),
+};
+
+int procstat_create_u64_series(struct procstat_context *context, struct procstat_item *parent,
+			       const char *name, struct procstat_series_u64 *series)
+{
+	struct procstat_series *series_stat;
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	series_stat = arena_alloc(&context->arena, sizeof(*series_stat));
+	if (!series_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
+	series_stat->private = series;
+	series_stat->template = &u64_series_template;
+
+	series->min = ULLONG_MAX;
+	series->reset.last_reset_time = procstat_clock();
+	series->reset.reset_flag = 0;
+	series->reset.reset_interval = 0;
+
+	/* the series is readable as soon as it is registered */
+	error = init_directory_ext(context, &series_stat->root, name, (struct procstat_directory *)parent,
+				   STATS_ENTRY_FLAG_SERIES | STATS_ENTRY_FLAG_TEMPLATE);
+	if (error) {
+		free_item(&series_stat->root.base);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+void procstat_u64_series_set_reset_interval(struct procstat_series_u64 *series, int reset_interval)
+{
+	series->reset.reset_interval = reset_interval;
+}
+
+int procstat_create_multiple_u64_series(struct procstat_context *context,
+					struct procstat_item *parent,
+					struct procstat_series_u64_handle *descriptors,
+					size_t series_len)
+{
+	int i;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < series_len; ++i) {
+		int error;
+
+		error = procstat_create_u64_series(context, parent,
+						   descriptors[i].name, descriptors[i].series);
+		if (error) {
+			errno = error;
+			--i;
+			goto error_release;
+		}
+	}
+	return 0;
+error_release:
+	for (;i >= 0; --i)
+		procstat_remove_by_name(context, parent, descriptors[i].name);
+	return -1;
+}
+
+int procstat_create_start_end(struct procstat_context *context,
+			      struct procstat_item *parent,
+			      struct procstat_start_end_handle *descriptors,
+			      size_t descriptors_size)
+{
+	int i;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < descriptors_size; ++i) {
+		struct procstat_start_end_handle *descriptor = &descriptors[i];
+		struct procstat_directory *directory;
+		struct procstat_file *file;
+
+		directory = (struct procstat_directory *)procstat_create_directory(context, parent,
+										   descriptors[i].name);
+		if (!directory) {
+			--i;
+			goto error_release;
+		}
+
+		file = create_file(context, directory, "start", descriptor->start, descriptor->fmt, NULL);
+		if (!file)
+			goto error_release;
+
+		file = create_file(context, directory, "end", descriptor->end, descriptor->fmt, NULL);
+		if (!file) {
+			goto error_release;
+		}
+	}
+	return 0;
+error_release:
+	for (; i >= 0; --i)
+		procstat_remove_by_name(context, parent, descriptors[i].name);
+	return -1;
+}
+
+struct procstat_item *procstat_root(struct procstat_context *context)
+{
+	assert(context);
+	return &context->root.base;
+}
+
+struct procstat_context *procstat_context(struct procstat_item *item)
+{
+	struct procstat_directory *root;
+
+	assert(item);
+
+	if (!item->parent)
+		root = (struct procstat_directory *)item;
+	else
+		for (root = item->parent; root->base.parent != NULL; root = root->base.parent);
+
+	return (struct procstat_context *)root;
+}
+
+void fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	struct stat stat;
+	struct procstat_context *context = request_context(req);
+	struct procstat_item *item;
+
+	memset(&stat, 0, sizeof(stat));
+
+	item = fuse_inode_to_item(context, ino);
+	if (!item_registered(item)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (!fuse_inode_to_file(context, ino)->writer) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	/* only support for truncate as it is needed during write */
+	if (to_set != FUSE_SET_ATTR_SIZE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	fill_item_stats(context, item, &stat);
+	fuse_reply_attr(req, &stat, 1.0);
+}
+
+static void fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct procstat_item *item = fuse_inode_to_item(request_context(req), ino);
+	struct read_struct *fh = (struct read_struct *)fi->fh;
+
+	if (item->flags & STATS_ENTRY_FLAG_AGGREGATOR)
+		aggregator_release(item, fi);
+	else if (fh && fh->ext && !(item->flags & STATS_ENTRY_FLAG_HISTORY))
+		/* the output of stream files, and of formatted files longer than READ_BUFFER_SIZE */
+		stream_clear(fh->ext);
+	item_put(item);
+	if (fh) {
+		pthread_mutex_destroy(&fh->lock);
+		free(fh->ext);
+		free(fh);
+	}
+	fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops fops = {
+	.read = fuse_read,
+	.lookup = fuse_lookup,
+	.forget = fuse_forget,
+	.getattr = fuse_getattr,
+	.opendir = fuse_opendir,
+	.readdir = fuse_readdir,
+	.open = fuse_open,
+	.write = fuse_write,
+	.setattr = fuse_setattr,
+	.release = fuse_release,
+	.releasedir = fuse_releasedir,
+};
+
+static void run_tick_handlers(struct procstat_context *context, uint64_t now)
+{
+	struct procstat_tick_handler *handler;
+
+	pthread_mutex_lock(&context->global_lock);
+	list_for_each_entry(handler, &context->tick_handlers, entry) {
+		/* once unregistered, the owner may free the object behind the handler */
+		if (item_registered(handler->item))
+			handler->tick(handler, now);
+	}
+	pthread_mutex_unlock(&context->global_lock);
+}
+
+static void add_tick_handler(struct procstat_context *context, struct procstat_tick_handler *handler)
+{
+	pthread_mutex_lock(&context->global_lock);
+	list_add_tail(&handler->entry, &context->tick_handlers);
+	pthread_mutex_unlock(&context->global_lock);
+}
+
+static void *ticker_loop(void *arg)
+{
+	struct procstat_context *context = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&context->ticker_lock);
+	while (!context->ticker_stop) {
+		procstat_clock_update();
+		if (procstat_clock() != context->last_tick) {
+			context->last_tick = procstat_clock();
+			pthread_mutex_unlock(&context->ticker_lock);
+			run_tick_handlers(context, context->last_tick);
+			pthread_mutex_lock(&context->ticker_lock);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += TICKER_INTERVAL_MSEC * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			++deadline.tv_sec;
+		}
+		pthread_cond_timedwait(&context->ticker_cond, &context->ticker_lock, &deadline);
+	}
+	pthread_mutex_unlock(&context->ticker_lock);
+	return NULL;
+}
+
+static int ticker_start(struct procstat_context *context)
+{
+	pthread_condattr_t attr;
+	int error;
+
+	pthread_mutex_init(&context->ticker_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&context->ticker_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	procstat_clock_update();
+	context->last_tick = procstat_clock();
+	error = pthread_create(&context->ticker, NULL, ticker_loop, context);
+	if (error)
+		return error;
+	context->ticker_started = true;
+	return 0;
+}
+
+static void ticker_stop(struct procstat_context *context)
+{
+	if (!context->ticker_started)
+		return;
+
+	pthread_mutex_lock(&context->ticker_lock);
+	context->ticker_stop = true;
+	pthread_cond_signal(&context->ticker_cond);
+	pthread_mutex_unlock(&context->ticker_lock);
+	pthread_join(context->ticker, NULL);
+	context->ticker_started = false;
+}
+
+static void history_add_sample(struct procstat_history *history, uint64_t now, const char *value, ssize_t len)
+{
+	struct history_sample *sample = &history->samples[history->next];
+
+	len = MAX(0, MIN(len, HISTORY_VALUE_LEN - 1));
+	if (len && value[len - 1] == '\n')
+		--len;
+	memcpy(sample->value, value, len);
+	sample->value[len] = 0;
+	sample->time_msec = now;
+	history->next = (history->next + 1) % history->nsamples;
+	++history->count;
+}
+
+/*
+ * global_lock is released while a stat is formatted, so a large tree does not block fuse for the whole walk.
+ * The reference on the view keeps the history (and so the list position) valid meanwhile, it is dropped
+ * only after the lock is released since the view may be freed.
+ */
+static void sampler_walk(struct procstat_context *context)
+{
+	struct procstat_history *history;
+	struct procstat_item *held = NULL;
+	struct list_head *next;
+	char buffer[READ_BUFFER_SIZE];
+	struct timespec ts;
+	uint64_t now;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+
+	pthread_mutex_lock(&context->global_lock);
+	next = context->histories.next;
+	while (next != &context->histories) {
+		struct procstat_file *source;
+		ssize_t len;
+
+		history = list_entry(next, struct procstat_history, entry);
+		source = history->source;
+		/* See fuse_read(): stat memory may be freed once the parent directory is unregistered */
+		if (!item_registered(&source->base) || !source->base.parent ||
+		    !item_registered(&source->base.parent->base)) {
+			next = next->next;
+			continue;
+		}
+
+		item_get(&history->view->base);
+		pthread_mutex_unlock(&context->global_lock);
+		if (held)
+			item_put(held);
+		held = &history->view->base;
+		len = file_format(source, buffer, sizeof(buffer));
+		pthread_mutex_lock(&context->global_lock);
+		history_add_sample(history, now, buffer, len);
+		next = history->entry.next;
+	}
+	pthread_mutex_unlock(&context->global_lock);
+	if (held)
+		item_put(held);
+}
+
+static void *sampler_loop(void *arg)
+{
+	struct procstat_context *context = arg;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	pthread_mutex_lock(&context->sampler_lock);
+	while (!context->sampler_stop) {
+		pthread_mutex_unlock(&context->sampler_lock);
+		sampler_walk(context);
+		pthread_mutex_lock(&context->sampler_lock);
+
+		deadline.tv_sec += context->sampler_interval_msec / 1000;
+		deadline.tv_nsec += (context->sampler_interval_msec % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			++deadline.tv_sec;
+		}
+		while (!context->sampler_stop &&
+		       pthread_cond_timedwait(&context->sampler_cond, &context->sampler_lock, &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&context->sampler_lock);
+	return NULL;
+}
+
+int procstat_sampler_start(struct procstat_context *context, unsigned interval_msec)
+{
+	pthread_condattr_t attr;
+	int error;
+
+	if (!interval_msec || context->sampler_started) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_init(&context->sampler_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&context->sampler_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	context->sampler_interval_msec = interval_msec;
+	context->sampler_stop = false;
+	error = pthread_create(&context->sampler, NULL, sampler_loop, context);
+	if (error) {
+		pthread_mutex_destroy(&context->sampler_lock);
+		pthread_cond_destroy(&context->sampler_cond);
+		errno = error;
+		return -1;
+	}
+	context->sampler_started = true;
+	return 0;
+}
+
+void procstat_sampler_stop(struct procstat_context *context)
+{
+	if (!context->sampler_started)
+		return;
+
+	pthread_mutex_lock(&context->sampler_lock);
+	context->sampler_stop = true;
+	pthread_cond_signal(&context->sampler_cond);
+	pthread_mutex_unlock(&context->sampler_lock);
+	pthread_join(context->sampler, NULL);
+	pthread_mutex_destroy(&context->sampler_lock);
+	pthread_cond_destroy(&context->sampler_cond);
+	context->sampler_started = false;
+}
+
+/* @parent is the directory of @source, which may be removed meanwhile */
+static int create_file_history(struct procstat_context *context, struct procstat_directory *parent,
+			       struct procstat_file *source, unsigned nsamples)
+{
+	const char *name = procstat_item_name(&source->base);
+	char view_name[strlen(name) + sizeof(HISTORY_SUFFIX)];
+	struct procstat_history *history;
+	struct procstat_file *view;
+
+	history = calloc(1, sizeof(*history) + nsamples * sizeof(history->samples[0]));
+	if (!history) {
+		errno = ENOMEM;
+		return -1;
+	}
+	history->nsamples = nsamples;
+	history->context = context;
+	INIT_LIST_HEAD(&history->entry);
+
+	sprintf(view_name, "%s" HISTORY_SUFFIX, name);
+	view = create_file_ext(context, parent, view_name, history, NULL, NULL,
+			       STATS_ENTRY_FLAG_HISTORY, 0);
+	if (!view) {
+		free(history);
+		return -1;
+	}
+
+	item_get(&source->base);
+	item_set_flags(&source->base, STATS_ENTRY_FLAG_SAMPLED);
+	pthread_mutex_lock(&context->global_lock);
+	history->source = source;
+	history->view = view;
+	list_add_tail(&history->entry, &context->histories);
+	pthread_mutex_unlock(&context->global_lock);
+	return 0;
+}
+
+static int create_history(struct procstat_context *context, struct procstat_directory *parent,
+			  struct procstat_item *item, unsigned nsamples)
+{
+	struct procstat_directory *directory;
+	struct procstat_item **children, *child;
+	unsigned nchildren = 0;
+	unsigned i;
+	int error = 0;
+
+	if (!item_type_directory(item)) {
+		struct procstat_file *file = container_of(item, struct procstat_file, base);
+
+		if (!file->fmt || (item->flags & (STATS_ENTRY_FLAG_AGGREGATOR | STATS_ENTRY_FLAG_SAMPLED |
+						  STATS_ENTRY_FLAG_HISTORY)))
+			return 0;
+		return create_file_history(context, parent, file, nsamples);
+	}
+
+	directory = container_of(item, struct procstat_directory, base);
+	if (template_materialize(context, directory)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/*
+	 * Creating a history view write locks the directory, so its children are collected under the read
+	 * lock, each with a reference. Views added meanwhile are not collected.
+	 */
+	pthread_rwlock_rdlock(&directory->lock);
+	children = calloc(directory->nchildren + 1, sizeof(*children));
+	if (!children) {
+		pthread_rwlock_unlock(&directory->lock);
+		errno = ENOMEM;
+		return -1;
+	}
+	list_for_each_entry(child, &directory->children, entry) {
+		item_get(child);
+		children[nchildren++] = child;
+	}
+	pthread_rwlock_unlock(&directory->lock);
+
+	for (i = 0; i < nchildren; ++i) {
+		if (!error && item_registered(children[i]))
+			error = create_history(context, directory, children[i], nsamples) ? errno : 0;
+		item_put(children[i]);
+	}
+	free(children);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int procstat_create_history(struct procstat_context *context,
+			    struct procstat_item *item,
+			    unsigned nsamples)
+{
+	if (!item || !nsamples || !item_registered(item) || (!item_type_directory(item) && !item->parent)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return create_history(context, item->parent, item, nsamples);
+}
+
+#define ROOT_DIR_NAME "."
+struct procstat_context *procstat_create(const char *mountpoint)
+{
+	struct procstat_context *context;
+	char *argv[] = {(char *)"stats", (char *)"-o", (char *)"auto_unmount", (char *)mountpoint, NULL};
+	struct fuse_args args = FUSE_ARGS_INIT(ARRAY_SIZE(argv)-1, argv);
+	char *full_path_mountpoint;
+	int error;
+	struct fuse_chan *channel;
+
+	error = mkdir(mountpoint, 0755);
+	if (error) {
+		if (errno != EEXIST)
+			return NULL;
+	}
+
+	error = fuse_parse_cmdline(&args, &full_path_mountpoint, NULL, NULL);
+	if (error) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	context = calloc(1, sizeof(*context));
+	if (!context) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	context->mountpoint = full_path_mountpoint;
+	context->uid = getuid();
+	context->gid = getgid();
+
+	pthread_mutex_init(&context->global_lock, NULL);
+	pthread_mutex_init(&context->shm_lock, NULL);
+	pthread_mutex_init(&context->inodes_lock, NULL);
+	INIT_LIST_HEAD(&context->tick_handlers);
+	INIT_LIST_HEAD(&context->histories);
+	arena_init(&context->arena);
+	init_directory(context, &context->root, ROOT_DIR_NAME, NULL);
+
+	error = ticker_start(context);
+	if (error) {
+		errno = error;
+		goto free_stats;
+	}
+
+	channel = fuse_mount(context->mountpoint, &args);
+	if (!channel) {
+		errno = EFAULT;
+		goto free_stats;
+	}
+
+	context->session = fuse_lowlevel_new(&args, &fops, sizeof(fops), context);
+	if (!context->session) {
+		errno = EPERM;
+		goto free_stats;
+	}
+
+	fuse_opt_free_args(&args);
+	fuse_session_add_chan(context->session, channel);
+	return context;
+free_stats:
+	procstat_destroy(context);
+	return NULL;
+}
+
+void procstat_stop(struct procstat_context *context)
+{
+	struct fuse_session *session;
+
+	assert(context);
+	session = context->session;
+
+	if (session)
+		fuse_session_exit(session);
+}
+
+void procstat_destroy(struct procstat_context *context)
+{
+	struct fuse_session *session;
+
+	assert(context);
+	session = context->session;
+
+	ticker_stop(context);
+	procstat_sampler_stop(context);
+	shm_refresher_stop(context);
+	if (session) {
+		struct fuse_chan *channel = NULL;
+
+		assert(context->mountpoint);
+		fuse_session_exit(session);
+		channel = fuse_session_next_chan(session, channel);
+		assert(channel);
+		fuse_session_remove_chan(channel);
+
+		fuse_unmount(context->mountpoint, channel);
+		fuse_session_destroy(session);
+	}
+
+	/* items still release what they own, their memory goes with the slabs */
+	context->arena.teardown = true;
+	pthread_rwlock_wrlock(&context->root.lock);
+	item_put_children_locked(&context->root);
+	pthread_rwlock_unlock(&context->root.lock);
+	dir_listing_put(context->root.listing);
+	directory_hash_free(&context->root);
+	pthread_rwlock_destroy(&context->root.lock);
+	if (context->shm)
+		shm_destroy(context->shm);
+	arena_destroy(&context->arena);
+	free(context->mountpoint);
+	pthread_mutex_destroy(&context->shm_lock);
+	pthread_mutex_destroy(&context->inodes_lock);
+	pthread_mutex_destroy(&context->global_lock);
+	pthread_mutex_destroy(&context->ticker_lock);
+	pthread_cond_destroy(&context->ticker_cond);
+
+	/* debug purposes of use after free*/
+	context->mountpoint = NULL;
+	context->session = NULL;
+	free(context);
+}
+
+void procstat_loop(struct procstat_context *context)
+{
+	fuse_session_loop(context->session);
+}
+
+struct loop_mt {
+	struct fuse_session 	*session;
+	struct fuse_chan 	*channel;
+	sem_t 			finished; /* posted by every worker that leaves the loop */
+};
+
+/* workers can be cancelled only while waiting for a request, so a request is never left half processed */
+static void *loop_worker(void *arg)
+{
+	struct loop_mt *loop = arg;
+	size_t size = fuse_chan_bufsize(loop->channel);
+	char *buffer;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	buffer = malloc(size);
+	if (!buffer)
+		goto out;
+	pthread_cleanup_push(free, buffer);
+
+	while (!fuse_session_exited(loop->session)) {
+		struct fuse_chan *channel = loop->channel;
+		int ret;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ret = fuse_chan_recv(&channel, buffer, size);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (ret == -EINTR || ret == -EAGAIN)
+			continue;
+		if (ret <= 0)
+			break; /* unmounted or error */
+		fuse_session_process(loop->session, buffer, ret, channel);
+	}
+
+	pthread_cleanup_pop(1);
+out:
+	fuse_session_exit(loop->session);
+	sem_post(&loop->finished);
+	return NULL;
+}
+
+int procstat_loop_mt(struct procstat_context *context, unsigned nthreads)
+{
+	struct loop_mt loop;
+	pthread_t *workers;
+	unsigned nworkers;
+	int error = 0;
+
+	if (!nthreads) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	loop.session = context->session;
+	loop.channel = fuse_session_next_chan(context->session, NULL);
+	sem_init(&loop.finished, 0, 0);
+	for (nworkers = 0; nworkers < nthreads; ++nworkers) {
+		error = pthread_create(&workers[nworkers], NULL, loop_worker, &loop);
+		if (error)
+			break;
+	}
+
+	/* the first worker to leave ends the loop for all, the others may be blocked on an idle channel */
+	if (!error)
+		sem_wait(&loop.finished);
+	while (nworkers--) {
+		pthread_cancel(workers[nworkers]);
+		pthread_join(workers[nworkers], NULL);
+	}
+	sem_destroy(&loop.finished);
+	free(workers);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+static bool percentile_cache_valid(struct procstat_percentile_cache *cache, uint64_t count,
+				   struct reset_info *reset)
+{
+	return cache->valid && cache->count == count &&
+	       cache->epoch == __atomic_load_n(&reset->epoch, __ATOMIC_ACQUIRE);
+}
+
+static void percentile_cache_update(struct procstat_percentile_cache *cache, uint64_t count,
+				    struct reset_info *reset)
+{
+	cache->count = count;
+	cache->epoch = __atomic_load_n(&reset->epoch, __ATOMIC_ACQUIRE);
+	cache->valid = 1;
+}
+
+/*
+ * Sum up the valid shards into series fields, and in case @histogram is set
+ * merge shard buckets into series->histogram as well.
+ */
+static void merge_histogram_shards(struct procstat_histogram_u32 *series, bool histogram)
+{
+	unsigned epoch = __atomic_load_n(&series->reset.epoch, __ATOMIC_ACQUIRE);
+	unsigned i, j;
+
+	series->sum = 0;
+	series->count = 0;
+	if (histogram)
+		memset(series->histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*series->histogram));
+
+	for (i = 0; i < series->nshards; ++i) {
+		struct procstat_histogram_shard *shard = &series->shards[i];
+
+		if (__atomic_load_n(&shard->epoch, __ATOMIC_ACQUIRE) != epoch)
+			continue; /* not written since the last reset */
+		if (!__atomic_load_n(&shard->count, __ATOMIC_RELAXED))
+			continue;
+
+		series->sum += __atomic_load_n(&shard->sum, __ATOMIC_RELAXED);
+		series->count += __atomic_load_n(&shard->count, __ATOMIC_RELAXED);
+		series->last = __atomic_load_n(&shard->last, __ATOMIC_RELAXED);
+		if (!histogram)
+			continue;
+		for (j = 0; j < PROCSTAT_PERCENTILE_ARR_NR; ++j)
+			series->histogram[j] += __atomic_load_n(&shard->histogram[j], __ATOMIC_RELAXED);
+	}
+}
+
+static uint64_t histogram_u32_percentile_value(void *object, uint64_t arg)
+{
+	struct procstat_histogram_u32 *series = object;
+	uint64_t count;
+
+	if (series->shards)
+		histogram_reset(series);
+
+	if (__atomic_load_n(&series->reset.reset_flag, __ATOMIC_ACQUIRE))
+		return 0;
+
+	if (series->shards)
+		merge_histogram_shards(series, false);
+	count = *((volatile uint64_t *)&series->count);
+	if (!percentile_cache_valid(&series->cache, count, &series->reset)) {
+		if (series->shards) {
+			merge_histogram_shards(series, true);
+			count = series->count;
+		}
+		series->compute_cb(series->histogram, count, series->percentile, series->npercentile);
+		percentile_cache_update(&series->cache, count, &series->reset);
+	}
+	return series->percentile[arg].value;
+}
+
+static ssize_t procstat_fmt_u32_percentile(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	return procstat_print_u64(buffer, length, histogram_u32_percentile_value(object, arg));
+}
+
+void clear_values_histogram(struct procstat_histogram_u32 *series)
+{
+	series->count = 0;
+	series->sum = 0;
+	series->last = 0;
+	memset(series->histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*series->histogram));
+	++series->reset.epoch;
+	__atomic_store_n(&series->reset.reset_flag, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Epochs of a sharded histogram are even, odd shard epoch marks a shard being cleared by a writer.
+ */
+#define HISTOGRAM_SHARD_CLEARING 1u
+#define HISTOGRAM_EPOCH_STEP 2u
+
+/* Claims a due reset, only one of the threads seeing it at once gets true */
+static bool reset_claim(struct reset_info *reset)
+{
+	uint64_t reset_interval;
+	uint64_t last;
+	uint64_t now;
+	unsigned flag = 1;
+
+	reset_interval = __atomic_load_n(&reset->reset_interval, __ATOMIC_RELAXED);
+	if (unlikely(reset_interval)) {
+		now = procstat_clock();
+		last = __atomic_load_n(&reset->last_reset_time, __ATOMIC_RELAXED);
+		if (now - last > reset_interval &&
+		    __atomic_compare_exchange_n(&reset->last_reset_time, &last, now, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&reset->reset_flag, 0, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+
+	return __atomic_load_n(&reset->reset_flag, __ATOMIC_RELAXED) &&
+	       __atomic_compare_exchange_n(&reset->reset_flag, &flag, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * Resets the histogram in case it is due. Shards cannot be cleared by a reader while writers record
+ * into them, so only readers reset a sharded histogram, by moving the epoch forward, and every shard
+ * is cleared on its next point. Writers of a sharded histogram never reset it.
+ */
+static void histogram_reset(struct procstat_histogram_u32 *series)
+{
+	if (!series->shards) {
+		if (is_reset(&series->reset))
+			clear_values_histogram(series);
+		return;
+	}
+
+	if (reset_claim(&series->reset))
+		__atomic_add_fetch(&series->reset.epoch, HISTOGRAM_EPOCH_STEP, __ATOMIC_RELEASE);
+}
+
+/*
+ * A shard is shared in case there are more threads than shards. A stale shard is cleared by the writer
+ * that wins the CAS on its epoch, the others move on to the next shard rather than wait for it. A point
+ * racing with the reset of every shard is counted as recorded before the reset, and dropped.
+ */
+static struct procstat_histogram_shard *histogram_current_shard(struct procstat_histogram_u32 *series)
+{
+	unsigned epoch = __atomic_load_n(&series->reset.epoch, __ATOMIC_ACQUIRE);
+	unsigned slot = procstat_thread_slot_get();
+	struct procstat_histogram_shard *shard;
+	unsigned shard_epoch;
+	unsigned i;
+
+	for (i = 0; i < series->nshards; ++i) {
+		shard = &series->shards[(slot + i) & (series->nshards - 1)];
+		shard_epoch = __atomic_load_n(&shard->epoch, __ATOMIC_ACQUIRE);
+		if (likely(shard_epoch == epoch))
+			return shard;
+		if (shard_epoch & HISTOGRAM_SHARD_CLEARING)
+			continue;
+		if (!__atomic_compare_exchange_n(&shard->epoch, &shard_epoch, epoch | HISTOGRAM_SHARD_CLEARING,
+						 false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+
+		shard->count = 0;
+		shard->sum = 0;
+		shard->last = 0;
+		memset(shard->histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*shard->histogram));
+		__atomic_store_n(&shard->epoch, epoch, __ATOMIC_RELEASE);
+		return shard;
+	}
+	return NULL;
+}
+
+static void histogram_shard_add_point(struct procstat_histogram_u32 *series, uint32_t value)
+{
+	struct procstat_histogram_shard *shard = histogram_current_shard(series);
+
+	if (unlikely(!shard))
+		return;
+
+	/* shard is shared only in case there are more threads than shards */
+	__atomic_fetch_add(&shard->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->sum, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&shard->last, value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->histogram[procstat_hist_value_to_index(value)], 1, __ATOMIC_RELAXED);
+}
+
+void procstat_histogram_u32_add_point(struct procstat_histogram_u32 *series, uint32_t value)
+{
+	if (series->shards) {
+		histogram_shard_add_point(series, value);
+		return;
+	}
+
+	if (is_reset(&series->reset))
+		clear_values_histogram(series);
+
+	++series->count;
+	series->sum += value;
+	series->last = value;
+
+	procstat_hist_add_point(series->histogram, value);
+}
+
+#define HISTOGRAM_BATCH_SIZE 64
+static void histogram_shard_add_points(struct procstat_histogram_u32 *series,
+				       const uint32_t *values, size_t n, uint64_t sum)
+{
+	struct procstat_histogram_shard *shard = histogram_current_shard(series);
+	uint32_t index[HISTOGRAM_BATCH_SIZE];
+	size_t batch, i;
+
+	if (unlikely(!shard))
+		return;
+
+	__atomic_fetch_add(&shard->count, n, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->sum, sum, __ATOMIC_RELAXED);
+	__atomic_store_n(&shard->last, values[n - 1], __ATOMIC_RELAXED);
+
+	for (; n; n -= batch, values += batch) {
+		batch = MIN(n, HISTOGRAM_BATCH_SIZE);
+		procstat_hist_values_to_index(values, index, batch);
+		for (i = 0; i < batch; ++i)
+			__atomic_fetch_add(&shard->histogram[index[i]], 1, __ATOMIC_RELAXED);
+	}
+}
+
+void procstat_histogram_u32_add_points(struct procstat_histogram_u32 *series, const uint32_t *values, size_t n)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	if (!n)
+		return;
+
+	for (i = 0; i < n; ++i)
+		sum += values[i];
+
+	if (series->shards) {
+		histogram_shard_add_points(series, values, n, sum);
+		return;
+	}
+
+	if (is_reset(&series->reset))
+		clear_values_histogram(series);
+
+	series->count += n;
+	series->sum += sum;
+	series->last = values[n - 1];
+
+	procstat_hist_add_points(series->histogram, values, n);
+}
+
+enum histogram_u32_series_type{
+	HISTOGRAM_SUM = 0,
+	HISTOGRAM_COUNT = 1,
+	HISTOGRAM_LAST = 2,
+	HISTOGRAM_AVG = 3,
+	HISTOGRAM_RESET_INTERVAL = 4,
+};
+
+static uint64_t histogram_u32_series_value(void *object, uint64_t arg)
+{
+	struct procstat_histogram_u32 *series = object;
+	enum histogram_u32_series_type type = arg;
+	uint64_t count;
+
+	histogram_reset(series);
+
+	if (series->shards)
+		merge_histogram_shards(series, false);
+
+	count = *((volatile uint64_t *)&series->count);
+	switch (type) {
+	case HISTOGRAM_SUM:
+		return series->sum;
+	case HISTOGRAM_COUNT:
+		return count;
+	case HISTOGRAM_LAST:
+		return series->last;
+	case HISTOGRAM_AVG:
+		return count ? series->sum / count : 0;
+	case HISTOGRAM_RESET_INTERVAL:
+		return series->reset.reset_interval;
+	default:
+		return 0;
+	}
+}
+
+static ssize_t histogram_u32_series_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return procstat_print_u64(buffer, len, histogram_u32_series_value(object, arg));
+}
+
+static ssize_t reset_histogram_u32_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_histogram_u32 *series = series_stat->private;
+	uint32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control != 1)
+		return EINVAL;
+
+	/* points recorded from now on are kept, rather than cleared by the next read */
+	if (series->shards) {
+		__atomic_add_fetch(&series->reset.epoch, HISTOGRAM_EPOCH_STEP, __ATOMIC_RELEASE);
+		return 1;
+	}
+	__atomic_store_n(&series->reset.reset_flag, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static ssize_t reset_interval_histogram_u32_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_histogram_u32 *series = series_stat->private;
+	int32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control < 0)
+		return EINVAL;
+
+	__atomic_store_n(&series->reset.reset_interval, control, __ATOMIC_RELAXED);
+	return 1; 
+}
+
+static int allocate_histogram_shards(struct procstat_histogram_u32 *series)
+{
+	size_t buckets_size = PROCSTAT_PERCENTILE_ARR_NR * sizeof(uint32_t);
+	unsigned nshards = 1;
+	uint32_t *buckets;
+	unsigned i;
+
+	while (nshards < series->nshards)
+		nshards <<= 1;
+
+	if (posix_memalign((void **)&series->shards, PROCSTAT_CACHELINE_SIZE,
+			   nshards * sizeof(*series->shards)))
+		return ENOMEM;
+	if (posix_memalign((void **)&buckets, PROCSTAT_CACHELINE_SIZE, nshards * buckets_size)) {
+		free(series->shards);
+		series->shards = NULL;
+		return ENOMEM;
+	}
+	memset(series->shards, 0, nshards * sizeof(*series->shards));
+	memset(buckets, 0, nshards * buckets_size);
+
+	series->reset.epoch &= ~HISTOGRAM_SHARD_CLEARING;
+	for (i = 0; i < nshards; ++i) {
+		series->shards[i].histogram = buckets + i * PROCSTAT_PERCENTILE_ARR_NR;
+		series->shards[i].epoch = series->reset.epoch;
+	}
+	series->nshards = nshards;
+	return 0;
+}
+
+static unsigned histogram_u32_npercentile(void *series)
+{
+	return MAX(((struct procstat_histogram_u32 *)series)->npercentile, 0);
+}
+
+static double histogram_u32_fraction(void *series, unsigned index)
+{
+	return ((struct procstat_histogram_u32 *)series)->percentile[index].fraction;
+}
+
+static const struct template_file histogram_u32_series_files[] = {
+	{"sum",    			histogram_u32_series_read, NULL, HISTOGRAM_SUM, histogram_u32_series_value},
+	{"count",  			histogram_u32_series_read, NULL, HISTOGRAM_COUNT, histogram_u32_series_value},
+	{"last",   			histogram_u32_series_read, NULL, HISTOGRAM_LAST, histogram_u32_series_value},
+	{"avg",    			histogram_u32_series_read, NULL, HISTOGRAM_AVG, histogram_u32_series_value},
+	{"get_reset_interval_sec",  	histogram_u32_series_read, NULL, HISTOGRAM_RESET_INTERVAL, histogram_u32_series_value},
+	{NULL,				procstat_fmt_u32_percentile, NULL, 0, histogram_u32_percentile_value},
+	{"reset",			NULL, reset_histogram_u32_series},
+	{"reset_interval_sec",		NULL, reset_interval_histogram_u32_series},
+};
+
+static const struct series_template histogram_u32_series_template = {
+	.files = histogram_u32_series_files,
+	.nfiles = ARRAY_SIZE(histogram_u32_series_files),
+	.npercentile = histogram_u32_npercentile,
+	.fraction = histogram_u32_fraction,
+};
+
+int procstat_create_histogram_u32_series(struct procstat_context *context, struct procstat_item *parent,
+					 const char *name, struct procstat_histogram_u32 *series)
+{
+	struct procstat_series *series_stat;
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	series_stat = arena_alloc(&context->arena, sizeof(*series_stat));
+	if (!series_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
+	series_stat->private = series;
+	series_stat->template = &histogram_u32_series_template;
+	if (!template_names_unique(series_stat)) {
+		arena_free(series_stat);
+		errno = EEXIST;
+		return -1;
+	}
+
+	/* the series is readable as soon as it is registered, so it is fully set up before */
+	series->histogram = calloc(PROCSTAT_PERCENTILE_ARR_NR, sizeof(uint32_t));
+	if (!series->histogram) {
+		arena_free(series_stat);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (series->nshards) {
+		error = allocate_histogram_shards(series);
+		if (error) {
+			free_histogram(series_stat);
+			arena_free(series_stat);
+			errno = error;
+			return -1;
+		}
+	}
 
-	/* debug purposes of use after free*/
-	context->mountpoint = NULL;
-	context->session = NULL;
-	free(context);
+	if (!series->compute_cb)
+		series->compute_cb = procstat_percentile_calculate;
+	series->cache.valid = 0;
+	series->reset.last_reset_time = procstat_clock();
+	series->reset.reset_flag = 0;
+	series->reset.reset_interval = 0;
+
+	error = init_directory_ext(context, &series_stat->root, name, (struct procstat_directory *)parent,
+				   STATS_ENTRY_FLAG_HISTOGRAM | STATS_ENTRY_FLAG_SERIES | STATS_ENTRY_FLAG_TEMPLATE);
+	if (error) {
+		free_item(&series_stat->root.base);
+		errno = error;
+		return -1;
+	}
+	return 0;
 }
 
-void procstat_loop(struct procstat_context *context)
+void procstat_histogram_u32_series_set_reset_interval(struct procstat_histogram_u32 *series, int reset_interval)
 {
-	fuse_session_loop(context->session);
+	series->reset.reset_interval = reset_interval;
 }
 
-static ssize_t procstat_fmt_u32_percentile(void *object, uint64_t arg, char *buffer, size_t length)
+static uint64_t histogram_u64_percentile_value(void *object, uint64_t arg)
 {
-	struct procstat_histogram_u32 *series = object;
-	unsigned reset;
-	uint32_t zero = 0;
-	uint32_t *data_ptr = NULL;
+	struct procstat_histogram_u64 *series = object;
+	uint64_t count;
 
-	reset = __atomic_load_n(&series->reset.reset_flag, __ATOMIC_ACQUIRE);
-	if (reset) {
-		data_ptr = &zero;
-	} else {
-		series->compute_cb(series->histogram, series->count, series->percentile, series->npercentile);
-		data_ptr = &series->percentile[arg].value;
+	if (__atomic_load_n(&series->reset.reset_flag, __ATOMIC_ACQUIRE))
+		return 0;
+
+	count = *((volatile uint64_t *)&series->count);
+	if (!percentile_cache_valid(&series->cache, count, &series->reset)) {
+		procstat_percentile_calculate_u64(&series->geometry, series->histogram, count,
+						  series->percentile, series->npercentile);
+		percentile_cache_update(&series->cache, count, &series->reset);
 	}
-	return procstat_format_u32_decimal(data_ptr, 0, buffer, length);
+	return series->percentile[arg].value;
 }
 
-void clear_values_histogram(struct procstat_histogram_u32 *series)
+static ssize_t procstat_fmt_u64_percentile(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	return procstat_print_u64(buffer, length, histogram_u64_percentile_value(object, arg));
+}
+
+void clear_values_histogram_u64(struct procstat_histogram_u64 *series)
 {
 	series->count = 0;
 	series->sum = 0;
 	series->last = 0;
-	memset(series->histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*series->histogram));
+	memset(series->histogram, 0, series->geometry.nbuckets * sizeof(*series->histogram));
+	++series->reset.epoch;
 	__atomic_store_n(&series->reset.reset_flag, 0, __ATOMIC_RELEASE);
 }
 
-void procstat_histogram_u32_add_point(struct procstat_histogram_u32 *series, uint32_t value)
+void procstat_histogram_u64_add_point(struct procstat_histogram_u64 *series, uint64_t value)
 {
-	if (is_reset(&series->reset)) {
-		clear_values_histogram(series);
-	}
+	if (is_reset(&series->reset))
+		clear_values_histogram_u64(series);
 
 	++series->count;
 	series->sum += value;
 	series->last = value;
 
-	procstat_hist_add_point(series->histogram, value);
+	++series->histogram[procstat_hist_u64_value_to_index(&series->geometry, value)];
 }
 
-enum histogram_u32_series_type{
-	HISTOGRAM_SUM = 0,
-	HISTOGRAM_COUNT = 1,
-	HISTOGRAM_LAST = 2,
-	HISTOGRAM_AVG = 3,
-	HISTOGRAM_RESET_INTERVAL = 4,
-};
-
-static ssize_t histogram_u32_series_read(void *object, uint64_t arg, char *buffer, size_t len)
+static uint64_t histogram_u64_series_value(void *object, uint64_t arg)
 {
-	struct procstat_histogram_u32 *series = object;
+	struct procstat_histogram_u64 *series = object;
 	enum histogram_u32_series_type type = arg;
-	uint64_t *data_ptr = NULL;
-	uint64_t data;
 	uint64_t count;
 
-	if (is_reset(&series->reset)) {
-		clear_values_histogram(series);
-	}
+	if (is_reset(&series->reset))
+		clear_values_histogram_u64(series);
 
+	count = *((volatile uint64_t *)&series->count);
 	switch (type) {
 	case HISTOGRAM_SUM:
-		data_ptr = &series->sum;
-		goto write_var;
+		return series->sum;
 	case HISTOGRAM_COUNT:
-		count = *((volatile uint64_t *)&series->count);
-		data_ptr = &series->count;
-		goto write_var;
+		return count;
 	case HISTOGRAM_LAST:
-		data_ptr = &series->last;
-		goto write_var;
+		return series->last;
 	case HISTOGRAM_AVG:
-		count = *((volatile uint64_t *)&series->count);
-		if (!count)
-			goto write_zero;
-		data = series->sum / count;
-		data_ptr = &data;
-		goto write_var;
+		return count ? series->sum / count : 0;
 	case HISTOGRAM_RESET_INTERVAL:
-		data_ptr = &series->reset.reset_interval;
-		goto write_var;
+		return series->reset.reset_interval;
 	default:
-		return -1;
+		return 0;
 	}
-write_zero:
-	return snprintf(buffer, len, "0\n");
-write_var:
-	return procstat_format_u64_decimal(data_ptr, arg, buffer, len);
 }
 
-static ssize_t reset_histogram_u32_series(void *object, uint64_t arg, char *buffer, size_t length)
+static ssize_t histogram_u64_series_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return procstat_print_u64(buffer, len, histogram_u64_series_value(object, arg));
+}
+
+static ssize_t reset_histogram_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
 {
 	struct procstat_series *series_stat = object;
-	struct procstat_histogram_u32 *series = series_stat->private;
+	struct procstat_histogram_u64 *series = series_stat->private;
 	uint32_t control;
 
 	control = strtoul(buffer, NULL, 10);
@@ -1640,10 +5709,10 @@ static ssize_t reset_histogram_u32_series(void *object, uint64_t arg, char *buff
 	return 1;
 }
 
-static ssize_t reset_interval_histogram_u32_series(void *object, uint64_t arg, char *buffer, size_t length)
+static ssize_t reset_interval_histogram_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
 {
 	struct procstat_series *series_stat = object;
-	struct procstat_histogram_u32 *series = series_stat->private;
+	struct procstat_histogram_u64 *series = series_stat->private;
 	int32_t control;
 
 	control = strtoul(buffer, NULL, 10);
@@ -1651,26 +5720,75 @@ static ssize_t reset_interval_histogram_u32_series(void *object, uint64_t arg, c
 		return EINVAL;
 
 	__atomic_store_n(&series->reset.reset_interval, control, __ATOMIC_RELAXED);
-	return 1; 
+	return 1;
 }
 
-int procstat_create_histogram_u32_series(struct procstat_context *context, struct procstat_item *parent,
-					 const char *name, struct procstat_histogram_u32 *series)
+static unsigned histogram_u64_npercentile(void *series)
+{
+	return MAX(((struct procstat_histogram_u64 *)series)->npercentile, 0);
+}
+
+static double histogram_u64_fraction(void *series, unsigned index)
+{
+	return ((struct procstat_histogram_u64 *)series)->percentile[index].fraction;
+}
+
+static const struct template_file histogram_u64_series_files[] = {
+	{"sum",    			histogram_u64_series_read, NULL, HISTOGRAM_SUM, histogram_u64_series_value},
+	{"count",  			histogram_u64_series_read, NULL, HISTOGRAM_COUNT, histogram_u64_series_value},
+	{"last",   			histogram_u64_series_read, NULL, HISTOGRAM_LAST, histogram_u64_series_value},
+	{"avg",    			histogram_u64_series_read, NULL, HISTOGRAM_AVG, histogram_u64_series_value},
+	{"get_reset_interval_sec",  	histogram_u64_series_read, NULL, HISTOGRAM_RESET_INTERVAL, histogram_u64_series_value},
+	{NULL,				procstat_fmt_u64_percentile, NULL, 0, histogram_u64_percentile_value},
+	{"reset",			NULL, reset_histogram_u64_series},
+	{"reset_interval_sec",		NULL, reset_interval_histogram_u64_series},
+};
+
+static const struct series_template histogram_u64_series_template = {
+	.files = histogram_u64_series_files,
+	.nfiles = ARRAY_SIZE(histogram_u64_series_files),
+	.npercentile = histogram_u64_npercentile,
+	.fraction = histogram_u64_fraction,
+};
+
+static const struct series_template *const series_templates[] = {
+	&u64_series_template, &histogram_u32_series_template, &histogram_u64_series_template,
+};
+
+/*
+ * Raw value of a file of a template series, synthesized or materialized, read under the series lock.
+ * Returns false for files with no raw value, @value may be NULL to only check for one.
+ */
+static bool series_file_value(struct procstat_file *file, uint64_t *value)
+{
+	pthread_mutex_t *lock = series_read_lock(file->base.parent);
+	unsigned i, j;
+
+	if (!lock)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(series_templates); ++i) {
+		for (j = 0; j < series_templates[i]->nfiles; ++j) {
+			const struct template_file *entry = &series_templates[i]->files[j];
+
+			if (!entry->value || entry->fmt != file->fmt)
+				continue;
+			if (value) {
+				pthread_mutex_lock(lock);
+				*value = entry->value(file->private, file->arg);
+				pthread_mutex_unlock(lock);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+int procstat_create_histogram_u64_series(struct procstat_context *context, struct procstat_item *parent,
+					 const char *name, struct procstat_histogram_u64 *series)
 {
-	int i;
 	struct procstat_series *series_stat;
-	struct procstat_simple_handle control[] = {
-		{.name = "reset", .writer = reset_histogram_u32_series},
-		{.name = "reset_interval_sec", .writer = reset_interval_histogram_u32_series},
-	};
 	int error;
-	struct procstat_simple_handle descriptors[] = {
-		{"sum",    			series, HISTOGRAM_SUM, histogram_u32_series_read},
-		{"count",  			series, HISTOGRAM_COUNT, histogram_u32_series_read},
-		{"last",   			series, HISTOGRAM_LAST, histogram_u32_series_read},
-		{"avg",    			series, HISTOGRAM_AVG, histogram_u32_series_read},
-		{"get_reset_interval_sec",  	series, HISTOGRAM_RESET_INTERVAL, histogram_u32_series_read},
-	};
 
 	parent = parent_or_root(context, parent);
 	if (!parent) {
@@ -1678,73 +5796,389 @@ int procstat_create_histogram_u32_series(struct procstat_context *context, struc
 		return -1;
 	}
 
-	series_stat = calloc(1, sizeof(*series_stat));
+	if (!series->bucket_bits)
+		series->bucket_bits = PROCSTAT_BUCKET_BITS;
+	if (!series->max_value)
+		series->max_value = UINT64_MAX;
+	error = procstat_hist_geometry_init(&series->geometry, series->bucket_bits, series->max_value);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	series_stat = arena_alloc(&context->arena, sizeof(*series_stat));
 	if (!series_stat) {
 		errno = ENOMEM;
 		return -1;
 	}
-
-	error = init_directory(context, &series_stat->root, name, (struct procstat_directory *)parent);
-	if (error) {
-		free_item(&series_stat->root.base);
-		errno = error;
+	series_stat->private = series;
+	series_stat->template = &histogram_u64_series_template;
+	if (!template_names_unique(series_stat)) {
+		arena_free(series_stat);
+		errno = EEXIST;
 		return -1;
 	}
 
-	series_stat->root.base.flags |= STATS_ENTRY_FLAG_HISTOGRAM;
-	series_stat->private = series;
-	series->histogram = calloc(PROCSTAT_PERCENTILE_ARR_NR, sizeof(uint32_t));
+	/* the series is readable as soon as it is registered, so it is fully set up before */
+	series->histogram = calloc(series->geometry.nbuckets, sizeof(*series->histogram));
 	if (!series->histogram) {
+		arena_free(series_stat);
 		errno = ENOMEM;
-		goto fail_remove_stat;
+		return -1;
 	}
 
-	error = procstat_create_simple(context, &series_stat->root.base, descriptors, ARRAY_SIZE(descriptors));
+	series->cache.valid = 0;
+	series->reset.last_reset_time = procstat_clock();
+	series->reset.reset_flag = 0;
+	series->reset.reset_interval = 0;
+
+	error = init_directory_ext(context, &series_stat->root, name, (struct procstat_directory *)parent,
+				   STATS_ENTRY_FLAG_HISTOGRAM_U64 | STATS_ENTRY_FLAG_SERIES | STATS_ENTRY_FLAG_TEMPLATE);
 	if (error) {
+		free_item(&series_stat->root.base);
 		errno = error;
-		goto fail_remove_stat;
+		return -1;
 	}
+	return 0;
+}
 
-	if (!series->compute_cb)
-		series->compute_cb = procstat_percentile_calculate;
+void procstat_histogram_u64_series_set_reset_interval(struct procstat_histogram_u64 *series, int reset_interval)
+{
+	series->reset.reset_interval = reset_interval;
+}
+
+static void window_rotate(struct procstat_histogram_u32_window *window)
+{
+	unsigned next = (window->current + 1) % window->nslices;
+	struct procstat_window_slice *slice = &window->slices[next];
+
+	slice->count = 0;
+	slice->sum = 0;
+	memset(slice->histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*slice->histogram));
+	__atomic_store_n(&window->current, next, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&window->rotations, 1, __ATOMIC_RELEASE);
+}
+
+static void window_tick(struct procstat_tick_handler *handler, uint64_t now)
+{
+	struct procstat_window_series *window_stat = container_of(handler, struct procstat_window_series, tick);
+	struct procstat_histogram_u32_window *window = window_stat->series.private;
+	uint64_t elapsed = now - window_stat->last_rotation_time;
+
+	/* in case the ticker was late, skip the missed slices, but never rotate more than whole ring */
+	if (elapsed > window->nslices)
+		elapsed = window->nslices;
+	while (elapsed--)
+		window_rotate(window);
+	window_stat->last_rotation_time = now;
+}
+
+void procstat_histogram_u32_window_add_point(struct procstat_histogram_u32_window *window, uint32_t value)
+{
+	struct procstat_window_slice *slice;
+
+	/* pairs with the release in window_rotate(), so the slice is seen cleared before it is recorded into */
+	slice = &window->slices[__atomic_load_n(&window->current, __ATOMIC_ACQUIRE)];
+	++slice->count;
+	slice->sum += value;
+	procstat_hist_add_point(slice->histogram, value);
+}
+
+/*
+ * Merge the last window_sec complete slices. Complete slices are not written any more,
+ * so the merged view stays valid until the next rotation.
+ */
+static void window_view_update(struct procstat_window_view *view)
+{
+	struct procstat_histogram_u32_window *window = view->window;
+	uint64_t rotation = __atomic_load_n(&window->rotations, __ATOMIC_ACQUIRE);
+	unsigned current, slice_index;
+	unsigned i, j;
+
+	if (view->valid && view->rotation == rotation)
+		return;
+
+	current = __atomic_load_n(&window->current, __ATOMIC_ACQUIRE);
+	view->count = 0;
+	view->sum = 0;
+	memset(view->histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*view->histogram));
+	for (i = 1; i <= view->window_sec; ++i) {
+		struct procstat_window_slice *slice;
+
+		slice_index = (current + window->nslices - i) % window->nslices;
+		slice = &window->slices[slice_index];
+		if (!slice->count)
+			continue;
+		view->count += slice->count;
+		view->sum += slice->sum;
+		for (j = 0; j < PROCSTAT_PERCENTILE_ARR_NR; ++j)
+			view->histogram[j] += slice->histogram[j];
+	}
+
+	procstat_percentile_calculate(view->histogram, view->count, view->percentile, window->npercentile);
+	view->rotation = rotation;
+	view->valid = true;
+}
+
+static ssize_t window_percentile_read(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_window_view *view = object;
+
+	window_view_update(view);
+	return procstat_format_u32_decimal(&view->percentile[arg].value, 0, buffer, length);
+}
+
+static ssize_t window_series_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_window_view *view = object;
+	enum histogram_u32_series_type type = arg;
+	uint64_t data;
+
+	window_view_update(view);
+	switch (type) {
+	case HISTOGRAM_SUM:
+		data = view->sum;
+		break;
+	case HISTOGRAM_COUNT:
+		data = view->count;
+		break;
+	case HISTOGRAM_AVG:
+		data = view->count ? view->sum / view->count : 0;
+		break;
+	default:
+		return -1;
+	}
+	return procstat_format_u64_decimal(&data, 0, buffer, len);
+}
+
+static int register_window_view(struct procstat_context *context,
+				struct procstat_window_series *window_stat,
+				struct procstat_window_view *view)
+{
+	struct procstat_histogram_u32_window *window = view->window;
+	struct procstat_item *directory;
+	char name[32];
+	int error;
+	int i;
+	struct procstat_simple_handle descriptors[] = {
+		{"sum",   view, HISTOGRAM_SUM, window_series_read},
+		{"count", view, HISTOGRAM_COUNT, window_series_read},
+		{"avg",   view, HISTOGRAM_AVG, window_series_read},
+	};
+
+	view->histogram = calloc(PROCSTAT_PERCENTILE_ARR_NR, sizeof(*view->histogram));
+	if (!view->histogram)
+		return ENOMEM;
+	for (i = 0; i < window->npercentile; ++i)
+		view->percentile[i].fraction = window->percentile[i].fraction;
+
+	snprintf(name, sizeof(name), "%us", view->window_sec);
+	directory = procstat_create_directory(context, &window_stat->series.root.base, name);
+	if (!directory)
+		return errno;
+	directory->flags |= STATS_ENTRY_FLAG_SERIES;
 
-	for (i = 0; i < series->npercentile; ++i) {
+	error = procstat_create_simple(context, directory, descriptors, ARRAY_SIZE(descriptors));
+	if (error)
+		return errno;
+
+	for (i = 0; i < window->npercentile; ++i) {
 		char stat_name[100];
 		struct procstat_file *file;
 
-		sprintf(stat_name, "%.4g", series->percentile[i].fraction * 100);
-		file = create_file(context, (struct procstat_directory *)&series_stat->root.base,
-				   stat_name, series, procstat_fmt_u32_percentile, NULL);
+		sprintf(stat_name, "%.4g", window->percentile[i].fraction * 100);
+		file = create_file_ext(context, (struct procstat_directory *)directory,
+				       stat_name, view, window_percentile_read, NULL, 0, i);
 		if (!file)
-			goto fail_remove_stat;
-		file->arg = i;
+			return errno;
 	}
+	return 0;
+}
 
-	struct timespec cur_time;
-	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time) == 0) {
-		series->reset.last_reset_time = cur_time.tv_sec;
-	} else {
-		series->reset.last_reset_time = 0;
+int procstat_create_histogram_u32_window(struct procstat_context *context, struct procstat_item *parent,
+					 const char *name, struct procstat_histogram_u32_window *window)
+{
+	static const unsigned default_windows[] = {1, 10, 60};
+	struct procstat_window_series *window_stat;
+	unsigned max_window = 0;
+	unsigned i;
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
 	}
-	series->reset.reset_flag = 0;
-	series->reset.reset_interval = 0;
 
-	control[0].object = series_stat;
-	control[1].object = series_stat;
-	error = procstat_create_simple(context, &series_stat->root.base, control, 2);
-	if (error)
-		goto fail_remove_stat;
+	if (!window->nwindows) {
+		window->nwindows = ARRAY_SIZE(default_windows);
+		memcpy(window->window_sec, default_windows, sizeof(default_windows));
+	}
+	if (window->nwindows > PROCSTAT_MAX_WINDOWS) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < window->nwindows; ++i) {
+		if (!window->window_sec[i]) {
+			errno = EINVAL;
+			return -1;
+		}
+		max_window = MAX(max_window, window->window_sec[i]);
+	}
+
+	window_stat = arena_alloc(&context->arena, sizeof(*window_stat));
+	if (!window_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
 
+	/* current slice, complete slices of the largest window, and a spare slice cleared on rotation */
+	window->nslices = max_window + 2;
+	window->current = 0;
+	window->rotations = 0;
+	window_stat->slices = calloc(window->nslices, sizeof(*window_stat->slices));
+	window_stat->buckets = calloc(window->nslices * PROCSTAT_PERCENTILE_ARR_NR, sizeof(uint32_t));
+	if (!window_stat->slices || !window_stat->buckets) {
+		free(window_stat->slices);
+		free(window_stat->buckets);
+		arena_free(window_stat);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < window->nslices; ++i)
+		window_stat->slices[i].histogram = window_stat->buckets + i * PROCSTAT_PERCENTILE_ARR_NR;
+	window->slices = window_stat->slices;
+
+	window_stat->series.private = window;
+	window_stat->tick.context = context;
+	window_stat->tick.item = &window_stat->series.root.base;
+	window_stat->tick.tick = window_tick;
+	window_stat->last_rotation_time = procstat_clock();
+	INIT_LIST_HEAD(&window_stat->tick.entry);
+
+	error = init_directory(context, &window_stat->series.root, name, (struct procstat_directory *)parent);
+	if (error) {
+		free_window(&window_stat->series.root.base);
+		free_item(&window_stat->series.root.base);
+		errno = error;
+		return -1;
+	}
+	item_set_flags(&window_stat->series.root.base, STATS_ENTRY_FLAG_WINDOW);
+
+	for (i = 0; i < window->nwindows; ++i) {
+		struct procstat_window_view *view = &window_stat->views[i];
+
+		view->window = window;
+		view->window_sec = window->window_sec[i];
+		error = register_window_view(context, window_stat, view);
+		if (error) {
+			errno = error;
+			goto fail_remove_stat;
+		}
+	}
+
+	add_tick_handler(context, &window_stat->tick);
 	return 0;
 
 fail_remove_stat:
-	procstat_remove(context, &series_stat->root.base);
+	procstat_remove(context, &window_stat->series.root.base);
 	return -1;
 }
 
-void procstat_histogram_u32_series_set_reset_interval(struct procstat_histogram_u32 *series, int reset_interval)
+static const unsigned rate_period_sec[PROCSTAT_RATE_NR] = {1, 10, 60};
+
+/*
+ * Exponentially decayed rates, the same way loadavg is calculated:
+ * rate = rate * e^(-dt/period) + current_rate * (1 - e^(-dt/period))
+ */
+static void rate_tick(struct procstat_tick_handler *handler, uint64_t now)
 {
-	series->reset.reset_interval = reset_interval;
+	struct procstat_rate_series *rate_stat = container_of(handler, struct procstat_rate_series, tick);
+	struct procstat_rate *rate = rate_stat->series.private;
+	uint64_t elapsed = now - rate_stat->last_tick_time;
+	uint64_t events;
+	double current;
+	int i;
+
+	if (!elapsed)
+		return;
+
+	events = __atomic_load_n(&rate->events, __ATOMIC_RELAXED);
+	current = (double)(events - rate->last_events) / elapsed;
+	for (i = 0; i < PROCSTAT_RATE_NR; ++i) {
+		double decay = exp(-(double)elapsed / rate_period_sec[i]);
+
+		rate->rate[i] = rate->rate[i] * decay + current * (1 - decay);
+	}
+	rate->last_events = events;
+	rate_stat->last_tick_time = now;
+}
+
+enum rate_type {
+	RATE_COUNT = PROCSTAT_RATE_NR,
+};
+
+static ssize_t rate_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_rate *rate = object;
+	uint64_t data;
+
+	if (arg == RATE_COUNT)
+		data = __atomic_load_n(&rate->events, __ATOMIC_RELAXED);
+	else if (arg < PROCSTAT_RATE_NR)
+		data = (uint64_t)(rate->rate[arg] + 0.5);
+	else
+		return -1;
+	return procstat_format_u64_decimal(&data, 0, buffer, len);
+}
+
+int procstat_create_rate(struct procstat_context *context, struct procstat_item *parent,
+			 const char *name, struct procstat_rate *rate)
+{
+	struct procstat_rate_series *rate_stat;
+	int error;
+	struct procstat_simple_handle descriptors[] = {
+		{"count",    rate, RATE_COUNT, rate_read},
+		{"rate_1s",  rate, PROCSTAT_RATE_1S, rate_read},
+		{"rate_10s", rate, PROCSTAT_RATE_10S, rate_read},
+		{"rate_60s", rate, PROCSTAT_RATE_60S, rate_read},
+	};
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rate_stat = arena_alloc(&context->arena, sizeof(*rate_stat));
+	if (!rate_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
+	rate_stat->series.private = rate;
+	rate_stat->tick.context = context;
+	rate_stat->tick.item = &rate_stat->series.root.base;
+	rate_stat->tick.tick = rate_tick;
+	rate_stat->last_tick_time = procstat_clock();
+	INIT_LIST_HEAD(&rate_stat->tick.entry);
+	rate->last_events = rate->events;
+
+	error = init_directory(context, &rate_stat->series.root, name, (struct procstat_directory *)parent);
+	if (error) {
+		free_item(&rate_stat->series.root.base);
+		errno = error;
+		return -1;
+	}
+	item_set_flags(&rate_stat->series.root.base, STATS_ENTRY_FLAG_RATE);
+
+	error = procstat_create_simple(context, &rate_stat->series.root.base, descriptors, ARRAY_SIZE(descriptors));
+	if (error) {
+		procstat_remove(context, &rate_stat->series.root.base);
+		return -1;
+	}
+
+	add_tick_handler(context, &rate_stat->tick);
+	return 0;
 }
 
 struct procstat_item *procstat_lookup_item(struct procstat_context *context,
@@ -1753,12 +6187,15 @@ struct procstat_item *procstat_lookup_item(struct procstat_context *context,
 	struct procstat_item *item;
 
 	parent = parent_or_root(context, parent);
-	pthread_mutex_lock(&context->global_lock);
+	/* the caller keeps the item, so the files of a template series are made real */
+	if (template_materialize(context, (struct procstat_directory *)parent))
+		return NULL;
+	pthread_rwlock_rdlock(&((struct procstat_directory *)parent)->lock);
 
 	item = lookup_item_locked((struct procstat_directory *)parent,
 				  name, string_hash(name));
 
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&((struct procstat_directory *)parent)->lock);
 
 	return item;
 }
@@ -60,6 +60,17 @@ struct procstat_item;
  */
 typedef ssize_t (*procstats_formatter)(void *object, uint64_t arg, char *buffer, size_t length);
 
+/*
+ * Type of the object of a simple stat, lets binary consumers read the raw value instead of
+ * the formatter output.
+ */
+enum procstat_value_type {
+	PROCSTAT_VALUE_FORMATTED,
+	PROCSTAT_VALUE_U32,
+	PROCSTAT_VALUE_U64,
+	PROCSTAT_VALUE_INT,
+};
+
 /**
  * @brief registration parameter for simple value statistics
  * @name of statistics
@@ -73,6 +84,7 @@ struct procstat_simple_handle {
 	uint64_t 	    arg;
 	procstats_formatter fmt;
 	procstats_formatter writer;
+	enum procstat_value_type type;
 };
 
 
@@ -111,6 +123,13 @@ struct procstat_context *procstat_context(struct procstat_item *item);
  */
 void procstat_loop(struct procstat_context *context);
 
+/**
+ * @brief same as procstat_loop(), but requests are handled by a pool of @nthreads workers, so
+ * a slow formatter or a large aggregator read does not stall the other readers of the mount.
+ * @return 0 once the loop exits, -1 with errno set if the workers could not be started
+ */
+int procstat_loop_mt(struct procstat_context *context, unsigned nthreads);
+
 /**
  * @brief create directory @name under @parent directory
  * @context statistics context
@@ -123,6 +142,28 @@ struct procstat_item *procstat_create_directory(struct procstat_context *context
 					  	struct procstat_item *parent,
 						const char *name);
 
+/**
+ * @brief begin a batch: create directory @name which is not attached to the hierarchy yet.
+ * Statistics are created under it with the usual methods, privately and without contention,
+ * and become visible together once the batch is committed. procstat_context() cannot be used
+ * on the batch items before commit.
+ * @return the batch directory or NULL in case of failure and errno will be set accordingly
+ */
+struct procstat_item *procstat_batch_begin(struct procstat_context *context, const char *name);
+
+/**
+ * @brief attach the @batch directory with all its content under @parent (root in case of NULL)
+ * with a single lock acquisition. All or nothing: in case of failure the batch is discarded.
+ * @return 0 on success, -1 in case of failure and errno will be set accordingly
+ */
+int procstat_batch_commit(struct procstat_context *context, struct procstat_item *parent,
+			  struct procstat_item *batch);
+
+/**
+ * @brief discard an uncommitted @batch with all its content
+ */
+void procstat_batch_abort(struct procstat_context *context, struct procstat_item *batch);
+
 /**
  * @brief removes statistics item previosly created with any of creation methods
  */
@@ -141,6 +182,7 @@ int procstat_remove_by_name(struct procstat_context *context, struct procstat_it
  * 	    @name will be lookup under root directory
  * @name of the item to lookup
  * @return the found item NULL, in case of failure and errno will be set accordingly
+ * Looking up a file of a series allocates the files of that series.
  */
 struct procstat_item *procstat_lookup_item(struct procstat_context *context,
 		struct procstat_item *parent, const char *name);
@@ -162,6 +204,106 @@ int procstat_create_aggregator(struct procstat_context *context,
 			   struct procstat_item *parent,
 			   const char *name);
 
+/**
+ * @brief creates a file that outputs the contents of the entire directory tree like procstat_create_aggregator.
+ * The tree is serialized once, on the first read after open, and reads at any offset and of any
+ * size are served from that snapshot.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_snapshot_aggregator(struct procstat_context *context,
+					struct procstat_item *parent,
+					const char *name);
+
+enum procstat_aggregator_format {
+	PROCSTAT_AGGREGATOR_TEXT,	 /* path/name:value lines */
+	PROCSTAT_AGGREGATOR_OPENMETRICS, /* OpenMetrics text exposition, histograms as histograms, series as summaries */
+	PROCSTAT_AGGREGATOR_JSON,	 /* nested objects per directory */
+	PROCSTAT_AGGREGATOR_BINARY,	 /* dictionary and raw value records, see procstat_binary.h */
+};
+
+/**
+ * @brief creates a snapshot aggregator (see procstat_create_snapshot_aggregator) serializing
+ * the directory tree in @format.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_formatted_aggregator(struct procstat_context *context,
+					 struct procstat_item *parent,
+					 const char *name,
+					 enum procstat_aggregator_format format);
+
+struct procstat_stream;
+
+/**
+ * @brief stream formatter method, writes the whole content of the file with procstat_stream_write()
+ * and procstat_stream_printf(). Output is not limited in size, it is kept in chained buffers and served
+ * to reads at any offset.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+typedef int (*procstat_stream_formatter)(void *object, uint64_t arg, struct procstat_stream *stream);
+
+/**
+ * @brief creates a file that on read outputs whatever @formatter writes to its stream, e.g. a table
+ * or a report of a whole subsystem. The formatter is called on a read at offset 0, later reads are
+ * served from its output. Stream files are not part of aggregators, shared memory and history.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_stream(struct procstat_context *context,
+			   struct procstat_item *parent,
+			   const char *name,
+			   void *object,
+			   uint64_t arg,
+			   procstat_stream_formatter formatter);
+
+/**
+ * @brief appends @len bytes of @data, or the printf() formatted string, to @stream
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_stream_write(struct procstat_stream *stream, const void *data, size_t len);
+int procstat_stream_printf(struct procstat_stream *stream, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief exports all the stats of @context to a POSIX shared memory segment @name (see shm_open)
+ * with room for @capacity stats, using the layout described in procstat_shm.h. Stats registered
+ * later are added to the segment, values are refreshed every 100 msec by a thread of the export.
+ * The segment is unlinked by procstat_destroy.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_shm_export(struct procstat_context *context, const char *name, unsigned capacity);
+
+/**
+ * @brief starts a sampler thread that every @interval_msec snapshots the values of all stats
+ * with history enabled by procstat_create_history.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_sampler_start(struct procstat_context *context, unsigned interval_msec);
+
+/**
+ * @brief stops the sampler thread, collected histories remain readable
+ */
+void procstat_sampler_stop(struct procstat_context *context);
+
+/**
+ * @brief enables history for @item, in case @item is a directory history is enabled for every
+ * readable file in the subtree. Each stat gets a sibling "<name>.history" file, showing the last
+ * @nsamples sampled values with timestamps. The memory of the history is allocated here.
+ * Must not race with registration of new items under the same subtree.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_history(struct procstat_context *context,
+			    struct procstat_item *item,
+			    unsigned nsamples);
+
+
+/**
+ * @brief table driven conversion of @value followed by a new line, with the same result and truncation
+ * as snprintf() with "%lu\n", "%ld\n", "%lx\n" and "0x%lx\n" respectively.
+ * @return the length of the whole output, excluding the terminating null byte
+ */
+ssize_t procstat_print_u64(char *buffer, size_t len, uint64_t value);
+ssize_t procstat_print_s64(char *buffer, size_t len, int64_t value);
+ssize_t procstat_print_hex(char *buffer, size_t len, uint64_t value);
+ssize_t procstat_print_address(char *buffer, size_t len, uint64_t value);
 
 #define DEFINE_PROCSTAT_FORMATTER(__type, __fmt, __fmt_name)\
 static inline ssize_t procstat_format_ ## __type ##_## __fmt_name(void *object, uint64_t arg, char *buffer, size_t len)\
@@ -169,6 +311,12 @@ static inline ssize_t procstat_format_ ## __type ##_## __fmt_name(void *object,
 	return snprintf(buffer, len, __fmt, *((__type *)object));\
 }\
 
+#define DEFINE_PROCSTAT_INTEGER_FORMATTER(__type, __print, __fmt_name)\
+static inline ssize_t procstat_format_ ## __type ##_## __fmt_name(void *object, uint64_t arg, char *buffer, size_t len)\
+{\
+	return __print(buffer, len, *((__type *)object));\
+}\
+
 #define DEFINE_PROCSTAT_WRITER(__type, __fmt, __fmt_name)\
 static inline ssize_t procstat_write_ ## __type ##_## __fmt_name(void *object, uint64_t arg, char *buffer, size_t size)\
 {\
@@ -185,28 +333,30 @@ static inline ssize_t procstat_write_ ## __type ##_## __fmt_name(void *object, u
 #endif
 
 
-DEFINE_PROCSTAT_FORMATTER(u64, "%lu\n", decimal);
-DEFINE_PROCSTAT_FORMATTER(u64, "%lx\n", hex);
-DEFINE_PROCSTAT_FORMATTER(u64, "0x%lx\n", address);
-DEFINE_PROCSTAT_FORMATTER(u32, "%u\n", decimal);
-DEFINE_PROCSTAT_FORMATTER(u32, "%x\n", hex);
-DEFINE_PROCSTAT_FORMATTER(int, "%d\n", decimal);
+DEFINE_PROCSTAT_INTEGER_FORMATTER(u64, procstat_print_u64, decimal);
+DEFINE_PROCSTAT_INTEGER_FORMATTER(u64, procstat_print_hex, hex);
+DEFINE_PROCSTAT_INTEGER_FORMATTER(u64, procstat_print_address, address);
+DEFINE_PROCSTAT_INTEGER_FORMATTER(u32, procstat_print_u64, decimal);
+DEFINE_PROCSTAT_INTEGER_FORMATTER(u32, procstat_print_hex, hex);
+DEFINE_PROCSTAT_INTEGER_FORMATTER(int, procstat_print_s64, decimal);
 
 DEFINE_PROCSTAT_WRITER(u64, "%lu\n", decimal);
 DEFINE_PROCSTAT_WRITER(u32, "%u\n", decimal);
 DEFINE_PROCSTAT_WRITER(int, "%d\n", decimal);
 
-#define DEFINE_PROCSTAT_SIMPLE_ATTRIBUTE(__type)\
+#define DEFINE_PROCSTAT_TYPED_ATTRIBUTE(__type, __value_type)\
 static inline int procstat_create_ ## __type(struct procstat_context *context, struct procstat_item *parent, const char *name, __type *object)\
 {\
-	struct procstat_simple_handle descriptor = {name, object, 0UL, procstat_format_ ## __type ## _decimal, NULL};\
+	struct procstat_simple_handle descriptor = {name, object, 0UL, procstat_format_ ## __type ## _decimal, NULL, __value_type};\
 	\
 	return procstat_create_simple(context, parent, &descriptor, 1);\
 }\
 
-DEFINE_PROCSTAT_SIMPLE_ATTRIBUTE(u32);
-DEFINE_PROCSTAT_SIMPLE_ATTRIBUTE(u64);
-DEFINE_PROCSTAT_SIMPLE_ATTRIBUTE(int);
+#define DEFINE_PROCSTAT_SIMPLE_ATTRIBUTE(__type) DEFINE_PROCSTAT_TYPED_ATTRIBUTE(__type, PROCSTAT_VALUE_FORMATTED)
+
+DEFINE_PROCSTAT_TYPED_ATTRIBUTE(u32, PROCSTAT_VALUE_U32);
+DEFINE_PROCSTAT_TYPED_ATTRIBUTE(u64, PROCSTAT_VALUE_U64);
+DEFINE_PROCSTAT_TYPED_ATTRIBUTE(int, PROCSTAT_VALUE_INT);
 
 
 #define DEFINE_PROCSTAT_SIMPLE_PARAMETER(__type)\
@@ -233,6 +383,66 @@ static inline ssize_t procstat_format_ ## __type ##_## name(void *object, uint64
 	return snprintf(buffer, length, __fmt, out);\
 }\
 
+#define PROCSTAT_CACHELINE_SIZE 64
+
+struct procstat_percpu_slot {
+	uint64_t value;
+} __attribute__((aligned(PROCSTAT_CACHELINE_SIZE)));
+
+/**
+ * @brief sharded u64 counter. Every thread adds to its own cache line padded slot,
+ * slots are summed only when the counter is read.
+ * @slots allocated on registration, one slot per cpu (rounded up to power of 2)
+ * @mask number of slots - 1
+ */
+struct procstat_percpu_u64 {
+	struct procstat_percpu_slot *slots;
+	unsigned 		    mask;
+};
+
+/* slot number + 1 of the calling thread, 0 means not assigned yet */
+extern __thread unsigned procstat_thread_slot;
+
+/**
+ * @brief assigns slot number to the calling thread
+ * @return slot number + 1
+ */
+unsigned procstat_thread_slot_assign(void);
+
+static inline unsigned procstat_thread_slot_get(void)
+{
+	unsigned slot = procstat_thread_slot;
+
+	if (__builtin_expect(!slot, 0))
+		slot = procstat_thread_slot_assign();
+	return slot - 1;
+}
+
+/**
+ * @brief creates sharded counter, which will be exposed as @name under @parent directory.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_percpu_u64(struct procstat_context *context, struct procstat_item *parent,
+			       const char *name, struct procstat_percpu_u64 *counter);
+
+static inline void procstat_percpu_add(struct procstat_percpu_u64 *counter, uint64_t value)
+{
+	struct procstat_percpu_slot *slot = &counter->slots[procstat_thread_slot_get() & counter->mask];
+
+	/* slot is shared only in case there are more threads than cpus, so this is uncontended */
+	__atomic_fetch_add(&slot->value, value, __ATOMIC_RELAXED);
+}
+
+static inline void procstat_percpu_inc(struct procstat_percpu_u64 *counter)
+{
+	procstat_percpu_add(counter, 1);
+}
+
+/**
+ * @return sum of all slots of @counter
+ */
+uint64_t procstat_percpu_u64_sum(struct procstat_percpu_u64 *counter);
+
 /**
  * @brief registration parameter for start end statistics. This is equivalent to creating a directory
  * with @name and registering start and end files bounded to @start and @end
@@ -287,6 +497,7 @@ struct reset_info {
 	uint64_t reset_interval;
 	uint64_t last_reset_time;
 	unsigned reset_flag;
+	unsigned epoch; /* incremented on every reset */
 };
 
 /**
@@ -323,7 +534,34 @@ typedef void (*percentiles_calculator)(uint32_t *histogram,
 					struct procstat_percentile_result *result,
 					unsigned result_len);
 
+/**
+ * @brief per thread part of sharded histogram. Shard is valid only when its @epoch
+ * matches the histogram reset epoch, otherwise it is treated as empty.
+ */
+struct procstat_histogram_shard {
+	uint64_t sum;
+	uint64_t count;
+	uint64_t last;
+	unsigned epoch; /* odd while a writer clears the shard after a reset */
+	uint32_t *histogram;
+} __attribute__((aligned(PROCSTAT_CACHELINE_SIZE)));
+
+/**
+ * @brief identifies histogram state percentiles were last calculated at, so reading several
+ * percentile files of unchanged histogram calculates them only once
+ */
+struct procstat_percentile_cache {
+	uint64_t count;
+	unsigned epoch;
+	unsigned valid;
+};
+
 #define MAX_SUPPORTED_PERCENTILE 20
+/**
+ * @brief histogram statistics. In case @nshards is set before registration, every thread
+ * records into its own shard and shards are merged upon read. @nshards is rounded up to power of 2.
+ * Recording into a sharded histogram is wait-free, its resets take effect upon read.
+ */
 struct procstat_histogram_u32 {
 	uint64_t 				sum;
 	uint64_t 				count;
@@ -333,10 +571,16 @@ struct procstat_histogram_u32 {
 	uint32_t 				*histogram;
 	percentiles_calculator 			compute_cb;
 	struct reset_info 			reset;
+	unsigned 				nshards;
+	struct procstat_histogram_shard 	*shards;
+	struct procstat_percentile_cache 	cache;
 };
 
 /**
  * @brief create series statistics.
+ * The files of a series (sum, count, ... reset) are not allocated per series, they are synthesized
+ * from a schema shared by all series until something needs them as items (procstat_lookup_item(),
+ * history, shared memory export). Histogram series behave the same.
  */
 int procstat_create_u64_series(struct procstat_context *context, struct procstat_item *parent,
 			       const char *name, struct procstat_series_u64 *series);
@@ -355,6 +599,14 @@ int procstat_create_multiple_u64_series(struct procstat_context *context,
  */
 void procstat_u64_series_add_point(struct procstat_series_u64 *series, uint64_t value);
 
+/**
+ * @brief add @n points from @values to series statistics at once. count, sum, min, max and last are
+ * the same as when adding the points one by one. Mean and variance of the batch are calculated in
+ * floating point and merged into the series, so they differ slightly from those of per-point adds,
+ * which round down on every point (by well under 0.1% for batches of tens of points or more).
+ */
+void procstat_u64_series_add_points(struct procstat_series_u64 *series, const uint64_t *values, size_t n);
+
 void procstat_u64_series_set_reset_interval(struct procstat_series_u64 *series, int reset_interval);
 
 int procstat_create_histogram_u32_series(struct procstat_context *context, struct procstat_item *parent,
@@ -362,8 +614,100 @@ int procstat_create_histogram_u32_series(struct procstat_context *context, struc
 
 void procstat_histogram_u32_add_point(struct procstat_histogram_u32 *series, uint32_t value);
 
+/**
+ * @brief add @n points from @values to histogram statistics at once
+ */
+void procstat_histogram_u32_add_points(struct procstat_histogram_u32 *series, const uint32_t *values, size_t n);
+
 void procstat_histogram_u32_series_set_reset_interval(struct procstat_histogram_u32 *series, int reset_interval);
 
+/**
+ * @brief 64 bit histogram statistics with 64 bit bucket counters.
+ * @bucket_bits precision of the histogram, error is bounded by 1/2^(bucket_bits+1).
+ * 	        PROCSTAT_BUCKET_BITS is used in case it is 0
+ * @max_value largest value tracked accurately, larger values are counted in the last bucket.
+ * 	      UINT64_MAX is used in case it is 0
+ * Both are set before registration and determine the size of the histogram.
+ */
+struct procstat_histogram_u64 {
+	uint64_t 				sum;
+	uint64_t 				count;
+	uint64_t 				last;
+	unsigned 				bucket_bits;
+	uint64_t 				max_value;
+	int 					npercentile;
+	struct procstat_percentile_result_u64	percentile[MAX_SUPPORTED_PERCENTILE];
+	struct procstat_hist_geometry 		geometry;
+	uint64_t 				*histogram;
+	struct reset_info 			reset;
+	struct procstat_percentile_cache 	cache;
+};
+
+struct procstat_window_slice {
+	uint64_t count;
+	uint64_t sum;
+	uint32_t *histogram;
+};
+
+#define PROCSTAT_MAX_WINDOWS 4
+/**
+ * @brief histogram over sliding time windows. Points are recorded into one second slices,
+ * and slices are rotated by the context ticker. For every window a directory named "<window>s"
+ * exposes sum, count, avg and percentiles of the last <window> complete seconds.
+ * @nwindows number of windows, default windows of 1, 10 and 60 seconds are used in case it is 0
+ * @window_sec length of each window in seconds
+ * @npercentile @percentile fractions to be exposed, as in procstat_histogram_u32
+ * Remaining fields are set on registration.
+ */
+struct procstat_histogram_u32_window {
+	unsigned 				nwindows;
+	unsigned 				window_sec[PROCSTAT_MAX_WINDOWS];
+	int 					npercentile;
+	struct procstat_percentile_result	percentile[MAX_SUPPORTED_PERCENTILE];
+	unsigned 				nslices;
+	unsigned 				current;
+	uint64_t 				rotations;
+	struct procstat_window_slice 		*slices;
+};
+
+int procstat_create_histogram_u32_window(struct procstat_context *context, struct procstat_item *parent,
+					 const char *name, struct procstat_histogram_u32_window *window);
+
+void procstat_histogram_u32_window_add_point(struct procstat_histogram_u32_window *window, uint32_t value);
+
+enum {
+	PROCSTAT_RATE_1S,
+	PROCSTAT_RATE_10S,
+	PROCSTAT_RATE_60S,
+	PROCSTAT_RATE_NR,
+};
+
+/**
+ * @brief events rate statistics, exposes count of events and exponentially decayed rates
+ * (events per second) over 1, 10 and 60 seconds as rate_1s, rate_10s and rate_60s.
+ * Events are recorded with procstat_rate_add, rates are updated by the context ticker once a second.
+ */
+struct procstat_rate {
+	uint64_t events;
+	uint64_t last_events;
+	double 	 rate[PROCSTAT_RATE_NR];
+};
+
+int procstat_create_rate(struct procstat_context *context, struct procstat_item *parent,
+			 const char *name, struct procstat_rate *rate);
+
+static inline void procstat_rate_add(struct procstat_rate *rate, uint64_t events)
+{
+	__atomic_fetch_add(&rate->events, events, __ATOMIC_RELAXED);
+}
+
+int procstat_create_histogram_u64_series(struct procstat_context *context, struct procstat_item *parent,
+					 const char *name, struct procstat_histogram_u64 *series);
+
+void procstat_histogram_u64_add_point(struct procstat_histogram_u64 *series, uint64_t value);
+
+void procstat_histogram_u64_series_set_reset_interval(struct procstat_histogram_u64 *series, int reset_interval);
+
 #ifdef __cplusplus
 }
 #endif
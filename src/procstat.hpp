@@ -0,0 +1,349 @@
+/*
+ *   BSD LICENSE
+ *
+ *   Copyright (C) 2016 LightBits Labs Ltd. - All Rights Reserved
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of LightBits Labs Ltd nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _PROCSTAT_HPP_
+#define _PROCSTAT_HPP_
+
+/*
+ * C++17 wrappers of the procstat statistics. Every object registers its statistic in the constructor,
+ * removes it in the destructor and can be moved but not copied. Recording is inlined: the value of a
+ * Counter or Gauge is updated in place, Series and Histogram call the C recording functions directly.
+ * Failures to register throw std::system_error with the errno of the C call.
+ *
+ * As with the C API, a statistic is updated by a single thread at a time, see procstat_create_percpu_u64()
+ * for counters updated by many threads.
+ */
+
+#include "procstat.h"
+#include <cerrno>
+#include <cstdio>
+#include <initializer_list>
+#include <memory>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace procstat {
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+/* formatter generated from the value type */
+template <typename T>
+ssize_t format(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	T value;
+
+	__atomic_load(static_cast<T *>(object), &value, __ATOMIC_RELAXED);
+	if constexpr (std::is_floating_point_v<T>)
+		return snprintf(buffer, length, "%g\n", static_cast<double>(value));
+	else if constexpr (std::is_signed_v<T>)
+		return procstat_print_s64(buffer, length, value);
+	else
+		return procstat_print_u64(buffer, length, value);
+}
+
+/* lets binary consumers read the raw value where the C API would */
+template <typename T>
+constexpr procstat_value_type value_type()
+{
+	if constexpr (std::is_same_v<T, uint32_t>)
+		return PROCSTAT_VALUE_U32;
+	else if constexpr (std::is_same_v<T, uint64_t>)
+		return PROCSTAT_VALUE_U64;
+	else if constexpr (std::is_same_v<T, int>)
+		return PROCSTAT_VALUE_INT;
+	else
+		return PROCSTAT_VALUE_FORMATTED;
+}
+
+/* owns a registered item, removes it on destruction */
+class Registration {
+public:
+	Registration() = default;
+	Registration(struct procstat_context *context, struct procstat_item *item) : context_(context), item_(item) {}
+	Registration(Registration &&other) noexcept
+		: context_(other.context_), item_(std::exchange(other.item_, nullptr)) {}
+	Registration &operator=(Registration &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			context_ = other.context_;
+			item_ = std::exchange(other.item_, nullptr);
+		}
+		return *this;
+	}
+	Registration(const Registration &) = delete;
+	Registration &operator=(const Registration &) = delete;
+	~Registration() { reset(); }
+
+	void reset() noexcept
+	{
+		if (item_)
+			procstat_remove(context_, item_);
+		item_ = nullptr;
+	}
+
+	struct procstat_item *item() const noexcept { return item_; }
+
+private:
+	struct procstat_context *context_ = nullptr;
+	struct procstat_item 	*item_ = nullptr;
+};
+
+/*
+ * File creation does not return the item, it is looked up right after. Should that fail, the statistic is
+ * removed before throwing, as its memory goes with the object that is never constructed.
+ */
+inline Registration lookup_created(struct procstat_context *context, struct procstat_item *parent, const char *name)
+{
+	struct procstat_item *item = procstat_lookup_item(context, parent, name);
+
+	if (!item) {
+		procstat_remove_by_name(context, parent, name);
+		errno = ENOENT;
+		throw_errno(name);
+	}
+	return Registration(context, item);
+}
+
+template <typename T>
+Registration create_value(struct procstat_context *context, struct procstat_item *parent, const char *name, T *value)
+{
+	struct procstat_simple_handle descriptor = {name, value, 0, format<T>, nullptr, value_type<T>()};
+
+	if (procstat_create_simple(context, parent, &descriptor, 1))
+		throw_errno(name);
+	return lookup_created(context, parent, name);
+}
+
+} /* namespace detail */
+
+/**
+ * @brief directory, statistics are created under its item()
+ * @parent directory to create under, root in case it is NULL
+ */
+class Directory {
+public:
+	Directory(struct procstat_context *context, struct procstat_item *parent, const char *name)
+	{
+		struct procstat_item *item = procstat_create_directory(context, parent, name);
+
+		if (!item)
+			detail::throw_errno(name);
+		registration_ = detail::Registration(context, item);
+	}
+
+	struct procstat_item *item() const noexcept { return registration_.item(); }
+
+private:
+	detail::Registration registration_;
+};
+
+/**
+ * @brief monotonic counter of integral type @T
+ */
+template <typename T>
+class Counter {
+	static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>, "Counter needs an integral type");
+public:
+	Counter(struct procstat_context *context, struct procstat_item *parent, const char *name)
+		: value_(std::make_unique<T>()),
+		  registration_(detail::create_value(context, parent, name, value_.get())) {}
+	Counter(Counter &&) noexcept = default;
+	/* the old statistic is removed before the value it reads is freed */
+	Counter &operator=(Counter &&other) noexcept
+	{
+		if (this != &other) {
+			registration_.reset();
+			value_ = std::move(other.value_);
+			registration_ = std::move(other.registration_);
+		}
+		return *this;
+	}
+
+	void add(T n) noexcept { __atomic_store_n(value_.get(), *value_ + n, __ATOMIC_RELAXED); }
+	void inc() noexcept { add(1); }
+	Counter &operator+=(T n) noexcept { add(n); return *this; }
+	Counter &operator++() noexcept { inc(); return *this; }
+	T value() const noexcept { return __atomic_load_n(value_.get(), __ATOMIC_RELAXED); }
+
+private:
+	/* the C library keeps a pointer to the value, it does not move with the object */
+	std::unique_ptr<T>   value_;
+	detail::Registration registration_; /* declared last, so removed before the value is freed */
+};
+
+/**
+ * @brief value of arithmetic type @T that can go up and down
+ */
+template <typename T>
+class Gauge {
+	static_assert(std::is_arithmetic_v<T>, "Gauge needs an arithmetic type");
+public:
+	Gauge(struct procstat_context *context, struct procstat_item *parent, const char *name, T initial = T())
+		: value_(std::make_unique<T>(initial)),
+		  registration_(detail::create_value(context, parent, name, value_.get())) {}
+	Gauge(Gauge &&) noexcept = default;
+	Gauge &operator=(Gauge &&other) noexcept
+	{
+		if (this != &other) {
+			registration_.reset();
+			value_ = std::move(other.value_);
+			registration_ = std::move(other.registration_);
+		}
+		return *this;
+	}
+
+	void set(T value) noexcept { __atomic_store(value_.get(), &value, __ATOMIC_RELAXED); }
+	void add(T n) noexcept { set(*value_ + n); }
+	void sub(T n) noexcept { set(*value_ - n); }
+	Gauge &operator=(T value) noexcept { set(value); return *this; }
+	T value() const noexcept
+	{
+		T value;
+
+		__atomic_load(value_.get(), &value, __ATOMIC_RELAXED);
+		return value;
+	}
+
+private:
+	std::unique_ptr<T>   value_;
+	detail::Registration registration_;
+};
+
+/**
+ * @brief series of u64 points, see procstat_create_u64_series()
+ */
+class Series {
+public:
+	Series(struct procstat_context *context, struct procstat_item *parent, const char *name)
+		: series_(std::make_unique<procstat_series_u64>())
+	{
+		if (procstat_create_u64_series(context, parent, name, series_.get()))
+			detail::throw_errno(name);
+		registration_ = detail::lookup_created(context, parent, name);
+	}
+	Series(Series &&) noexcept = default;
+	Series &operator=(Series &&other) noexcept
+	{
+		if (this != &other) {
+			registration_.reset();
+			series_ = std::move(other.series_);
+			registration_ = std::move(other.registration_);
+		}
+		return *this;
+	}
+
+	void add(uint64_t value) noexcept { procstat_u64_series_add_point(series_.get(), value); }
+	void add(const uint64_t *values, size_t n) noexcept { procstat_u64_series_add_points(series_.get(), values, n); }
+	void set_reset_interval(int seconds) noexcept { procstat_u64_series_set_reset_interval(series_.get(), seconds); }
+
+private:
+	std::unique_ptr<procstat_series_u64> series_;
+	detail::Registration 		     registration_;
+};
+
+/**
+ * @brief histogram of uint32_t or uint64_t points, see procstat_create_histogram_u32_series() and
+ * procstat_create_histogram_u64_series()
+ * @percentiles fractions to expose, at most MAX_SUPPORTED_PERCENTILE
+ */
+template <typename T = uint32_t>
+class Histogram {
+	static_assert(std::is_same_v<T, uint32_t> || std::is_same_v<T, uint64_t>,
+		      "Histogram needs uint32_t or uint64_t");
+	using histogram_type = std::conditional_t<std::is_same_v<T, uint32_t>,
+						  procstat_histogram_u32, procstat_histogram_u64>;
+public:
+	Histogram(struct procstat_context *context, struct procstat_item *parent, const char *name,
+		  std::initializer_list<float> percentiles)
+		: histogram_(std::make_unique<histogram_type>())
+	{
+		int error;
+
+		if (percentiles.size() > MAX_SUPPORTED_PERCENTILE) {
+			errno = EINVAL;
+			detail::throw_errno(name);
+		}
+		for (float fraction : percentiles)
+			histogram_->percentile[histogram_->npercentile++].fraction = fraction;
+
+		if constexpr (std::is_same_v<T, uint32_t>)
+			error = procstat_create_histogram_u32_series(context, parent, name, histogram_.get());
+		else
+			error = procstat_create_histogram_u64_series(context, parent, name, histogram_.get());
+		if (error)
+			detail::throw_errno(name);
+		registration_ = detail::lookup_created(context, parent, name);
+	}
+	Histogram(Histogram &&) noexcept = default;
+	Histogram &operator=(Histogram &&other) noexcept
+	{
+		if (this != &other) {
+			registration_.reset();
+			histogram_ = std::move(other.histogram_);
+			registration_ = std::move(other.registration_);
+		}
+		return *this;
+	}
+
+	void add(T value) noexcept
+	{
+		if constexpr (std::is_same_v<T, uint32_t>)
+			procstat_histogram_u32_add_point(histogram_.get(), value);
+		else
+			procstat_histogram_u64_add_point(histogram_.get(), value);
+	}
+
+	void set_reset_interval(int seconds) noexcept
+	{
+		if constexpr (std::is_same_v<T, uint32_t>)
+			procstat_histogram_u32_series_set_reset_interval(histogram_.get(), seconds);
+		else
+			procstat_histogram_u64_series_set_reset_interval(histogram_.get(), seconds);
+	}
+
+private:
+	std::unique_ptr<histogram_type> histogram_;
+	detail::Registration 		registration_;
+};
+
+} /* namespace procstat */
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ *   BSD LICENSE
+ *
+ *   Copyright (C) 2016 LightBits Labs Ltd. - All Rights Reserved
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of LightBits Labs Ltd nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Stream produced by an aggregator created with PROCSTAT_AGGREGATOR_BINARY, in host byte order.
+ *
+ * The stream is a sequence of frames, each made of:
+ * struct procstat_binary_header
+ * @nentries dictionary entries: struct procstat_binary_entry followed by @path_len bytes of the path
+ * @nrecords records: struct procstat_binary_record followed by @size bytes of payload
+ *
+ * The dictionary maps ids to paths (relative to the aggregator directory), every record refers to an id.
+ * It is written in the first frame after open, flagged by PROCSTAT_BINARY_FLAG_DICTIONARY, and later
+ * frames carry records only (@nentries is 0) using the same ids. The dictionary is written again, with
+ * new ids, only once stats were added or removed in the aggregated tree.
+ *
+ * A handle keeps its dictionary between frames, so a collector opens the file once and takes a new frame
+ * either by reading at offset 0 again, or by reading on past the end of the current frame once the end
+ * (a read returning 0 bytes) was reached. Fields are not aligned within the stream, read them with memcpy.
+ *
+ * Record payload by type:
+ * PROCSTAT_BINARY_U64, PROCSTAT_BINARY_S64: none, raw value in @value. Simple typed stats, per-cpu
+ * 	counters and the fields and percentiles of series and histograms.
+ * PROCSTAT_BINARY_TEXT: formatter output of a stat with no raw value
+ * PROCSTAT_BINARY_HISTOGRAM: @value is the points count, payload is the number of buckets followed by
+ * 	the bucket counts, each as the delta from the previous bucket. All encoded as LEB128 varints,
+ * 	deltas zigzag encoded. The buckets are those of procstat_hist_value_to_index (u32 histograms)
+ * 	or procstat_hist_u64_value_to_index (u64 histograms).
+ */
+
+#ifndef _PROCSTAT_BINARY_H_
+#define _PROCSTAT_BINARY_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROCSTAT_BINARY_MAGIC 	0x42545350 /* "PSTB" */
+#define PROCSTAT_BINARY_VERSION 2
+
+/* header flags */
+#define PROCSTAT_BINARY_FLAG_DICTIONARY 0x1 /* frame carries a new dictionary, earlier ids are void */
+
+enum procstat_binary_type {
+	PROCSTAT_BINARY_U64,
+	PROCSTAT_BINARY_S64,
+	PROCSTAT_BINARY_TEXT,
+	PROCSTAT_BINARY_HISTOGRAM,
+};
+
+struct procstat_binary_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t nentries;
+	uint32_t nrecords;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct procstat_binary_entry {
+	uint32_t id;
+	uint16_t type;
+	uint16_t path_len;
+} __attribute__((packed));
+
+struct procstat_binary_record {
+	uint32_t id;
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t size;
+	uint64_t value;
+} __attribute__((packed));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
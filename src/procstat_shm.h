@@ -0,0 +1,127 @@
+/*
+ *   BSD LICENSE
+ *
+ *   Copyright (C) 2016 LightBits Labs Ltd. - All Rights Reserved
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of LightBits Labs Ltd nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Layout of the shared memory segment created by procstat_shm_export().
+ *
+ * The segment starts with struct procstat_shm_header, followed by @capacity records
+ * of @record_size bytes each, starting at @header_size. Every exported stat file owns
+ * a record holding its full path relative to the root, its type and its last value.
+ * The values are refreshed every 100 msec: stats with a raw integer value (u32, u64,
+ * int, per-cpu counters and the files of series) are copied to @value as is, only stats with
+ * a custom formatter are formatted, into @text.
+ *
+ * Every record is protected by a sequence lock: @seq is odd while the record is written.
+ * A reader copies the record and retries if @seq was odd or changed meanwhile, see
+ * procstat_shm_read_record(). Records are added and freed as stats are registered and
+ * removed, every such change increments @generation so a reader may cache the index.
+ */
+
+#ifndef _PROCSTAT_SHM_H_
+#define _PROCSTAT_SHM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROCSTAT_SHM_MAGIC 	0x54535250 /* "PRST" */
+#define PROCSTAT_SHM_VERSION 	2
+#define PROCSTAT_SHM_TEXT_LEN 	32
+#define PROCSTAT_SHM_NAME_LEN 	208
+
+enum procstat_shm_type {
+	PROCSTAT_SHM_FREE,
+	PROCSTAT_SHM_U64,	/* @value holds the value */
+	PROCSTAT_SHM_S64,	/* @value holds the value, two's complement */
+	PROCSTAT_SHM_TEXT,	/* formatted stat, @text holds its (possibly truncated) output,
+				 * @value the output parsed as a decimal integer, 0 if it is not one */
+};
+
+struct procstat_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint32_t nrecords;	/* records past nrecords were never used */
+	uint32_t dropped;	/* stats not exported since the segment is full or the path is too long */
+	uint32_t reserved;
+	uint64_t generation;
+	uint64_t update_time_msec; /* CLOCK_REALTIME of the last refresh */
+};
+
+struct procstat_shm_record {
+	uint32_t seq;
+	uint16_t type;
+	uint16_t name_len;
+	uint64_t value;
+	char	 text[PROCSTAT_SHM_TEXT_LEN];
+	char	 name[PROCSTAT_SHM_NAME_LEN];
+};
+
+static inline const struct procstat_shm_record *procstat_shm_record(const struct procstat_shm_header *header,
+								    unsigned index)
+{
+	return (const struct procstat_shm_record *)((const char *)header + header->header_size +
+						    (size_t)index * header->record_size);
+}
+
+/**
+ * @brief copies a consistent snapshot of record @index to @record
+ * @return false in case the record is free
+ */
+static inline bool procstat_shm_read_record(const struct procstat_shm_header *header, unsigned index,
+					    struct procstat_shm_record *record)
+{
+	const struct procstat_shm_record *shared = procstat_shm_record(header, index);
+	uint32_t seq;
+
+	do {
+		while ((seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(record, shared, sizeof(*record));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) != seq);
+
+	return record->type != PROCSTAT_SHM_FREE;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
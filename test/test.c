@@ -4,8 +4,17 @@
 #include <stdlib.h>
 #include <memory.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "../src/procstat.h"
+#include "../src/procstat_shm.h"
+#include "../src/procstat_binary.h"
 
 static struct procstat_context *context;
 
@@ -15,6 +24,57 @@ void* fuse_loop(void *arg)
 	return NULL;
 }
 
+#define MOUNTPOINT "/tmp/blabla"
+
+/* reads @path under the mountpoint at @offset, returns the number of bytes read */
+static ssize_t read_mounted(const char *path, char *buffer, size_t size, off_t offset)
+{
+	char full_path[PATH_MAX];
+	ssize_t length;
+	int fd;
+
+	snprintf(full_path, sizeof(full_path), "%s/%s", MOUNTPOINT, path);
+	fd = open(full_path, O_RDONLY);
+	assert(fd >= 0);
+	length = pread(fd, buffer, size, offset);
+	assert(length >= 0);
+	close(fd);
+	return length;
+}
+
+static void write_mounted(const char *path, const char *value)
+{
+	char full_path[PATH_MAX];
+	int fd;
+
+	snprintf(full_path, sizeof(full_path), "%s/%s", MOUNTPOINT, path);
+	fd = open(full_path, O_WRONLY);
+	assert(fd >= 0);
+	assert(write(fd, value, strlen(value)) == (ssize_t)strlen(value));
+	close(fd);
+}
+
+static uint64_t read_mounted_u64(const char *path)
+{
+	char buffer[32];
+	ssize_t length;
+
+	length = read_mounted(path, buffer, sizeof(buffer) - 1, 0);
+	buffer[length] = '\0';
+	return strtoull(buffer, NULL, 10);
+}
+
+static uint64_t read_fd_u64(int fd)
+{
+	char buffer[32];
+	ssize_t length;
+
+	length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+	assert(length > 0);
+	buffer[length] = '\0';
+	return strtoull(buffer, NULL, 10);
+}
+
 static void fuse_destroy(int sig)
 {
 	printf("Destroying ...\n");
@@ -248,6 +308,119 @@ static void create_time_series(struct procstat_item *root)
 	getchar();
 }
 
+static ino_t readdir_inode(const char *path, const char *name)
+{
+	struct dirent *entry;
+	ino_t inode = 0;
+	DIR *dir;
+
+	dir = opendir(path);
+	assert(dir);
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, name) == 0)
+			inode = entry->d_ino;
+	}
+	closedir(dir);
+	return inode;
+}
+
+static void test_synthesized_files(void)
+{
+	struct procstat_series_u64 series, removed;
+	struct procstat_item *item;
+	struct stat first, second;
+	char buffer[32];
+	int error;
+	int fd;
+
+	memset(&series, 0, sizeof(series));
+	memset(&removed, 0, sizeof(removed));
+	error = procstat_create_u64_series(context, NULL, "synthesized", &series);
+	assert(!error);
+	procstat_u64_series_add_point(&series, 1);
+	procstat_u64_series_add_point(&series, 2);
+
+	/* a synthesized file keeps its inode across lookups, and readdir reports the same one */
+	assert(stat(MOUNTPOINT "/synthesized/sum", &first) == 0);
+	assert(stat(MOUNTPOINT "/synthesized/sum", &second) == 0);
+	assert(first.st_ino == second.st_ino);
+	assert(readdir_inode(MOUNTPOINT "/synthesized", "sum") == first.st_ino);
+
+	/* an open synthesized file keeps reading the series once its files are materialized */
+	fd = open(MOUNTPOINT "/synthesized/sum", O_RDONLY);
+	assert(fd >= 0);
+	assert(read_fd_u64(fd) == 3);
+	item = procstat_lookup_item(context, NULL, "synthesized");
+	assert(item);
+	assert(procstat_lookup_item(context, item, "sum"));
+	procstat_u64_series_add_point(&series, 3);
+	assert(read_fd_u64(fd) == 6);
+	assert(read_mounted_u64("synthesized/sum") == 6);
+	close(fd);
+	procstat_remove(context, item);
+
+	/* once its series is removed it reads empty, as the files of a removed directory do */
+	error = procstat_create_u64_series(context, NULL, "synthesized_removed", &removed);
+	assert(!error);
+	procstat_u64_series_add_point(&removed, 5);
+	fd = open(MOUNTPOINT "/synthesized_removed/count", O_RDONLY);
+	assert(fd >= 0);
+	assert(read_fd_u64(fd) == 1);
+	procstat_remove_by_name(context, NULL, "synthesized_removed");
+	assert(pread(fd, buffer, sizeof(buffer), 0) == 0);
+	close(fd);
+	assert(stat(MOUNTPOINT "/synthesized_removed/count", &first) < 0 && errno == ENOENT);
+}
+
+static void test_series_add_points(void)
+{
+	struct procstat_series_u64 single, batch;
+	uint64_t values[100];
+	int i;
+
+	memset(&single, 0, sizeof(single));
+	memset(&batch, 0, sizeof(batch));
+	single.min = batch.min = ULLONG_MAX;
+	for (i = 0; i < 100; ++i) {
+		values[i] = (i * 37) % 101;
+		procstat_u64_series_add_point(&single, values[i]);
+	}
+	procstat_u64_series_add_points(&batch, values, 50);
+	procstat_u64_series_add_points(&batch, &values[50], 50);
+
+	assert(single.count == batch.count);
+	assert(single.sum == batch.sum);
+	assert(single.min == batch.min);
+	assert(single.max == batch.max);
+	assert(single.last == batch.last);
+}
+
+/* batch mean and variance are merged in floating point, per-point adds round down on every point */
+#define SERIES_MOMENTS_TOLERANCE 0.001
+
+static void test_series_add_points_moments(void)
+{
+	struct procstat_series_u64 single, batch;
+	static uint64_t values[10000];
+	double single_variance, batch_variance;
+	int i;
+
+	memset(&single, 0, sizeof(single));
+	memset(&batch, 0, sizeof(batch));
+	single.min = batch.min = ULLONG_MAX;
+	for (i = 0; i < 10000; ++i) {
+		values[i] = 1000 + (i * 7919ULL) % 100000;
+		procstat_u64_series_add_point(&single, values[i]);
+	}
+	for (i = 0; i < 10000; i += 100)
+		procstat_u64_series_add_points(&batch, &values[i], 100);
+
+	single_variance = (double)single.aggregated_variance / (single.count - 1);
+	batch_variance = (double)batch.aggregated_variance / (batch.count - 1);
+	assert(fabs((double)batch.mean - single.mean) <= single.mean * SERIES_MOMENTS_TOLERANCE);
+	assert(fabs(batch_variance - single_variance) <= single_variance * SERIES_MOMENTS_TOLERANCE);
+}
+
 static void test_create_multiple_dirs_and_files(struct procstat_item *root, uint32_t *values_32)
 {
 	struct procstat_item *item;
@@ -367,6 +540,545 @@ void create_histogram(void)
 	procstat_remove_by_name(context, NULL, "hist");
 }
 
+/* the batch bucketing is vectorized where the cpu supports it, it must match the scalar one */
+static void test_hist_values_to_index(void)
+{
+	static uint32_t values[8192];
+	static uint32_t index[8192];
+	size_t n = 0;
+	size_t i, len;
+	unsigned bit, k;
+
+	for (i = 0; i < 256; ++i)
+		values[n++] = i;
+	for (bit = PROCSTAT_BUCKET_BITS; bit < 32; ++bit) {
+		/* first value of every bucket of the group, and the last value of the bucket before */
+		for (k = 0; k < PROCSTAT_BUCKET_VALUES; ++k) {
+			uint32_t first = (1U << bit) + (k << (bit - PROCSTAT_BUCKET_BITS));
+
+			values[n++] = first;
+			values[n++] = first - 1;
+		}
+	}
+	values[n++] = UINT32_MAX;
+	values[n++] = UINT32_MAX - 1;
+	values[n++] = 1U << 31;
+	srand(1);
+	while (n < sizeof(values) / sizeof(values[0]))
+		values[n++] = ((uint32_t)rand() << 16) ^ rand();
+
+	procstat_hist_values_to_index(values, index, n);
+	for (i = 0; i < n; ++i)
+		assert(index[i] == procstat_hist_value_to_index(values[i]));
+
+	/* lengths that are not a multiple of the vector width go through the scalar tail */
+	for (len = 1; len <= 40; ++len) {
+		memset(index, 0xff, len * sizeof(*index));
+		procstat_hist_values_to_index(&values[n - len], index, len);
+		for (i = 0; i < len; ++i)
+			assert(index[i] == procstat_hist_value_to_index(values[n - len + i]));
+	}
+}
+
+void create_histogram_u64(void)
+{
+	struct procstat_histogram_u64 series = {.percentile = {{.fraction = 0.1f},
+							       {.fraction = 0.6f},
+							       {.fraction = 0.99f}},
+						.npercentile = 3,
+						.max_value = 1ULL << 40};
+	int error;
+	int i;
+
+	error = procstat_create_histogram_u64_series(context, NULL, "hist_u64", &series);
+	assert(!error);
+
+	for (i = 0; i < 1000000; ++i)
+		procstat_histogram_u64_add_point(&series, i * 1000000ULL);
+
+	procstat_percentile_calculate_u64(&series.geometry, series.histogram, series.count, series.percentile, 3);
+	assert(series.percentile[0].value == 100394860544ULL);
+	assert(series.percentile[1].value == 597000454144ULL);
+
+	printf("Observe u64 histogram values\n");
+	getchar();
+	procstat_remove_by_name(context, NULL, "hist_u64");
+}
+
+void create_histogram_window(void)
+{
+	struct procstat_histogram_u32_window window = {.percentile = {{.fraction = 0.5f},
+								     {.fraction = 0.99f}},
+						       .npercentile = 2};
+	int error;
+	int i, j;
+
+	error = procstat_create_histogram_u32_window(context, NULL, "hist_window", &window);
+	assert(!error);
+
+	printf("Submitting points for 5 seconds, observe 1s, 10s and 60s windows\n");
+	for (i = 0; i < 5; ++i) {
+		for (j = 0; j < 1000; ++j)
+			procstat_histogram_u32_window_add_point(&window, i * 1000 + j);
+		sleep(1);
+	}
+	getchar();
+
+	procstat_remove_by_name(context, NULL, "hist_window");
+}
+
+void create_rate(void)
+{
+	static struct procstat_rate rate;
+	int error;
+	int i;
+
+	error = procstat_create_rate(context, NULL, "rate", &rate);
+	assert(!error);
+
+	printf("Recording 1000 events per second for 5 seconds, observe rate_1s, rate_10s and rate_60s\n");
+	for (i = 0; i < 50; ++i) {
+		procstat_rate_add(&rate, 100);
+		usleep(100000);
+	}
+	assert(rate.events == 5000);
+	getchar();
+
+	procstat_remove_by_name(context, NULL, "rate");
+}
+
+void create_history(void)
+{
+	struct procstat_item *item;
+	uint64_t counter = 0;
+	int error;
+	int i;
+
+	item = procstat_create_directory(context, NULL, "sampled");
+	assert(item);
+	error = procstat_create_u64(context, item, "counter", &counter);
+	assert(!error);
+	error = procstat_create_history(context, item, 600);
+	assert(!error);
+	assert(procstat_lookup_item(context, item, "counter.history"));
+
+	error = procstat_sampler_start(context, 100);
+	assert(!error);
+	for (i = 0; i < 20; ++i) {
+		++counter;
+		usleep(100000);
+	}
+	printf("Observe sampled/counter.history\n");
+	getchar();
+
+	procstat_sampler_stop(context);
+	procstat_remove(context, item);
+}
+
+void test_shm_export(void)
+{
+	struct procstat_shm_header *header;
+	struct procstat_shm_record record;
+	uint64_t counter = 5;
+	size_t size;
+	int error;
+	int fd;
+
+	error = procstat_shm_export(context, "/procstat_test", 1024);
+	assert(!error);
+	error = procstat_create_u64(context, NULL, "shm_counter", &counter);
+	assert(!error);
+
+	fd = shm_open("/procstat_test", O_RDONLY, 0);
+	assert(fd >= 0);
+	size = PROCSTAT_CACHELINE_SIZE + 1024 * sizeof(record);
+	header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	assert(header != MAP_FAILED);
+	close(fd);
+	assert(header->magic == PROCSTAT_SHM_MAGIC);
+
+	counter = 10;
+	sleep(1);
+	assert(procstat_shm_read_record(header, header->nrecords - 1, &record));
+	assert(!strcmp(record.name, "shm_counter"));
+	assert(record.type == PROCSTAT_SHM_U64 && record.value == 10);
+
+	munmap(header, size);
+	procstat_remove_by_name(context, NULL, "shm_counter");
+}
+
+void create_snapshot_aggregator(void)
+{
+	static char snapshot[1024 * 1024];
+	const size_t sizes[] = {1, 7, 100, 4096, 100000};
+	struct procstat_item *item = NULL;
+	uint64_t counter = 1;
+	char expected[512] = "";
+	char part[100000];
+	ssize_t length, part_length;
+	off_t offsets[4];
+	char name[64];
+	size_t i, j;
+	int error;
+	int fd;
+
+	/* deep enough to exceed the path length limit of procstat_create_aggregator */
+	for (i = 0; i < 8; ++i) {
+		sprintf(name, "snapshot_directory_level_%zu", i);
+		item = procstat_create_directory(context, item, name);
+		assert(item);
+		strcat(expected, name);
+		strcat(expected, "/");
+	}
+	strcat(expected, "counter:1\n");
+	assert(strlen(expected) > 120);
+	error = procstat_create_u64(context, item, "counter", &counter);
+	assert(!error);
+	error = procstat_create_snapshot_aggregator(context, NULL, "snapshot");
+	assert(!error);
+
+	/* the snapshot is taken by the first read, at whatever offset, and serves all the reads of the handle */
+	fd = open(MOUNTPOINT "/snapshot", O_RDONLY);
+	assert(fd >= 0);
+	part_length = pread(fd, part, 10, 5);
+	length = pread(fd, snapshot, sizeof(snapshot) - 1, 0);
+	assert(length > 0 && length < (ssize_t)sizeof(snapshot) - 1);
+	snapshot[length] = '\0';
+	assert(part_length == 10 && !memcmp(part, snapshot + 5, 10));
+	assert(strstr(snapshot, expected));
+
+	offsets[0] = 0;
+	offsets[1] = 1;
+	offsets[2] = length / 2;
+	offsets[3] = length - 1;
+	for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+		for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j) {
+			size_t expected_length = length - offsets[i] < sizes[j] ? length - offsets[i] : sizes[j];
+
+			part_length = pread(fd, part, sizes[j], offsets[i]);
+			assert(part_length == (ssize_t)expected_length);
+			assert(!memcmp(part, snapshot + offsets[i], expected_length));
+		}
+	}
+	assert(pread(fd, part, sizeof(part), length) == 0);
+	close(fd);
+
+	procstat_remove_by_name(context, NULL, "snapshot");
+	procstat_remove_by_name(context, NULL, "snapshot_directory_level_0");
+}
+
+static int queue_depths_report(void *object, uint64_t arg, struct procstat_stream *stream)
+{
+	uint32_t *depths = object;
+	uint64_t i;
+
+	for (i = 0; i < arg; ++i) {
+		if (procstat_stream_printf(stream, "queue %4lu depth %u\n", i, depths[i]))
+			return -1;
+	}
+	return 0;
+}
+
+static ssize_t long_line_format(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	return snprintf(buffer, length, "%s\n", (const char *)object);
+}
+
+/* whole file at once, and a part of it at @offset, both with a fresh handle */
+static void assert_mounted_content(const char *path, const char *expected, size_t offset)
+{
+	static char buffer[256 * 1024];
+	size_t length = strlen(expected);
+	size_t part = length - offset < 1000 ? length - offset : 1000;
+
+	assert(read_mounted(path, buffer, sizeof(buffer), 0) == (ssize_t)length);
+	assert(!memcmp(buffer, expected, length));
+	assert(read_mounted(path, buffer, 1000, offset) == (ssize_t)part);
+	assert(!memcmp(buffer, expected + offset, part));
+}
+
+void create_stream(void)
+{
+	static uint32_t depths[4096];
+	static char expected[4096 * 32];
+	static char long_line[301];
+	struct procstat_simple_handle descriptor = {"long_line", long_line, 0, long_line_format};
+	size_t length = 0;
+	int error;
+	int i;
+
+	for (i = 0; i < 4096; ++i) {
+		depths[i] = i % 17;
+		length += sprintf(&expected[length], "queue %4d depth %u\n", i, depths[i]);
+	}
+	error = procstat_create_stream(context, NULL, "queue_depths", depths, 4096, queue_depths_report);
+	assert(!error);
+	assert(length > 64 * 1024);
+	assert_mounted_content("queue_depths", expected, length / 2 + 7);
+
+	/* plain formatter output longer than READ_BUFFER_SIZE is reformatted rather than truncated */
+	for (i = 0; i < 300; ++i)
+		long_line[i] = 'a' + i % 26;
+	error = procstat_create_simple(context, NULL, &descriptor, 1);
+	assert(!error);
+	sprintf(expected, "%s\n", long_line);
+	assert_mounted_content("long_line", expected, 150);
+
+	procstat_remove_by_name(context, NULL, "long_line");
+	procstat_remove_by_name(context, NULL, "queue_depths");
+}
+
+void create_formatted_aggregators(void)
+{
+	struct procstat_histogram_u32 series = {.percentile = {{.fraction = 0.5f},
+								{.fraction = 0.99f}},
+						.npercentile = 2};
+	static char metrics[64 * 1024];
+	struct procstat_item *item;
+	uint64_t counter = 1;
+	ssize_t length;
+	int error;
+	int i;
+
+	item = procstat_create_directory(context, NULL, "formatted");
+	assert(item);
+	error = procstat_create_u64(context, item, "counter", &counter);
+	assert(!error);
+	error = procstat_create_histogram_u32_series(context, item, "latency", &series);
+	assert(!error);
+	for (i = 0; i < 1000; ++i)
+		procstat_histogram_u32_add_point(&series, i);
+
+	error = procstat_create_formatted_aggregator(context, item, "metrics", PROCSTAT_AGGREGATOR_OPENMETRICS);
+	assert(!error);
+	error = procstat_create_formatted_aggregator(context, item, "metrics.json", PROCSTAT_AGGREGATOR_JSON);
+	assert(!error);
+	error = procstat_create_formatted_aggregator(context, item, "metrics.bin", PROCSTAT_AGGREGATOR_BINARY);
+	assert(!error);
+	error = procstat_create_formatted_aggregator(context, item, "invalid", PROCSTAT_AGGREGATOR_BINARY + 1);
+	assert(error);
+
+	length = read_mounted("formatted/metrics", metrics, sizeof(metrics) - 1, 0);
+	metrics[length] = '\0';
+	assert(strstr(metrics, "# TYPE latency histogram\n"));
+	assert(strstr(metrics, "latency_bucket{le=\"999\"} 1000\n"));
+	assert(strstr(metrics, "latency_bucket{le=\"+Inf\"} 1000\n"));
+	assert(strstr(metrics, "latency_count 1000\n"));
+	assert(strstr(metrics, "latency_sum 499500\n"));
+
+	printf("Observe formatted/metrics, formatted/metrics.json and formatted/metrics.bin\n");
+	getchar();
+
+	procstat_remove(context, item);
+}
+
+/* id of @path in the dictionary of @frame, -1 in case it is not there */
+static int64_t binary_frame_id(const char *frame, const char *path)
+{
+	struct procstat_binary_header header;
+	struct procstat_binary_entry entry;
+	const char *pos;
+	uint32_t i;
+
+	memcpy(&header, frame, sizeof(header));
+	pos = frame + header.header_size;
+	for (i = 0; i < header.nentries; ++i) {
+		memcpy(&entry, pos, sizeof(entry));
+		pos += sizeof(entry);
+		if (entry.path_len == strlen(path) && !memcmp(pos, path, entry.path_len))
+			return entry.id;
+		pos += entry.path_len;
+	}
+	return -1;
+}
+
+/* value of the record of @id in @frame, which is @length bytes long */
+static uint64_t binary_frame_value(const char *frame, size_t length, uint32_t id)
+{
+	struct procstat_binary_header header;
+	struct procstat_binary_entry entry;
+	struct procstat_binary_record record;
+	const char *pos;
+	uint32_t i;
+
+	memcpy(&header, frame, sizeof(header));
+	pos = frame + header.header_size;
+	for (i = 0; i < header.nentries; ++i) {
+		memcpy(&entry, pos, sizeof(entry));
+		pos += sizeof(entry) + entry.path_len;
+	}
+	for (i = 0; i < header.nrecords; ++i) {
+		memcpy(&record, pos, sizeof(record));
+		assert(pos + sizeof(record) + record.size <= frame + length);
+		if (record.id == id)
+			return record.value;
+		pos += sizeof(record) + record.size;
+	}
+	assert(0);
+	return 0;
+}
+
+/* a handle keeps its dictionary, the next frames carry records only until the tree changes */
+void test_binary_frames(void)
+{
+	static char frame[64 * 1024];
+	struct procstat_binary_header header;
+	struct procstat_item *item;
+	uint64_t counter = 1, other = 0;
+	int64_t id;
+	ssize_t length;
+	int error;
+	int fd;
+
+	item = procstat_create_directory(context, NULL, "binary");
+	assert(item);
+	error = procstat_create_u64(context, item, "counter", &counter);
+	assert(!error);
+	error = procstat_create_formatted_aggregator(context, item, "metrics.bin", PROCSTAT_AGGREGATOR_BINARY);
+	assert(!error);
+
+	fd = open(MOUNTPOINT "/binary/metrics.bin", O_RDONLY);
+	assert(fd >= 0);
+	length = pread(fd, frame, sizeof(frame), 0);
+	assert(length > (ssize_t)sizeof(header));
+	memcpy(&header, frame, sizeof(header));
+	assert(header.magic == PROCSTAT_BINARY_MAGIC && header.version == PROCSTAT_BINARY_VERSION);
+	assert(header.flags & PROCSTAT_BINARY_FLAG_DICTIONARY);
+	id = binary_frame_id(frame, "counter");
+	assert(id >= 0);
+	assert(binary_frame_value(frame, length, id) == 1);
+
+	/* reading at offset 0 again */
+	counter = 2;
+	length = pread(fd, frame, sizeof(frame), 0);
+	memcpy(&header, frame, sizeof(header));
+	assert(!(header.flags & PROCSTAT_BINARY_FLAG_DICTIONARY) && !header.nentries);
+	assert(binary_frame_value(frame, length, id) == 2);
+
+	/* reading on past the end of the frame */
+	assert(pread(fd, frame, sizeof(frame), length) == 0);
+	counter = 3;
+	length = pread(fd, frame, sizeof(frame), length);
+	memcpy(&header, frame, sizeof(header));
+	assert(!(header.flags & PROCSTAT_BINARY_FLAG_DICTIONARY));
+	assert(binary_frame_value(frame, length, id) == 3);
+
+	/* stats added, the dictionary is sent again */
+	error = procstat_create_u64(context, item, "other", &other);
+	assert(!error);
+	length = pread(fd, frame, sizeof(frame), 0);
+	memcpy(&header, frame, sizeof(header));
+	assert(header.flags & PROCSTAT_BINARY_FLAG_DICTIONARY);
+	assert(binary_frame_id(frame, "other") >= 0);
+	assert(binary_frame_value(frame, length, binary_frame_id(frame, "counter")) == 3);
+
+	close(fd);
+	procstat_remove(context, item);
+}
+
+#define LARGE_DIRECTORY_ITEMS 10000
+void test_large_directory(void)
+{
+	static uint64_t values[LARGE_DIRECTORY_ITEMS];
+	struct procstat_item *item;
+	char name[32];
+	int error;
+	int i;
+
+	item = procstat_create_directory(context, NULL, "large");
+	assert(item);
+	for (i = 0; i < LARGE_DIRECTORY_ITEMS; ++i) {
+		sprintf(name, "volume_%d", i);
+		error = procstat_create_u64(context, item, name, &values[i]);
+		assert(!error);
+	}
+	error = procstat_create_u64(context, item, "volume_0", &values[0]);
+	assert(error);
+
+	for (i = 0; i < LARGE_DIRECTORY_ITEMS; i += 2) {
+		sprintf(name, "volume_%d", i);
+		error = procstat_remove_by_name(context, item, name);
+		assert(!error);
+	}
+	for (i = 0; i < LARGE_DIRECTORY_ITEMS; ++i) {
+		sprintf(name, "volume_%d", i);
+		assert(!procstat_lookup_item(context, item, name) == !(i & 1));
+	}
+	procstat_remove(context, item);
+}
+
+#define CONCURRENT_REGISTRATION_THREADS 4
+#define CONCURRENT_REGISTRATION_ITEMS 1000
+static void *concurrent_registration_thread(void *arg)
+{
+	static uint64_t values[CONCURRENT_REGISTRATION_THREADS][CONCURRENT_REGISTRATION_ITEMS];
+	long id = (long)arg;
+	struct procstat_item *item;
+	char name[32];
+	int error;
+	int i;
+
+	sprintf(name, "concurrent_%ld", id);
+	item = procstat_create_directory(context, NULL, name);
+	assert(item);
+	for (i = 0; i < CONCURRENT_REGISTRATION_ITEMS; ++i) {
+		sprintf(name, "value_%d", i);
+		error = procstat_create_u64(context, item, name, &values[id][i]);
+		assert(!error);
+		assert(procstat_lookup_item(context, item, name));
+	}
+	procstat_remove(context, item);
+	return NULL;
+}
+
+/* every thread registers in its own directory, only the root directory is shared */
+void test_concurrent_registration(void)
+{
+	pthread_t threads[CONCURRENT_REGISTRATION_THREADS];
+	long i;
+
+	for (i = 0; i < CONCURRENT_REGISTRATION_THREADS; ++i)
+		pthread_create(&threads[i], NULL, concurrent_registration_thread, (void *)i);
+	for (i = 0; i < CONCURRENT_REGISTRATION_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+	assert(!procstat_lookup_item(context, NULL, "concurrent_0"));
+}
+
+#define BATCH_ITEMS 100
+void test_batch_registration(void)
+{
+	static uint64_t values[BATCH_ITEMS];
+	struct procstat_item *batch, *dup;
+	char name[32];
+	int error;
+	int i;
+
+	batch = procstat_batch_begin(context, "batch");
+	assert(batch);
+	for (i = 0; i < BATCH_ITEMS; ++i) {
+		sprintf(name, "value_%d", i);
+		error = procstat_create_u64(context, batch, name, &values[i]);
+		assert(!error);
+	}
+	/* nothing is visible until commit */
+	assert(!procstat_lookup_item(context, NULL, "batch"));
+	error = procstat_batch_commit(context, NULL, batch);
+	assert(!error);
+	assert(procstat_lookup_item(context, batch, "value_7"));
+
+	/* failed commit frees the whole batch */
+	dup = procstat_batch_begin(context, "batch");
+	assert(dup);
+	error = procstat_create_u64(context, dup, "value_0", &values[0]);
+	assert(!error);
+	error = procstat_batch_commit(context, NULL, dup);
+	assert(error && errno == EEXIST);
+
+	printf("Batch registered at batch/, press enter to remove\n");
+	getchar();
+	procstat_remove(context, batch);
+}
+
 static ssize_t procstat_control_set_u64(void *object, uint64_t arg, char *buffer, size_t length)
 {
 	uint64_t *ptr = object;
@@ -421,6 +1133,133 @@ void test_parameter(void)
 	procstat_remove_by_name(context, NULL, "param");
 }
 
+#define PERCPU_THREADS 4
+#define PERCPU_ADDS 100000
+
+static void *percpu_add_thread(void *arg)
+{
+	struct procstat_percpu_u64 *counter = arg;
+	int i;
+
+	for (i = 0; i < PERCPU_ADDS; ++i)
+		procstat_percpu_inc(counter);
+	return NULL;
+}
+
+void test_percpu_counter(void)
+{
+	struct procstat_percpu_u64 counter;
+	pthread_t threads[PERCPU_THREADS];
+	int error;
+	int i;
+
+	error = procstat_create_percpu_u64(context, NULL, "percpu", &counter);
+	assert(!error);
+
+	for (i = 0; i < PERCPU_THREADS; ++i)
+		pthread_create(&threads[i], NULL, percpu_add_thread, &counter);
+	for (i = 0; i < PERCPU_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+	assert(procstat_percpu_u64_sum(&counter) == PERCPU_THREADS * PERCPU_ADDS);
+
+	printf("Observe percpu value\n");
+	getchar();
+	procstat_remove_by_name(context, NULL, "percpu");
+}
+
+static struct procstat_histogram_u32 sharded_histogram = {.percentile = {{.fraction = 0.5f},
+									 {.fraction = 0.99f}},
+							  .npercentile = 2,
+							  .nshards = PERCPU_THREADS};
+
+static void *sharded_histogram_thread(void *arg)
+{
+	int i;
+
+	for (i = 0; i < PERCPU_ADDS; ++i)
+		procstat_histogram_u32_add_point(&sharded_histogram, i);
+	return NULL;
+}
+
+static uint64_t sharded_histogram_count(struct procstat_histogram_u32 *series)
+{
+	uint64_t count = 0;
+	unsigned i;
+
+	for (i = 0; i < series->nshards; ++i)
+		count += series->shards[i].count;
+	return count;
+}
+
+void test_sharded_histogram(void)
+{
+	pthread_t threads[PERCPU_THREADS];
+	int error;
+	int i;
+
+	error = procstat_create_histogram_u32_series(context, NULL, "sharded_hist", &sharded_histogram);
+	assert(!error);
+
+	for (i = 0; i < PERCPU_THREADS; ++i)
+		pthread_create(&threads[i], NULL, sharded_histogram_thread, NULL);
+	for (i = 0; i < PERCPU_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+	assert(sharded_histogram_count(&sharded_histogram) == PERCPU_THREADS * PERCPU_ADDS);
+
+	printf("Observe sharded histogram, count should be %d\n", PERCPU_THREADS * PERCPU_ADDS);
+	getchar();
+	procstat_remove_by_name(context, NULL, "sharded_hist");
+}
+
+#define SHARDED_RESET_SHARDS 2
+#define SHARDED_RESET_THREADS (4 * SHARDED_RESET_SHARDS)
+static struct procstat_histogram_u32 sharded_reset_histogram = {.percentile = {{.fraction = 0.5f}},
+								.npercentile = 1,
+								.nshards = SHARDED_RESET_SHARDS};
+
+static void *sharded_reset_thread(void *arg)
+{
+	int i;
+
+	for (i = 0; i < PERCPU_ADDS; ++i)
+		procstat_histogram_u32_add_point(&sharded_reset_histogram, i);
+	return NULL;
+}
+
+/* more threads than shards, so writers share shards and race on clearing them after a reset */
+static void record_sharded_reset(int resets)
+{
+	pthread_t threads[SHARDED_RESET_THREADS];
+	int i;
+
+	for (i = 0; i < SHARDED_RESET_THREADS; ++i)
+		pthread_create(&threads[i], NULL, sharded_reset_thread, NULL);
+	for (i = 0; i < resets; ++i) {
+		write_mounted("sharded_reset/reset", "1");
+		assert(read_mounted_u64("sharded_reset/count") <= SHARDED_RESET_THREADS * PERCPU_ADDS);
+	}
+	for (i = 0; i < SHARDED_RESET_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+void test_sharded_histogram_reset(void)
+{
+	int error;
+
+	error = procstat_create_histogram_u32_series(context, NULL, "sharded_reset", &sharded_reset_histogram);
+	assert(!error);
+
+	record_sharded_reset(10);
+
+	/* nothing recorded after the reset is lost */
+	write_mounted("sharded_reset/reset", "1");
+	assert(read_mounted_u64("sharded_reset/count") == 0);
+	record_sharded_reset(0);
+	assert(read_mounted_u64("sharded_reset/count") == SHARDED_RESET_THREADS * PERCPU_ADDS);
+
+	procstat_remove_by_name(context, NULL, "sharded_reset");
+}
+
 int main(int argc, char **argv) {
 	struct procstat_item *item;
 	uint32_t values_32[10];
@@ -428,7 +1267,7 @@ int main(int argc, char **argv) {
 	uint16_t values_16[10];
 	int i;
 
-	context = procstat_create("/tmp/blabla");
+	context = procstat_create(MOUNTPOINT);
 	assert(context);
 	set_signal_handlers();
 
@@ -449,8 +1288,27 @@ int main(int argc, char **argv) {
 	create_multiple_start_end_stats(NULL);
 	create_multiple_series(NULL);
 	create_time_series(NULL);
+	test_synthesized_files();
+	test_series_add_points();
+	test_series_add_points_moments();
 	create_histogram();
+	test_hist_values_to_index();
+	create_histogram_u64();
+	create_histogram_window();
+	create_rate();
+	create_history();
+	test_shm_export();
+	create_snapshot_aggregator();
+	create_formatted_aggregators();
+	test_binary_frames();
+	create_stream();
+	test_large_directory();
+	test_concurrent_registration();
+	test_batch_registration();
 	test_control();
+	test_percpu_counter();
+	test_sharded_histogram();
+	test_sharded_histogram_reset();
 
 	printf("PRESS CTRL-C to exit\n");
 	pthread_join(inc_x_thread, NULL);
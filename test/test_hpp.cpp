@@ -0,0 +1,105 @@
+#include <assert.h>
+#include <stdio.h>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include "../src/procstat.hpp"
+
+static struct procstat_context *context;
+
+static void test_create_and_remove()
+{
+	{
+		procstat::Directory dir(context, nullptr, "cpp");
+		procstat::Counter<uint64_t> reads(context, dir.item(), "reads");
+		procstat::Counter<int> errors(context, dir.item(), "errors");
+		procstat::Gauge<double> temperature(context, dir.item(), "temperature", 1.5);
+		procstat::Series latency(context, dir.item(), "latency");
+		procstat::Histogram<> histogram(context, dir.item(), "histogram", {0.5f, 0.99f});
+		procstat::Histogram<uint64_t> histogram64(context, dir.item(), "histogram64", {0.9f});
+		uint64_t points[] = {1, 2, 3};
+
+		reads.inc();
+		reads += 41;
+		++errors;
+		temperature = 36.6;
+		latency.add(10);
+		latency.add(points, 3);
+		histogram.add(5);
+		histogram64.add(1ULL << 40);
+		assert(reads.value() == 42);
+		assert(errors.value() == 1);
+		assert(temperature.value() == 36.6);
+		assert(procstat_lookup_item(context, dir.item(), "histogram"));
+	}
+	assert(!procstat_lookup_item(context, nullptr, "cpp"));
+}
+
+static void test_duplicate_throws()
+{
+	procstat::Counter<uint64_t> counter(context, nullptr, "cpp_counter");
+	bool thrown = false;
+
+	try {
+		procstat::Counter<uint64_t> duplicate(context, nullptr, "cpp_counter");
+	} catch (const std::system_error &e) {
+		thrown = e.code().value() == EEXIST;
+	}
+	assert(thrown);
+}
+
+static void test_move()
+{
+	std::vector<procstat::Counter<uint64_t>> counters;
+	char name[32];
+	int i;
+
+	for (i = 0; i < 16; ++i) {
+		snprintf(name, sizeof(name), "cpp_counter_%d", i);
+		counters.emplace_back(context, nullptr, name);
+		counters.back().add(i);
+	}
+	for (i = 0; i < 16; ++i)
+		assert(counters[i].value() == (uint64_t)i);
+
+	/* the assigned-to statistic is removed, the moved one stays registered */
+	counters[0] = std::move(counters[1]);
+	assert(!procstat_lookup_item(context, nullptr, "cpp_counter_0"));
+	assert(procstat_lookup_item(context, nullptr, "cpp_counter_1"));
+	assert(counters[0].value() == 1);
+
+	procstat::Series series(context, nullptr, "cpp_series");
+	procstat::Series other(context, nullptr, "cpp_series_other");
+	series = std::move(other);
+	series.add(1);
+	assert(!procstat_lookup_item(context, nullptr, "cpp_series"));
+
+	procstat::Histogram<> histogram(context, nullptr, "cpp_histogram", {0.5f});
+	procstat::Histogram<> other_histogram(context, nullptr, "cpp_histogram_other", {0.5f});
+	histogram = std::move(other_histogram);
+	histogram.add(1);
+	assert(!procstat_lookup_item(context, nullptr, "cpp_histogram"));
+
+	procstat::Gauge<int> gauge(context, nullptr, "cpp_gauge");
+	procstat::Gauge<int> other_gauge(context, nullptr, "cpp_gauge_other", 7);
+	gauge = std::move(other_gauge);
+	assert(gauge.value() == 7);
+	assert(!procstat_lookup_item(context, nullptr, "cpp_gauge"));
+
+	counters.clear();
+	assert(!procstat_lookup_item(context, nullptr, "cpp_counter_1"));
+}
+
+int main(int argc, char **argv)
+{
+	context = procstat_create("/tmp/procstat_hpp");
+	assert(context);
+
+	test_create_and_remove();
+	test_duplicate_throws();
+	test_move();
+
+	procstat_destroy(context);
+	printf("DONE\n");
+	return 0;
+}